@@ -0,0 +1,951 @@
+/*
+    BookDBLite, a book database management solution using SQLite.
+    Copyright (C) 2015-2016  SilverNexus
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file bench.c
+ * Benchmarks the database layer against synthetic libraries.
+ * Results are written as JSON, so runs from different builds can be compared.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "db_access.h"
+
+// How many sample values are kept from each library to search for.
+#define BENCH_SAMPLES 256
+
+// Default library sizes, in books.
+static const int default_sizes[] = {10000, 100000, 1000000};
+
+static const char * const first_names[] = {
+    "James", "Mary", "John", "Patricia", "Robert", "Jennifer", "Michael", "Linda",
+    "William", "Elizabeth", "David", "Barbara", "Richard", "Susan", "Joseph", "Jessica",
+    "Thomas", "Sarah", "Charles", "Karen", "Christopher", "Nancy", "Daniel", "Lisa",
+    "Matthew", "Betty", "Anthony", "Margaret", "Mark", "Sandra", "Donald", "Ashley",
+    "Steven", "Kimberly", "Paul", "Emily", "Andrew", "Donna", "Joshua", "Michelle",
+    "Kenneth", "Dorothy", "Kevin", "Carol", "Brian", "Amanda", "George", "Melissa",
+    "Edward", "Deborah", "Ronald", "Stephanie", "Timothy", "Rebecca", "Jason", "Sharon",
+    "Jeffrey", "Laura", "Ryan", "Cynthia", "Jacob", "Kathleen", "Gary", "Amy"
+};
+
+static const char * const last_names[] = {
+    "Smith", "Johnson", "Williams", "Brown", "Jones", "Garcia", "Miller", "Davis",
+    "Rodriguez", "Martinez", "Hernandez", "Lopez", "Gonzalez", "Wilson", "Anderson", "Thomas",
+    "Taylor", "Moore", "Jackson", "Martin", "Lee", "Perez", "Thompson", "White",
+    "Harris", "Sanchez", "Clark", "Ramirez", "Lewis", "Robinson", "Walker", "Young",
+    "Allen", "King", "Wright", "Scott", "Torres", "Nguyen", "Hill", "Flores",
+    "Green", "Adams", "Nelson", "Baker", "Hall", "Rivera", "Campbell", "Mitchell",
+    "Carter", "Roberts", "Gomez", "Phillips", "Evans", "Turner", "Diaz", "Parker",
+    "Cruz", "Edwards", "Collins", "Reyes", "Stewart", "Morris", "Morales", "Murphy",
+    "Cook", "Rogers", "Gutierrez", "Ortiz", "Morgan", "Cooper", "Peterson", "Bailey",
+    "Reed", "Kelly", "Howard", "Ramos", "Kim", "Cox", "Ward", "Richardson",
+    "Watson", "Brooks", "Chavez", "Wood", "James", "Bennett", "Gray", "Mendoza",
+    "Ruiz", "Hughes", "Price", "Alvarez", "Castillo", "Sanders", "Patel", "Myers",
+    "Long", "Ross", "Foster", "Jimenez", "Powell", "Jenkins", "Perry", "Russell",
+    "Sullivan", "Bell", "Coleman", "Butler", "Henderson", "Barnes", "Gonzales", "Fisher",
+    "Vasquez", "Simmons", "Romero", "Jordan", "Patterson", "Alexander", "Hamilton", "Graham",
+    "Reynolds", "Griffin", "Wallace", "Moreno", "West", "Cole", "Hayes", "Bryant"
+};
+
+static const char * const middle_names[] = {
+    "A", "B", "C", "D", "E", "F", "G", "H", "J", "K", "L", "M", "N",
+    "P", "R", "S", "T", "W"
+};
+
+static const char * const genres[] = {
+    "Fiction", "Mystery", "Science Fiction", "Fantasy", "Romance", "Biography",
+    "History", "Thriller", "Horror", "Poetry", "Drama", "Humor",
+    "Science", "Mathematics", "Philosophy", "Religion", "Travel", "Cooking",
+    "Art", "Music", "Business", "Economics", "Politics", "Psychology",
+    "Self-Help", "Health", "Sports", "Nature", "Children", "Young Adult",
+    "Reference", "Computing"
+};
+
+static const char * const bindings[] = {"Paperback", "Hardcover", "Mass Market"};
+
+static const char * const title_words[] = {
+    "The", "Last", "Night", "Garden", "River", "Shadow", "House", "Winter",
+    "Secret", "Light", "Stone", "City", "Silent", "Road", "Dark", "Summer",
+    "Empire", "Song", "Fire", "Glass", "Memory", "Island", "Iron", "Storm",
+    "Kingdom", "Lost", "Ocean", "Letters", "Forest", "Crown", "Ashes", "Star",
+    "Journey", "Hidden", "Machine", "Tower", "Wild", "Broken", "Golden", "Time",
+    "Bridge", "Mountain", "Northern", "Daughter", "Stranger", "Mirror", "Dream", "War"
+};
+
+#define COUNT_OF(array) (sizeof(array) / sizeof((array)[0]))
+
+// The most distinct author names the generator can make.
+#define MAX_AUTHORS (COUNT_OF(first_names) * (COUNT_OF(middle_names) + 1) * COUNT_OF(last_names))
+
+// Number of people who own books in a library.
+#define OWNER_COUNT 50
+
+// A deterministic generator, so every run builds the same libraries.
+static unsigned long long rng_state;
+
+static unsigned long long next_random(){
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+/**
+ * Picks an index below n, uniformly.
+ */
+static size_t pick(size_t n){
+    return next_random() % n;
+}
+
+/**
+ * Picks an index below n, favoring low indices.
+ * Higher skew concentrates more of the picks at the front,
+ * the way a few authors and genres account for most of a library.
+ *
+ * @param n
+ * The number of choices.
+ *
+ * @param skew
+ * 1 is uniform. Each step above that squares the bias again.
+ */
+static size_t pick_skewed(size_t n, int skew){
+    double u = (next_random() >> 11) * (1.0 / 9007199254740992.0);
+    double p = u;
+    for (int i = 1; i < skew; ++i)
+	p *= u;
+    size_t idx = (size_t)(p * n);
+    return idx < n ? idx : n - 1;
+}
+
+/**
+ * Fills in the name of author number idx.
+ */
+static void author_name(size_t idx, name *author){
+    author->first = first_names[idx % COUNT_OF(first_names)];
+    idx /= COUNT_OF(first_names);
+    size_t middle = idx % (COUNT_OF(middle_names) + 1);
+    author->middle = middle ? middle_names[middle - 1] : 0;
+    idx /= COUNT_OF(middle_names) + 1;
+    author->last = last_names[idx % COUNT_OF(last_names)];
+    author->suffix = 0;
+}
+
+/**
+ * Fills in the name of owner number idx.
+ */
+static void owner_name(size_t idx, name *owner){
+    owner->first = first_names[(idx * 7) % COUNT_OF(first_names)];
+    owner->middle = 0;
+    owner->last = last_names[(idx * 13) % COUNT_OF(last_names)];
+    owner->suffix = 0;
+}
+
+// Values taken from a library to search for.
+typedef struct {
+    char title[BENCH_SAMPLES][128];
+    char isbn[BENCH_SAMPLES][16];
+    int count;
+} samples;
+
+// The library being built.
+typedef struct {
+    // Number of distinct authors to pick from.
+    size_t author_count;
+    // Number of books generated so far.
+    size_t made;
+    // Keep one sample every this many books.
+    size_t sample_every;
+    samples *keep;
+} library;
+
+/**
+ * Makes up a plausible book, allocating it from an arena.
+ *
+ * @param lib
+ * The library the book belongs to.
+ *
+ * @param pool
+ * Where the book and its strings are allocated.
+ *
+ * @return
+ * The book, or 0 if out of memory.
+ */
+static book *make_book(library *lib, arena *pool){
+    // Most books have one author and a genre or two.
+    int author_count = pick(100) < 80 ? 1 : (pick(4) < 3 ? 2 : 3);
+    int genre_count = 1 + (int)pick_skewed(3, 2);
+    book *b = arena_alloc(pool, sizeof(book) + sizeof(const char *) * (genre_count + 1));
+    name *authors = arena_alloc(pool, sizeof(name) * (author_count + 1));
+    char *title = arena_alloc(pool, 128);
+    char *isbn = arena_alloc(pool, 16);
+    if (!b || !authors || !title || !isbn)
+	return 0;
+    memset(b, 0, sizeof(book));
+
+    int words = 1 + (int)pick(4);
+    title[0] = '\0';
+    for (int i = 0; i < words; ++i){
+	if (i)
+	    strcat(title, " ");
+	strcat(title, title_words[pick_skewed(COUNT_OF(title_words), 2)]);
+    }
+    b->title = title;
+    b->subtitle = pick(5) == 0 ? "A Novel" : 0;
+
+    for (int i = 0; i < author_count; ++i)
+	author_name(pick_skewed(lib->author_count, 3), &authors[i]);
+    memset(&authors[author_count], 0, sizeof(name));
+    b->authors = authors;
+
+    for (int i = 0; i < genre_count; ++i)
+	b->genre[i] = genres[pick_skewed(COUNT_OF(genres), 2)];
+    b->genre[genre_count] = 0;
+
+    owner_name(pick_skewed(OWNER_COUNT, 2), &b->owner);
+    // Skewed toward recent years.
+    b->year = 2025 - (int)pick_skewed(120, 2);
+    b->edition_num = pick(10) == 0 ? 2 : 1;
+    b->quantity = 1;
+    b->binding_type = bindings[pick(100) < 55 ? 0 : (pick(4) < 3 ? 1 : 2)];
+
+    // A valid ISBN-13 in the 978 range.
+    int sum = 9 + 7 * 3 + 8;
+    memcpy(isbn, "978", 3);
+    for (int i = 3; i < 12; ++i){
+	int digit = (int)pick(10);
+	isbn[i] = '0' + digit;
+	sum += (i % 2) ? digit * 3 : digit;
+    }
+    isbn[12] = '0' + (10 - sum % 10) % 10;
+    isbn[13] = '\0';
+    b->ISBN = isbn;
+
+    if (lib->keep && lib->made % lib->sample_every == 0 && lib->keep->count < BENCH_SAMPLES){
+	strcpy(lib->keep->title[lib->keep->count], title);
+	strcpy(lib->keep->isbn[lib->keep->count], isbn);
+	++lib->keep->count;
+    }
+    ++lib->made;
+    return b;
+}
+
+// Latencies for one operation.
+typedef struct {
+    const char *label;
+    double *seconds;
+    int count;
+    int errors;
+    double total;
+} timing;
+
+static double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Gets a timing ready to record up to n runs.
+ *
+ * @return
+ * 0 on success, -1 if out of memory.
+ */
+static int timing_init(timing *t, const char *label, int n){
+    t->label = label;
+    t->seconds = malloc(sizeof(double) * (n > 0 ? n : 1));
+    t->count = 0;
+    t->errors = 0;
+    t->total = 0;
+    return t->seconds ? 0 : -1;
+}
+
+/**
+ * Records one run that started at the given time.
+ *
+ * @param ok
+ * Nonzero if the operation succeeded.
+ */
+static void timing_add(timing *t, double start, int ok){
+    double elapsed = now() - start;
+    t->seconds[t->count++] = elapsed;
+    t->total += elapsed;
+    if (!ok)
+	++t->errors;
+}
+
+/**
+ * Writes a timing as a JSON object and frees it.
+ * Latencies are in microseconds.
+ */
+static void timing_print(FILE *out, timing *t, const char *indent, int last){
+    qsort(t->seconds, t->count, sizeof(double), compare_doubles);
+    double p50 = t->count ? t->seconds[(t->count - 1) / 2] : 0;
+    double p99 = t->count ? t->seconds[(t->count - 1) * 99 / 100] : 0;
+    fprintf(out, "%s\"%s\": {\"count\": %d, \"errors\": %d, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+	"\"ops_per_sec\": %.1f}%s\n", indent, t->label, t->count, t->errors, p50 * 1e6, p99 * 1e6,
+	t->total > 0 ? t->count / t->total : 0.0, last ? "" : ",");
+    free(t->seconds);
+}
+
+/**
+ * Removes a database file and the WAL files that go with it.
+ */
+static void remove_db_files(const char * const path){
+    char extra[4096];
+    unlink(path);
+    snprintf(extra, sizeof(extra), "%s-wal", path);
+    unlink(extra);
+    snprintf(extra, sizeof(extra), "%s-shm", path);
+    unlink(extra);
+}
+
+/**
+ * Times new_db() on fresh, empty databases,
+ * and create_db_from_template() copying one of them.
+ *
+ * @return
+ * 0 on success, -1 if a database could not be made.
+ */
+static int bench_new_db(FILE *out, const char * const dir, int runs){
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/new.db", dir);
+    timing t;
+    if (timing_init(&t, "new_db", runs) != 0)
+	return -1;
+    for (int i = 0; i < runs; ++i){
+	remove_db_files(path);
+	sqlite3 *fresh;
+	if (sqlite3_open_v2(path, &fresh, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, 0) != SQLITE_OK){
+	    close_connection(fresh);
+	    free(t.seconds);
+	    return -1;
+	}
+	double start = now();
+	int res = new_db(fresh);
+	timing_add(&t, start, res == 0);
+	close_connection(fresh);
+    }
+    timing_print(out, &t, "  ", 0);
+
+    // The last database made is the template.
+    char copy[4096];
+    snprintf(copy, sizeof(copy), "%s/copy.db", dir);
+    if (timing_init(&t, "create_db_from_template", runs) != 0){
+	remove_db_files(path);
+	return -1;
+    }
+    for (int i = 0; i < runs; ++i){
+	remove_db_files(copy);
+	double start = now();
+	int res = create_db_from_template(copy, path, PROFILE_INTERACTIVE);
+	timing_add(&t, start, res == 0);
+	close_db();
+    }
+    remove_db_files(copy);
+    remove_db_files(path);
+    timing_print(out, &t, "  ", 0);
+    return 0;
+}
+
+/**
+ * Fills a new database with a synthetic library.
+ *
+ * @return
+ * 0 on success, -1 on failure.
+ */
+static int load_library(library *lib, int size, double *seconds){
+    const book **chunk = malloc(sizeof(book *) * ADD_BATCH_COMMIT_ROWS);
+    if (!chunk)
+	return -1;
+    double start = now();
+    for (int done = 0; done < size; ){
+	arena pool;
+	arena_init(&pool, 0, 0, ARENA_BLOCK_SIZE);
+	int count = size - done < ADD_BATCH_COMMIT_ROWS ? size - done : ADD_BATCH_COMMIT_ROWS;
+	for (int i = 0; i < count; ++i){
+	    if (!(chunk[i] = make_book(lib, &pool))){
+		arena_free(&pool);
+		free(chunk);
+		return -1;
+	    }
+	}
+	int res = add_batch(db, chunk, count);
+	arena_free(&pool);
+	if (res != count){
+	    free(chunk);
+	    return -1;
+	}
+	done += count;
+    }
+    *seconds = now() - start;
+    free(chunk);
+    return 0;
+}
+
+/**
+ * Times searches on one field.
+ *
+ * @param text
+ * Makes the search text for run i.
+ */
+static void bench_search(FILE *out, const char *label, fields field, int runs,
+	void (*text)(library *, int, char *, size_t), library *lib, int last){
+    timing t;
+    if (timing_init(&t, label, runs) != 0)
+	return;
+    char buf[256];
+    for (int i = 0; i < runs; ++i){
+	// search() may split the text in place, so each run gets a fresh copy.
+	text(lib, i, buf, sizeof(buf));
+	double start = now();
+	int res = search(db, field, buf);
+	timing_add(&t, start, res >= 0);
+    }
+    timing_print(out, &t, "        ", last);
+}
+
+static void title_text(library *lib, int i, char *buf, size_t len){
+    snprintf(buf, len, "%s", lib->keep->title[i % lib->keep->count]);
+}
+
+static void author_text(library *lib, int i, char *buf, size_t len){
+    (void)i;
+    name author;
+    author_name(pick_skewed(lib->author_count, 3), &author);
+    if (author.middle)
+	snprintf(buf, len, "%s %s %s", author.first, author.middle, author.last);
+    else
+	snprintf(buf, len, "%s %s", author.first, author.last);
+}
+
+static void owner_text(library *lib, int i, char *buf, size_t len){
+    (void)lib;
+    name owner;
+    owner_name(i % OWNER_COUNT, &owner);
+    snprintf(buf, len, "%s %s", owner.first, owner.last);
+}
+
+static void binding_text(library *lib, int i, char *buf, size_t len){
+    (void)lib;
+    snprintf(buf, len, "%s", bindings[i % COUNT_OF(bindings)]);
+}
+
+static void year_text(library *lib, int i, char *buf, size_t len){
+    (void)lib;
+    snprintf(buf, len, "%d", 2025 - (int)pick_skewed(120, 2));
+    (void)i;
+}
+
+static void isbn_text(library *lib, int i, char *buf, size_t len){
+    snprintf(buf, len, "%s", lib->keep->isbn[i % lib->keep->count]);
+}
+
+static void genre_text(library *lib, int i, char *buf, size_t len){
+    (void)lib;
+    snprintf(buf, len, "%s", genres[i % COUNT_OF(genres)]);
+}
+
+static void any_text(library *lib, int i, char *buf, size_t len){
+    (void)lib;
+    snprintf(buf, len, "%s %s", title_words[i % COUNT_OF(title_words)],
+	last_names[(i * 7) % COUNT_OF(last_names)]);
+}
+
+/**
+ * Times searches combining a binding, a range of years and an owner,
+ * which search_open_terms() answers with one query.
+ */
+static void bench_compound(FILE *out, int runs, library *lib){
+    timing t;
+    if (timing_init(&t, "compound", runs) != 0)
+	return;
+    char owner[256];
+    for (int i = 0; i < runs; ++i){
+	owner_text(lib, i, owner, sizeof(owner));
+	int low = 2025 - (int)pick_skewed(120, 2);
+	const search_term terms[] = {
+	    {FIELD_BINDING, MATCH_EQUAL, bindings[i % COUNT_OF(bindings)], 0, 0},
+	    {FIELD_YEAR, MATCH_RANGE, 0, low, low + 10},
+	    {FIELD_OWNER, MATCH_EQUAL, owner, 0, 0}
+	};
+	double start = now();
+	search_cursor *cursor = search_open_terms(db, terms, 3, 0);
+	book *row = malloc(sizeof(book) + sizeof(const char *) * 2);
+	int res = cursor && row ? 1 : -1;
+	while (res == 1)
+	    res = search_next(cursor, row, 2);
+	free(row);
+	search_close(cursor);
+	timing_add(&t, start, res == 0);
+    }
+    timing_print(out, &t, "        ", 1);
+}
+
+// The most threads to search with at once. 0 means one per core.
+static int max_threads = 0;
+
+// One thread's share of the concurrent searches.
+typedef struct {
+    db_pool *pool;
+    library *lib;
+    int runs;
+    int errors;
+} search_worker;
+
+/**
+ * Runs a mix of searches on the thread's own pool connection.
+ * Only text functions that do not use the shared generator are used.
+ */
+static void *search_thread(void *data){
+    search_worker *worker = data;
+    sqlite3 *conn = pool_reader(worker->pool);
+    if (!conn){
+	worker->errors = worker->runs;
+	return 0;
+    }
+    char buf[256];
+    for (int i = 0; i < worker->runs; ++i){
+	int res;
+	switch (i % 4){
+	    case 0:
+		title_text(worker->lib, i, buf, sizeof(buf));
+		res = search(conn, FIELD_TITLE, buf);
+		break;
+	    case 1:
+		isbn_text(worker->lib, i, buf, sizeof(buf));
+		res = search(conn, FIELD_ISBN, buf);
+		break;
+	    case 2:
+		owner_text(worker->lib, i, buf, sizeof(buf));
+		res = search(conn, FIELD_OWNER, buf);
+		break;
+	    default:
+		any_text(worker->lib, i, buf, sizeof(buf));
+		res = search(conn, FIELD_ANY, buf);
+		break;
+	}
+	if (res < 0)
+	    ++worker->errors;
+    }
+    return 0;
+}
+
+/**
+ * Times the same mix of searches spread over more and more threads,
+ * each with its own read-only connection from a pool.
+ *
+ * @return
+ * 0 on success, -1 if the pool could not be opened.
+ */
+static int bench_concurrent(FILE *out, const char * const path, library *lib, int runs){
+    db_pool *pool = pool_open(path);
+    if (!pool)
+	return -1;
+    long cores = max_threads > 0 ? max_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1)
+	cores = 1;
+    pthread_t threads[64];
+    search_worker workers[64];
+    fprintf(out, "      \"concurrent_search\": [\n");
+    for (int count = 1; ; count *= 2){
+	if (count > cores)
+	    count = cores;
+	if (count > 64)
+	    count = 64;
+	double start = now();
+	int started = 0;
+	for (; started < count; ++started){
+	    workers[started] = (search_worker){pool, lib, runs, 0};
+	    if (pthread_create(&threads[started], 0, search_thread, &workers[started]) != 0)
+		break;
+	}
+	int errors = 0;
+	for (int i = 0; i < started; ++i){
+	    pthread_join(threads[i], 0);
+	    errors += workers[i].errors;
+	}
+	double seconds = now() - start;
+	int last = count >= cores || count >= 64;
+	fprintf(out, "        {\"threads\": %d, \"searches\": %d, \"errors\": %d, \"ops_per_sec\": %.1f}%s\n",
+	    started, started * runs, errors, seconds > 0 ? started * runs / seconds : 0.0, last ? "" : ",");
+	if (last)
+	    break;
+    }
+    fprintf(out, "      ],\n");
+    pool_close(pool);
+    return 0;
+}
+
+// Books shown for each keystroke by bench_prefix().
+#define PREFIX_PAGE 20
+
+/**
+ * Builds a prefix index, then types sample titles into a prefix_query a
+ * keystroke at a time, reading the first page of books after each.
+ *
+ * @return
+ * 0 on success, -1 on failure.
+ */
+static int bench_prefix(FILE *out, library *lib, int runs){
+    double start = now();
+    prefix_index *index = prefix_index_build(db);
+    double build = now() - start;
+    timing t;
+    if (!index || timing_init(&t, "keystroke", runs * 64) != 0){
+	prefix_index_free(index);
+	return -1;
+    }
+    arena pool;
+    char title[256];
+    for (int i = 0; i < runs; ++i){
+	title_text(lib, i, title, sizeof(title));
+	size_t len = strlen(title);
+	if (len > 64)
+	    len = 64;
+	prefix_query query;
+	prefix_query_init(&query, index);
+	for (size_t typed = 1; typed <= len; ++typed){
+	    char saved = title[typed];
+	    title[typed] = '\0';
+	    double key_start = now();
+	    prefix_query_set(&query, title);
+	    search_cursor *cursor = prefix_query_open(&query, db, PREFIX_PAGE);
+	    arena_init(&pool, 0, 0, 0);
+	    size_t count;
+	    int ok = cursor && search_collect(cursor, &pool, PREFIX_PAGE, &count) != 0;
+	    search_close(cursor);
+	    arena_free(&pool);
+	    timing_add(&t, key_start, ok);
+	    title[typed] = saved;
+	}
+    }
+    fprintf(out, "      \"prefix\": {\"build_seconds\": %.3f,\n", build);
+    timing_print(out, &t, "        ", 1);
+    fprintf(out, "      },\n");
+    prefix_index_free(index);
+    return 0;
+}
+
+// Titles typed into the search box by bench_worker().
+#define WORKER_TITLES 10
+
+// Time between keystrokes and the search debounce time, in milliseconds.
+#define WORKER_KEY_MS 20
+#define WORKER_DEBOUNCE_MS 50
+
+// Replies from the worker, which answers on its own thread here.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t answered;
+    int replies;
+    int results;
+    int cancelled;
+    int errors;
+    // When the last reply came.
+    double last_reply;
+} worker_replies;
+
+static void count_reply(const db_reply *reply, void *data){
+    worker_replies *replies = data;
+    pthread_mutex_lock(&replies->lock);
+    ++replies->replies;
+    if (reply->cancelled)
+	++replies->cancelled;
+    else if (reply->status != 0)
+	++replies->errors;
+    else
+	++replies->results;
+    replies->last_reply = now();
+    pthread_cond_signal(&replies->answered);
+    pthread_mutex_unlock(&replies->lock);
+}
+
+/**
+ * Types titles into a search one keystroke at a time, through a db_worker,
+ * as the search screen would. Times how long each keystroke holds up the
+ * typing thread, and how long after the last keystroke the results come.
+ *
+ * @return
+ * 0 on success, -1 if the worker could not be started.
+ */
+static int bench_worker(FILE *out, const char * const path, library *lib){
+    worker_replies replies = {.replies = 0};
+    pthread_mutex_init(&replies.lock, 0);
+    pthread_cond_init(&replies.answered, 0);
+    db_worker *worker = db_worker_start(0, 0);
+    timing calls, latency;
+    if (!worker || timing_init(&calls, "search_call", WORKER_TITLES * 64) != 0){
+	db_worker_stop(worker);
+	return -1;
+    }
+    if (timing_init(&latency, "typed_to_results", WORKER_TITLES) != 0){
+	free(calls.seconds);
+	db_worker_stop(worker);
+	return -1;
+    }
+    db_worker_open(worker, path, PROFILE_INTERACTIVE, 0, 0, 0);
+    int asked = 0;
+    char title[256];
+    struct timespec key = {0, WORKER_KEY_MS * 1000000L};
+    for (int i = 0; i < WORKER_TITLES; ++i){
+	title_text(lib, i * 7, title, sizeof(title));
+	size_t len = strlen(title);
+	if (len > 63)
+	    len = 63;
+	double typed = 0;
+	for (size_t typed_len = 1; typed_len <= len; ++typed_len){
+	    char prefix[64];
+	    memcpy(prefix, title, typed_len);
+	    prefix[typed_len] = '\0';
+	    search_term term = {FIELD_TITLE, MATCH_PREFIX, prefix, 0, 0};
+	    typed = now();
+	    int res = db_worker_search(worker, &term, 1, 50, WORKER_DEBOUNCE_MS, count_reply, &replies);
+	    timing_add(&calls, typed, res == 0);
+	    if (res == 0)
+		++asked;
+	    nanosleep(&key, 0);
+	}
+	pthread_mutex_lock(&replies.lock);
+	while (replies.replies < asked)
+	    pthread_cond_wait(&replies.answered, &replies.lock);
+	double answered = replies.last_reply;
+	pthread_mutex_unlock(&replies.lock);
+	latency.seconds[latency.count++] = answered - typed;
+	latency.total += answered - typed;
+    }
+    db_worker_stop(worker);
+    fprintf(out, "      \"worker\": {\"searches\": %d, \"results\": %d, \"cancelled\": %d, \"errors\": %d,\n",
+	asked, replies.results, replies.cancelled, replies.errors);
+    timing_print(out, &calls, "        ", 0);
+    timing_print(out, &latency, "        ", 1);
+    fprintf(out, "      },\n");
+    pthread_mutex_destroy(&replies.lock);
+    pthread_cond_destroy(&replies.answered);
+    return 0;
+}
+
+/**
+ * Builds a library of the given size and times every operation against it.
+ *
+ * @return
+ * 0 on success, -1 on failure.
+ */
+static int bench_library(FILE *out, const char * const dir, int size, int runs, int last){
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/library-%d.db", dir, size);
+    remove_db_files(path);
+    samples *keep = calloc(1, sizeof(samples));
+    if (!keep)
+	return -1;
+    library lib = {0};
+    lib.author_count = size / 4 < 100 ? 100 : ((size_t)size / 4 > MAX_AUTHORS ? MAX_AUTHORS : (size_t)size / 4);
+    lib.sample_every = size / BENCH_SAMPLES > 0 ? size / BENCH_SAMPLES : 1;
+    lib.keep = keep;
+    rng_state = 0x9E3779B97F4A7C15ULL ^ (unsigned long long)size;
+
+    fprintf(stderr, "Building a library of %d books...\n", size);
+    double load_seconds;
+    if (create_db(path, PROFILE_BULK_LOAD) != 0 || load_library(&lib, size, &load_seconds) != 0){
+	close_db();
+	free(keep);
+	return -1;
+    }
+    close_db();
+
+    fprintf(out, "    {\n      \"books\": %d,\n", size);
+    fprintf(out, "      \"load\": {\"seconds\": %.3f, \"rows_per_sec\": %.1f},\n",
+	load_seconds, load_seconds > 0 ? size / load_seconds : 0.0);
+
+    fprintf(stderr, "Timing open_db()...\n");
+    timing t;
+    if (timing_init(&t, "open_db", runs) != 0){
+	free(keep);
+	return -1;
+    }
+    for (int i = 0; i < runs; ++i){
+	double start = now();
+	int res = open_db(path, PROFILE_INTERACTIVE);
+	timing_add(&t, start, res == 0);
+	close_db();
+    }
+    timing_print(out, &t, "      ", 0);
+
+    if (open_db(path, PROFILE_INTERACTIVE) != 0){
+	free(keep);
+	return -1;
+    }
+
+    fprintf(stderr, "Timing add() and remove_book()...\n");
+    arena pool;
+    arena_init(&pool, 0, 0, ARENA_BLOCK_SIZE);
+    book **added = arena_alloc(&pool, sizeof(book *) * runs);
+    timing adds, removes;
+    if (!added || timing_init(&adds, "add", runs) != 0){
+	arena_free(&pool);
+	free(keep);
+	return -1;
+    }
+    if (timing_init(&removes, "remove_book", runs) != 0){
+	free(adds.seconds);
+	arena_free(&pool);
+	free(keep);
+	return -1;
+    }
+    for (int i = 0; i < runs; ++i){
+	added[i] = make_book(&lib, &pool);
+	double start = now();
+	int res = added[i] ? add(db, added[i]) : -1;
+	timing_add(&adds, start, res == 0);
+    }
+    for (int i = 0; i < runs; ++i){
+	double start = now();
+	int res = added[i] ? remove_book(db, added[i]) : -1;
+	timing_add(&removes, start, res == 0);
+    }
+    arena_free(&pool);
+    timing_print(out, &adds, "      ", 0);
+    timing_print(out, &removes, "      ", 0);
+
+    fprintf(stderr, "Timing search()...\n");
+    fprintf(out, "      \"search\": {\n");
+    bench_search(out, "title", FIELD_TITLE, runs, title_text, &lib, 0);
+    bench_search(out, "author", FIELD_AUTHOR, runs, author_text, &lib, 0);
+    bench_search(out, "owner", FIELD_OWNER, runs, owner_text, &lib, 0);
+    bench_search(out, "binding", FIELD_BINDING, runs, binding_text, &lib, 0);
+    bench_search(out, "year", FIELD_YEAR, runs, year_text, &lib, 0);
+    bench_search(out, "isbn", FIELD_ISBN, runs, isbn_text, &lib, 0);
+    bench_search(out, "genre", FIELD_GENRE, runs, genre_text, &lib, 0);
+    bench_search(out, "any", FIELD_ANY, runs, any_text, &lib, 0);
+    bench_compound(out, runs, &lib);
+    fprintf(out, "      },\n");
+
+    fprintf(stderr, "Timing concurrent searches...\n");
+    if (bench_concurrent(out, path, &lib, runs) != 0){
+	close_db();
+	free(keep);
+	return -1;
+    }
+
+    fprintf(stderr, "Timing prefix searches...\n");
+    if (bench_prefix(out, &lib, runs) != 0){
+	close_db();
+	free(keep);
+	return -1;
+    }
+
+    fprintf(stderr, "Timing searches as they are typed...\n");
+    if (bench_worker(out, path, &lib) != 0){
+	close_db();
+	free(keep);
+	return -1;
+    }
+
+    unsigned long hits, misses, entries;
+    stmt_cache_stats(db, &hits, &misses);
+    fprintf(out, "      \"stmt_cache\": {\"hits\": %lu, \"misses\": %lu},\n", hits, misses);
+    id_cache_stats(db, &hits, &misses, &entries);
+    fprintf(out, "      \"id_cache\": {\"hits\": %lu, \"misses\": %lu, \"entries\": %lu}\n",
+	hits, misses, entries);
+    fprintf(out, "    }%s\n", last ? "" : ",");
+    close_db();
+    remove_db_files(path);
+    free(keep);
+    return 0;
+}
+
+static void print_help(){
+    puts("Usage: book-db-bench [--runs <n>] [--threads <n>] [--dir <directory>] [--output <file>] [size ...]\n"
+	"Sizes are in books. The default is 10000 100000 1000000.\n"
+	"Concurrent searches use up to one thread per core, unless --threads says otherwise.");
+    exit(0);
+}
+
+int main(int argc, const char * const *argv){
+    int runs = 200;
+    const char *parent = getenv("TMPDIR");
+    const char *output = 0;
+    int sizes[16];
+    int size_count = 0;
+    for (int i = 1; i < argc; ++i){
+	if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc)
+	    runs = atoi(argv[++i]);
+	else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+	    max_threads = atoi(argv[++i]);
+	else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc)
+	    parent = argv[++i];
+	else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+	    output = argv[++i];
+	else if (argv[i][0] != '-' && size_count < (int)COUNT_OF(sizes) && atoi(argv[i]) > 0)
+	    sizes[size_count++] = atoi(argv[i]);
+	else
+	    print_help();
+    }
+    if (runs <= 0)
+	print_help();
+    if (size_count == 0){
+	for (size_t i = 0; i < COUNT_OF(default_sizes); ++i)
+	    sizes[size_count++] = default_sizes[i];
+    }
+
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s/book-db-bench-XXXXXX", parent ? parent : "/tmp");
+    if (!mkdtemp(dir)){
+	perror("mkdtemp");
+	return 1;
+    }
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (!out){
+	perror(output);
+	rmdir(dir);
+	return 1;
+    }
+
+    int status = 0;
+    fprintf(out, "{\n  \"sqlite_version\": \"%s\",\n  \"runs\": %d,\n", sqlite3_libversion(), runs);
+    if (bench_new_db(out, dir, runs) != 0){
+	fputs("new_db() benchmark failed!\n", stderr);
+	status = 1;
+    }
+    fprintf(out, "  \"libraries\": [\n");
+    for (int i = 0; i < size_count && status == 0; ++i){
+	if (bench_library(out, dir, sizes[i], runs, i == size_count - 1) != 0){
+	    fprintf(stderr, "Benchmark of %d books failed!\n", sizes[i]);
+	    status = 1;
+	}
+    }
+    unsigned long blocks, bytes;
+    arena_stats(&blocks, &bytes);
+    fprintf(out, "  ],\n  \"arena\": {\"blocks\": %lu, \"bytes\": %lu}\n}\n", blocks, bytes);
+    if (output)
+	fclose(out);
+    rmdir(dir);
+    return status;
+}
@@ -0,0 +1,157 @@
+/*
+    BookDBLite, a book database management solution using SQLite.
+    Copyright (C) 2015-2016  SilverNexus
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file arena.c
+ * Hands out memory from large blocks, so that many small allocations
+ * cost only a few calls to malloc() and are freed with one call.
+ */
+
+#include "arena.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct arena_block {
+    arena_block *next;
+    // Keeps the data after the header suitably aligned.
+    max_align_t data[];
+};
+
+// Running totals of heap blocks allocated by all arenas, on any thread.
+static atomic_ulong blocks_allocated = 0;
+static atomic_ulong bytes_allocated = 0;
+
+/**
+ * Rounds a size up to the alignment every allocation gets.
+ */
+static size_t align_size(size_t size){
+    return (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+}
+
+/**
+ * Sets up an arena.
+ *
+ * @param pool
+ * The arena to set up.
+ *
+ * @param buffer
+ * Memory to hand out before going to the heap, such as a stack buffer.
+ * May be 0. It must outlive the arena, and is not freed by arena_free().
+ *
+ * @param size
+ * The size of buffer.
+ *
+ * @param block_size
+ * Size of each heap block, or 0 for ARENA_BLOCK_SIZE.
+ */
+void arena_init(arena *pool, void *buffer, size_t size, size_t block_size){
+    pool->blocks = 0;
+    pool->pos = buffer;
+    pool->end = buffer ? (char *)buffer + size : 0;
+    pool->block_size = block_size ? block_size : ARENA_BLOCK_SIZE;
+}
+
+/**
+ * Allocates memory from an arena.
+ *
+ * @param pool
+ * The arena to allocate from.
+ *
+ * @param size
+ * The number of bytes needed.
+ *
+ * @return
+ * Memory aligned for any type, or 0 if out of memory.
+ * It stays valid until arena_free() is called on the arena.
+ */
+void *arena_alloc(arena *pool, size_t size){
+    size = align_size(size ? size : 1);
+    // The caller's buffer may not be aligned, so align the position first.
+    if (pool->pos){
+	size_t misalign = (size_t)pool->pos & (sizeof(max_align_t) - 1);
+	if (misalign)
+	    pool->pos += sizeof(max_align_t) - misalign;
+    }
+    if (!pool->pos || pool->pos > pool->end || (size_t)(pool->end - pool->pos) < size){
+	size_t data_size = size > pool->block_size ? size : pool->block_size;
+	arena_block *block = malloc(sizeof(arena_block) + data_size);
+	if (!block)
+	    return 0;
+	atomic_fetch_add_explicit(&blocks_allocated, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&bytes_allocated, sizeof(arena_block) + data_size, memory_order_relaxed);
+	block->next = pool->blocks;
+	pool->blocks = block;
+	// An oversized request takes the whole block, so keep using the old space if it had more left.
+	char *data = (char *)block->data;
+	if (data_size > pool->block_size && pool->pos && pool->pos <= pool->end)
+	    return data;
+	pool->pos = data;
+	pool->end = data + data_size;
+    }
+    void *mem = pool->pos;
+    pool->pos += size;
+    return mem;
+}
+
+/**
+ * Copies a string into an arena.
+ *
+ * @return
+ * The copy, or 0 if str is 0 or out of memory.
+ */
+char *arena_strdup(arena *pool, const char *str){
+    if (!str)
+	return 0;
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(pool, len);
+    if (copy)
+	memcpy(copy, str, len);
+    return copy;
+}
+
+/**
+ * Frees everything allocated from an arena.
+ * The arena is left empty, and must be set up with arena_init() before reuse.
+ */
+void arena_free(arena *pool){
+    arena_block *block = pool->blocks;
+    while (block){
+	arena_block *next = block->next;
+	free(block);
+	block = next;
+    }
+    pool->blocks = 0;
+    pool->pos = 0;
+    pool->end = 0;
+}
+
+/**
+ * Reports how many heap blocks all arenas have allocated so far.
+ *
+ * @param blocks
+ * Where to store the number of calls to malloc() arenas have made.
+ *
+ * @param bytes
+ * Where to store the number of bytes those calls asked for.
+ */
+void arena_stats(unsigned long *blocks, unsigned long *bytes){
+    *blocks = atomic_load_explicit(&blocks_allocated, memory_order_relaxed);
+    *bytes = atomic_load_explicit(&bytes_allocated, memory_order_relaxed);
+}
@@ -0,0 +1,37 @@
+/**
+ * @file arena.h
+ * Defines a simple arena allocator, for data that is all freed at once.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// A block of heap memory owned by an arena. Defined in arena.c.
+typedef struct arena_block arena_block;
+
+typedef struct {
+    // Heap blocks, newest first.
+    arena_block *blocks;
+    // The free space in the current block.
+    char *pos;
+    char *end;
+    // Size of each heap block. Larger requests get a block of their own.
+    size_t block_size;
+} arena;
+
+// Default heap block size.
+#define ARENA_BLOCK_SIZE 65536
+
+void arena_init(arena *pool, void *buffer, size_t size, size_t block_size);
+
+void *arena_alloc(arena *pool, size_t size);
+
+char *arena_strdup(arena *pool, const char *str);
+
+void arena_free(arena *pool);
+
+void arena_stats(unsigned long *blocks, unsigned long *bytes);
+
+#endif
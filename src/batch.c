@@ -0,0 +1,359 @@
+/*
+    BookDBLite, a book database management solution using SQLite.
+    Copyright (C) 2015-2016  SilverNexus
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file batch.c
+ * Runs a stream of commands against one open database, for scripts.
+ * The command layout is described in doc/Batch_Format.
+ *
+ * Every command shares the connection and its cached statements, and changes
+ * are committed in large transactions, so a long command file costs about
+ * as much as an import of the same size. Each command gets one line of JSON
+ * back, written as soon as it has run.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "book.h"
+#include "db_access.h"
+
+// The names of the fields a search command can look in, by fields value.
+static const char * const field_names[] = {
+    0, "title", "author", "owner", "binding", "year", "isbn", "genre", "any"
+};
+
+/**
+ * Looks up a search field by name.
+ *
+ * @return
+ * The field, or 0 if there is no field by that name.
+ */
+static fields find_field(const char * const name){
+    for (size_t i = FIELD_TITLE; i < sizeof(field_names) / sizeof(field_names[0]); ++i){
+	if (strcmp(field_names[i], name) == 0)
+	    return (fields)i;
+    }
+    return 0;
+}
+
+/**
+ * Writes a string as a JSON value, or null if there is no string.
+ * Also used by db_stats().
+ *
+ * @param out
+ * Where to write the value.
+ *
+ * @param text
+ * The string. May be 0.
+ */
+void write_json_string(FILE *out, const char *text){
+    if (!text){
+	fputs("null", out);
+	return;
+    }
+    putc('"', out);
+    for (const unsigned char *c = (const unsigned char *)text; *c; ++c){
+	switch (*c){
+	    case '"':
+		fputs("\\\"", out);
+		break;
+	    case '\\':
+		fputs("\\\\", out);
+		break;
+	    case '\n':
+		fputs("\\n", out);
+		break;
+	    case '\r':
+		fputs("\\r", out);
+		break;
+	    case '\t':
+		fputs("\\t", out);
+		break;
+	    default:
+		if (*c < 0x20)
+		    fprintf(out, "\\u%04x", *c);
+		else
+		    putc(*c, out);
+	}
+    }
+    putc('"', out);
+}
+
+/**
+ * Writes a name as a JSON object.
+ */
+static void write_name(FILE *out, const name * const person){
+    fputs("{\"last\":", out);
+    write_json_string(out, person->last);
+    fputs(",\"first\":", out);
+    write_json_string(out, person->first);
+    fputs(",\"middle\":", out);
+    write_json_string(out, person->middle);
+    fputs(",\"suffix\":", out);
+    write_json_string(out, person->suffix);
+    putc('}', out);
+}
+
+/**
+ * Writes a search result as a JSON object.
+ */
+static void write_book(FILE *out, const book * const result){
+    fputs("{\"title\":", out);
+    write_json_string(out, result->title);
+    fputs(",\"subtitle\":", out);
+    write_json_string(out, result->subtitle);
+    fputs(",\"authors\":[", out);
+    for (int i = 0; result->authors && result->authors[i].last; ++i){
+	if (i)
+	    putc(',', out);
+	write_name(out, &result->authors[i]);
+    }
+    fputs("],\"owner\":", out);
+    write_name(out, &result->owner);
+    fprintf(out, ",\"year\":%d,\"edition\":%d,\"quantity\":%d,\"isbn\":", result->year,
+	result->edition_num, result->quantity);
+    write_json_string(out, result->ISBN);
+    fputs(",\"binding\":", out);
+    write_json_string(out, result->binding_type);
+    fputs(",\"genres\":[", out);
+    for (int i = 0; result->genre[i]; ++i){
+	if (i)
+	    putc(',', out);
+	write_json_string(out, result->genre[i]);
+    }
+    fputs("]}", out);
+}
+
+/**
+ * Writes the reply to a command that failed.
+ */
+static void write_error(FILE *out, long line, const char * const command, const char * const message){
+    fprintf(out, "{\"line\":%ld,\"command\":", line);
+    write_json_string(out, command);
+    fputs(",\"ok\":false,\"error\":", out);
+    write_json_string(out, message);
+    fputs("}\n", out);
+}
+
+/**
+ * Reports a commit that failed, and the lines whose changes it took back.
+ * Those lines were already answered as done, so this reply names them.
+ */
+static void write_commit_error(FILE *out, long first, long last, const char * const message){
+    fprintf(out, "{\"line\":%ld,\"command\":\"commit\",\"ok\":false,\"error\":", last);
+    write_json_string(out, message);
+    fprintf(out, ",\"rolled_back\":{\"first\":%ld,\"last\":%ld}}\n", first, last);
+}
+
+/**
+ * Splits the next tab-separated argument off a command, in place.
+ *
+ * @return
+ * The argument, or 0 if there are no more.
+ */
+static char *next_arg(char **pos){
+    char *arg = *pos;
+    if (!arg)
+	return 0;
+    char *tab = strchr(arg, '\t');
+    if (tab)
+	*tab++ = '\0';
+    *pos = tab;
+    return arg;
+}
+
+/**
+ * Runs a search command, writing each result as it is read.
+ *
+ * @param args
+ * Pairs of field name and text, separated by tabs. It is modified.
+ *
+ * @retval 0
+ * The search ran.
+ *
+ * @retval -1
+ * The search failed. message says why.
+ */
+static int run_search(sqlite3 *db, char *args, long line, FILE *out, const char **message){
+    search_term terms[SEARCH_MAX_TERMS];
+    int count = 0;
+    char *field_name;
+    while ((field_name = next_arg(&args))){
+	char *text = next_arg(&args);
+	if (count == SEARCH_MAX_TERMS){
+	    *message = "too many search terms";
+	    return -1;
+	}
+	if (!text){
+	    *message = "search field without text";
+	    return -1;
+	}
+	search_term *term = &terms[count++];
+	memset(term, 0, sizeof(*term));
+	if (!(term->field = find_field(field_name))){
+	    *message = "unknown search field";
+	    return -1;
+	}
+	term->match = MATCH_EQUAL;
+	term->text = text;
+	size_t len = strlen(text);
+	// A trailing * asks for a prefix match, and two years with a dash for a range.
+	if ((term->field == FIELD_TITLE || term->field == FIELD_ISBN) && len && text[len - 1] == '*'){
+	    text[len - 1] = '\0';
+	    term->match = MATCH_PREFIX;
+	}
+	else if (term->field == FIELD_YEAR && sscanf(text, "%d-%d", &term->low, &term->high) == 2)
+	    term->match = MATCH_RANGE;
+    }
+    if (!count){
+	*message = "search without a field";
+	return -1;
+    }
+    search_cursor *cursor = search_open_terms(db, terms, count, 0);
+    if (!cursor){
+	*message = sqlite3_errmsg(db);
+	return -1;
+    }
+    book *result = malloc(sizeof(book) + sizeof(const char *) * (SEARCH_MAX_GENRES + 1));
+    if (!result){
+	search_close(cursor);
+	*message = "out of memory";
+	return -1;
+    }
+    fprintf(out, "{\"line\":%ld,\"command\":\"search\",\"ok\":true,\"results\":[", line);
+    int found = 0;
+    int res;
+    while ((res = search_next(cursor, result, SEARCH_MAX_GENRES + 1)) == 1){
+	if (found++)
+	    putc(',', out);
+	write_book(out, result);
+    }
+    fprintf(out, "],\"count\":%d", found);
+    // The reply is already under way, so a failure part way through is noted in it.
+    if (res < 0){
+	fputs(",\"complete\":false,\"error\":", out);
+	write_json_string(out, sqlite3_errmsg(db));
+    }
+    fputs("}\n", out);
+    free(result);
+    search_close(cursor);
+    return 0;
+}
+
+/**
+ * Runs commands from a stream, one per line, writing one line of JSON for each.
+ * Changes are committed every ADD_BATCH_COMMIT_ROWS changes and at the end,
+ * and searches see the changes made before them. If a commit fails, a reply
+ * naming the lines rolled back is written, and no more commands are read.
+ *
+ * @param db
+ * The database to run the commands against.
+ *
+ * @param in
+ * The commands to run.
+ *
+ * @param out
+ * Where to write the replies.
+ *
+ * @return
+ * The number of commands that failed, or -1 if changes could not be committed.
+ */
+int run_batch(sqlite3 *db, FILE *in, FILE *out){
+    char *line = 0;
+    size_t line_size = 0;
+    ssize_t len;
+    long line_num = 0;
+    int failed = 0;
+    int pending = 0;
+    // The line of the first change not yet committed.
+    long first_pending = 0;
+    int res = 0;
+    // Room for a book from an add or remove command.
+    book *info = malloc(IMPORT_BOOK_SIZE);
+    name *authors = malloc(sizeof(name) * (IMPORT_MAX_AUTHORS + 1));
+    if (!info || !authors){
+	free(info);
+	free(authors);
+	return -1;
+    }
+    while ((len = getline(&line, &line_size, in)) >= 0){
+	++line_num;
+	while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+	    line[--len] = '\0';
+	if (!len || line[0] == '#')
+	    continue;
+	char *args = line;
+	char *command = next_arg(&args);
+	const char *message = 0;
+	if (strcmp(command, "search") == 0){
+	    if (run_search(db, args, line_num, out, &message) != 0){
+		write_error(out, line_num, command, message);
+		++failed;
+	    }
+	    continue;
+	}
+	int is_add = strcmp(command, "add") == 0;
+	if (!is_add && strcmp(command, "remove") != 0){
+	    write_error(out, line_num, command, "unknown command");
+	    ++failed;
+	    continue;
+	}
+	if (!args || parse_book_record(args, len - (args - line), '\t', info, authors) != 0){
+	    write_error(out, line_num, command, "missing book fields");
+	    ++failed;
+	    continue;
+	}
+	if (sqlite3_get_autocommit(db)){
+	    if (sqlite3_exec(db, "BEGIN", 0, 0, 0) != SQLITE_OK){
+		write_error(out, line_num, command, sqlite3_errmsg(db));
+		++failed;
+		continue;
+	    }
+	    first_pending = line_num;
+	}
+	if ((is_add ? add(db, info) : remove_book(db, info)) != 0){
+	    write_error(out, line_num, command, is_add ? "could not add the book" : "could not remove the book");
+	    ++failed;
+	}
+	else
+	    fprintf(out, "{\"line\":%ld,\"command\":\"%s\",\"ok\":true}\n", line_num, command);
+	if (++pending >= ADD_BATCH_COMMIT_ROWS){
+	    pending = 0;
+	    if (!sqlite3_get_autocommit(db) && sqlite3_exec(db, "COMMIT", 0, 0, 0) != SQLITE_OK){
+		write_commit_error(out, first_pending, line_num, sqlite3_errmsg(db));
+		res = -1;
+		break;
+	    }
+	}
+    }
+    if (res == 0 && !sqlite3_get_autocommit(db) && sqlite3_exec(db, "COMMIT", 0, 0, 0) != SQLITE_OK){
+	write_commit_error(out, first_pending, line_num, sqlite3_errmsg(db));
+	res = -1;
+    }
+    // A failed commit may leave the transaction open.
+    if (!sqlite3_get_autocommit(db))
+	sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+    free(line);
+    free(info);
+    free(authors);
+    return res < 0 ? -1 : failed;
+}
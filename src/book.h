@@ -7,10 +7,10 @@
 #define BOOK_H
 
 typedef struct {
-    const char * const last;
-    const char * const middle;
-    const char * const first;
-    const char * const suffix;
+    const char *last;
+    const char *middle;
+    const char *first;
+    const char *suffix;
 } name;
 
 typedef struct {
@@ -23,8 +23,10 @@ typedef struct {
     const char *ISBN;
     const char *binding_type;
     // We can have multiple authors, so support that.
+    // The list ends with an entry whose last name is null.
     name *authors;
     // Can also have multiple genres.
+    // The list ends with a null pointer.
     const char *genre[];
 } book;
 
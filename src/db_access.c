@@ -22,103 +22,687 @@
  * Defines functions to consistently interface with the database.
  */
 
+#include <fcntl.h>
+#include <pthread.h>
 #include <sqlite3.h>
+#include "arena.h"
 #include "book.h"
 #include "db_access.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 sqlite3 *db;
 
 /**
- * Adds an entry to the database for the book specified in the arguments.
+ * Finds the id of a row, inserting the row if it does not exist yet.
  *
  * @param db
- * Reference to the current database
+ * The database connection we are using
  *
- * @param book_info
- * Reference to the book structure to add
+ * @param tag
+ * The table's tag in the id cache.
+ *
+ * @param select_sql
+ * Query returning the id of the matching row. Takes the values as parameters, in order.
+ *
+ * @param insert_sql
+ * Statement inserting the row. Takes the values as parameters, in order.
+ * 0 to only look the row up.
+ *
+ * @param values
+ * The values identifying the row. Null entries are bound as NULL.
+ *
+ * @param count
+ * The number of values.
+ *
+ * @return
+ * The id of the row, 0 if it is not there and insert_sql is 0, or -1 on failure.
+ */
+static int find_or_add_id(sqlite3 *db, char tag, const char * const select_sql,
+	const char * const insert_sql, const char * const *values, int count){
+    int complete;
+    int id = id_cache_get(db, tag, values, count, &complete);
+    if (id)
+	return id;
+    sqlite3_stmt *stmt;
+    // If the whole table is cached, the row is certainly not there.
+    if (!complete){
+	if (!(stmt = get_stmt(db, select_sql)))
+	    return -1;
+	for (int i = 0; i < count; ++i){
+	    if (sqlite3_bind_text(stmt, i + 1, values[i], -1, 0) != SQLITE_OK){
+		release_stmt(stmt);
+		return -1;
+	    }
+	}
+	int result = sqlite3_step(stmt);
+	if (result == SQLITE_ROW){
+	    id = sqlite3_column_int(stmt, 0);
+	    release_stmt(stmt);
+	    id_cache_put(db, tag, values, count, id);
+	    return id;
+	}
+	release_stmt(stmt);
+	if (result != SQLITE_DONE)
+	    return -1;
+    }
+    // Not there yet, so add it.
+    if (!insert_sql)
+	return 0;
+    if (!(stmt = get_stmt(db, insert_sql)))
+	return -1;
+    for (int i = 0; i < count; ++i){
+	if (sqlite3_bind_text(stmt, i + 1, values[i], -1, 0) != SQLITE_OK){
+	    release_stmt(stmt);
+	    return -1;
+	}
+    }
+    // The row is recorded below, so the cache can still take the table as complete.
+    id_cache_expect_insert(db, tag);
+    int result = sqlite3_step(stmt);
+    id_cache_expect_insert(db, 0);
+    release_stmt(stmt);
+    if (result != SQLITE_DONE)
+	return -1;
+    id = (int)sqlite3_last_insert_rowid(db);
+    id_cache_put(db, tag, values, count, id);
+    return id;
+}
+
+/**
+ * Turns empty optional name parts into nulls, so "" and NULL are the same name.
+ */
+static const char *null_if_empty(const char *part){
+    return (part && *part) ? part : 0;
+}
+
+/**
+ * Gets the id of an owner, adding the owner if needed and add is set.
+ * Gives 0 for an owner that is not there and not added.
+ */
+static int find_or_add_owner(sqlite3 *db, const name * const owner, int add){
+    const char * const values[] = {owner->last, owner->first ? owner->first : "",
+	null_if_empty(owner->middle), null_if_empty(owner->suffix)};
+    return find_or_add_id(db, 'O',
+	"SELECT OwnerID FROM Owner WHERE OwnerLast = ? AND OwnerFirst = ?"
+	" AND OwnerMiddle IS ? AND OwnerSuffix IS ?",
+	add ? "INSERT INTO Owner (OwnerLast, OwnerFirst, OwnerMiddle, OwnerSuffix) VALUES (?,?,?,?)" : 0,
+	values, 4);
+}
+
+/**
+ * Gets the id of an author, adding the author if needed.
+ */
+static int find_or_add_author(sqlite3 *db, const name * const author){
+    const char * const values[] = {author->last, author->first ? author->first : "",
+	null_if_empty(author->middle), null_if_empty(author->suffix)};
+    return find_or_add_id(db, 'A',
+	"SELECT AuthorID FROM Author WHERE AuthorLast = ? AND AuthorFirst = ?"
+	" AND AuthorMiddle IS ? AND AuthorSuffix IS ?",
+	"INSERT INTO Author (AuthorLast, AuthorFirst, AuthorMiddle, AuthorSuffix) VALUES (?,?,?,?)",
+	values, 4);
+}
+
+/**
+ * Gets the id of a genre, adding the genre if needed.
+ */
+static int find_or_add_genre(sqlite3 *db, const char * const genre){
+    return find_or_add_id(db, 'G',
+	"SELECT GenreID FROM Genre WHERE GenreName = ?",
+	"INSERT INTO Genre (GenreName) VALUES (?)",
+	&genre, 1);
+}
+
+/**
+ * Gets the id of a binding type, adding the type if needed and add is set.
+ * Gives 0 for a type that is not there and not added.
+ */
+static int find_or_add_type(sqlite3 *db, const char * const type_name, int add){
+    return find_or_add_id(db, 'T',
+	"SELECT TypeID FROM Type WHERE TypeName = ?",
+	add ? "INSERT INTO Type (TypeName) VALUES (?)" : 0,
+	&type_name, 1);
+}
+
+/**
+ * Runs a statement that takes only integer parameters and returns no rows.
  *
  * @retval 0
- * Add was successful
+ * Statement ran successfully
  *
  * @retval -1
- * Add failed
+ * Statement failed
+ */
+static int exec_ints(sqlite3 *db, const char * const sql, const int *values, int count){
+    sqlite3_stmt *stmt = get_stmt(db, sql);
+    if (!stmt)
+	return -1;
+    for (int i = 0; i < count; ++i){
+	if (sqlite3_bind_int(stmt, i + 1, values[i]) != SQLITE_OK){
+	    release_stmt(stmt);
+	    return -1;
+	}
+    }
+    int result = sqlite3_step(stmt);
+    release_stmt(stmt);
+    return result == SQLITE_DONE ? 0 : -1;
+}
+
+/**
+ * Adds a new Book row along with its author and genre links.
+ * The book is added to the full-text index once they are all linked,
+ * so its index row is written once.
  *
- * @todo Handle partial info (no ISBN, etc.)
+ * @return
+ * The new BookID, or -1 on failure.
  */
-int add(sqlite3 *db, const book * const book_info){
-    if (!db)
+static int insert_book(sqlite3 *db, const book * const book_info){
+    sqlite3_stmt *stmt = get_stmt(db, "INSERT INTO Book (Title, Subtitle) VALUES (?,?)");
+    if (!stmt)
 	return -1;
-    sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, "SELECT DISTINCT Book.BookID FROM Book"
+    if (sqlite3_bind_text(stmt, 1, book_info->title, -1, 0) != SQLITE_OK ||
+	    sqlite3_bind_text(stmt, 2, book_info->subtitle, -1, 0) != SQLITE_OK){
+	release_stmt(stmt);
+	return -1;
+    }
+    int result = sqlite3_step(stmt);
+    release_stmt(stmt);
+    if (result != SQLITE_DONE)
+	return -1;
+    int book_id = (int)sqlite3_last_insert_rowid(db);
+
+    // Link the authors in the order they were given.
+    for (int i = 0; book_info->authors && book_info->authors[i].last; ++i){
+	int author_id = find_or_add_author(db, &book_info->authors[i]);
+	if (author_id < 0)
+	    return -1;
+	const int link[] = {book_id, author_id, i + 1};
+	if (exec_ints(db, "INSERT OR IGNORE INTO BookAuthor (BookID, AuthorID, AuthorOrder) VALUES (?,?,?)", link, 3) != 0)
+	    return -1;
+    }
+    // Link the genres.
+    for (int i = 0; book_info->genre[i]; ++i){
+	int genre_id = find_or_add_genre(db, book_info->genre[i]);
+	if (genre_id < 0)
+	    return -1;
+	const int link[] = {book_id, genre_id};
+	if (exec_ints(db, "INSERT OR IGNORE INTO BookGenre (BookID, GenreID) VALUES (?,?)", link, 2) != 0)
+	    return -1;
+    }
+    return index_book(db, book_id) == 0 ? book_id : -1;
+}
+
+/**
+ * Finds the printing of a book, adding it if needed and add is set.
+ *
+ * @return
+ * The PrintingID, 0 if it is not there and not added, or -1 on failure.
+ */
+static int find_or_add_printing(sqlite3 *db, int book_id, int type_id, const book * const book_info, int add){
+    // A valid ISBN matches however it was written. Anything else has to match as typed.
+    sqlite3_int64 isbn13 = isbn_normalize(book_info->ISBN);
+    sqlite3_stmt *stmt = get_stmt(db, isbn13 ? "SELECT PrintingID FROM Printing"
+	" WHERE BookID = ? AND ISBN13 = ? AND Year = ? AND TypeID = ? AND PrintingNum = ?" :
+	"SELECT PrintingID FROM Printing"
+	" WHERE BookID = ? AND ISBN IS ? AND Year = ? AND TypeID = ? AND PrintingNum = ?");
+    if (!stmt)
+	return -1;
+    if (sqlite3_bind_int(stmt, 1, book_id) != SQLITE_OK ||
+	    (isbn13 ? sqlite3_bind_int64(stmt, 2, isbn13) : sqlite3_bind_text(stmt, 2, book_info->ISBN, -1, 0)) != SQLITE_OK ||
+	    sqlite3_bind_int(stmt, 3, book_info->year) != SQLITE_OK ||
+	    sqlite3_bind_int(stmt, 4, type_id) != SQLITE_OK ||
+	    sqlite3_bind_int(stmt, 5, book_info->edition_num) != SQLITE_OK){
+	release_stmt(stmt);
+	return -1;
+    }
+    int result = sqlite3_step(stmt);
+    if (result == SQLITE_ROW){
+	int printing_id = sqlite3_column_int(stmt, 0);
+	release_stmt(stmt);
+	return printing_id;
+    }
+    release_stmt(stmt);
+    if (result != SQLITE_DONE)
+	return -1;
+    if (!add)
+	return 0;
+    if (!(stmt = get_stmt(db, "INSERT INTO Printing (BookID, ISBN, Year, TypeID, PrintingNum, ISBN13)"
+	" VALUES (?,?,?,?,?,?)")))
+	return -1;
+    if (sqlite3_bind_int(stmt, 1, book_id) != SQLITE_OK ||
+	    sqlite3_bind_text(stmt, 2, book_info->ISBN, -1, 0) != SQLITE_OK ||
+	    sqlite3_bind_int(stmt, 3, book_info->year) != SQLITE_OK ||
+	    sqlite3_bind_int(stmt, 4, type_id) != SQLITE_OK ||
+	    sqlite3_bind_int(stmt, 5, book_info->edition_num) != SQLITE_OK ||
+	    (isbn13 ? sqlite3_bind_int64(stmt, 6, isbn13) : sqlite3_bind_null(stmt, 6)) != SQLITE_OK){
+	release_stmt(stmt);
+	return -1;
+    }
+    result = sqlite3_step(stmt);
+    release_stmt(stmt);
+    if (result != SQLITE_DONE)
+	return -1;
+    return (int)sqlite3_last_insert_rowid(db);
+}
+
+/**
+ * Adds copies of a printing to what an owner has, starting the owner off if needed.
+ * One statement, so two writers adding the same printing cannot lose a count.
+ *
+ * @return
+ * 0 on success, -1 on failure.
+ */
+static int add_quantity(sqlite3 *db, int printing_id, int owner_id, int quantity){
+    const int values[] = {printing_id, owner_id, quantity};
+    return exec_ints(db, "INSERT INTO BookOwner (PrintingID, OwnerID, Quantity) VALUES (?,?,?)"
+	" ON CONFLICT(PrintingID, OwnerID) DO UPDATE SET Quantity = Quantity + excluded.Quantity", values, 3);
+}
+
+/**
+ * Takes copies of a printing away from what an owner has.
+ * The owner's row is deleted once none are left.
+ *
+ * @retval 0
+ * The copies were taken away.
+ *
+ * @retval -1
+ * The owner has fewer copies than that, or the change failed. Nothing was changed.
+ */
+static int remove_quantity(sqlite3 *db, int printing_id, int owner_id, int quantity){
+    // Checking and taking away in one statement, so a concurrent remove cannot go below zero.
+    sqlite3_stmt *stmt = get_stmt(db, "UPDATE BookOwner SET Quantity = Quantity - ?3"
+	" WHERE PrintingID = ?1 AND OwnerID = ?2 AND Quantity >= ?3 RETURNING Quantity");
+    if (!stmt)
+	return -1;
+    if (sqlite3_bind_int(stmt, 1, printing_id) != SQLITE_OK ||
+	    sqlite3_bind_int(stmt, 2, owner_id) != SQLITE_OK ||
+	    sqlite3_bind_int(stmt, 3, quantity) != SQLITE_OK){
+	release_stmt(stmt);
+	return -1;
+    }
+    int result = sqlite3_step(stmt);
+    int left = result == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : -1;
+    // Finish the statement, so the update is complete before the delete.
+    if (result == SQLITE_ROW && sqlite3_step(stmt) != SQLITE_DONE)
+	left = -1;
+    release_stmt(stmt);
+    if (left < 0)
+	return -1;
+    if (left > 0)
+	return 0;
+    const int values[] = {printing_id, owner_id};
+    return exec_ints(db, "DELETE FROM BookOwner WHERE PrintingID = ? AND OwnerID = ? AND Quantity <= 0", values, 2);
+}
+
+/**
+ * Finds the printing a book describes, adding the book and printing if needed and add is set.
+ *
+ * @return
+ * The PrintingID, 0 if it is not there and not added, or -1 on failure.
+ */
+static int find_printing(sqlite3 *db, const book * const book_info, int add){
+    sqlite3_int64 isbn13 = isbn_normalize(book_info->ISBN);
+    sqlite3_stmt *stmt = get_stmt(db, isbn13 ? "SELECT DISTINCT Book.BookID FROM Book"
     " JOIN Printing ON Book.BookID = Printing.BookID"
-    " WHERE Title = ? AND Year = ? AND ISBN = ?", -1, &stmt, 0) != SQLITE_OK){
+    " WHERE Title = ? AND Year = ? AND ISBN13 = ?" :
+    "SELECT DISTINCT Book.BookID FROM Book"
+    " JOIN Printing ON Book.BookID = Printing.BookID"
+    " WHERE Title = ? AND Year = ? AND ISBN = ?");
+    if (!stmt){
 	// TODO: Determine whether this should print an error message.
 	return -1;
     }
     if (sqlite3_bind_text(stmt, 1, book_info->title, -1, 0) != SQLITE_OK){
-	sqlite3_finalize(stmt);
+	release_stmt(stmt);
 	return -1;
     }
     if (sqlite3_bind_int(stmt, 2, book_info->year) != SQLITE_OK){
-	sqlite3_finalize(stmt);
+	release_stmt(stmt);
 	return -1;
     }
-    if (sqlite3_bind_text(stmt, 3, book_info->ISBN, -1, 0) != SQLITE_OK){
-	sqlite3_finalize(stmt);
+    if ((isbn13 ? sqlite3_bind_int64(stmt, 3, isbn13) : sqlite3_bind_text(stmt, 3, book_info->ISBN, -1, 0)) != SQLITE_OK){
+	release_stmt(stmt);
 	return -1;
     }
-    // Unallocated array of book ids.
+    // The book ids come out of a stack buffer, and only use the heap for unusually many matches.
+    char id_space[256];
+    arena ids;
+    arena_init(&ids, id_space, sizeof(id_space), 0);
     int *book_id_list = 0;
     unsigned int id_list_len = 0;
+    unsigned int id_list_size = 0;
     int result;
     while ((result = sqlite3_step(stmt)) == SQLITE_ROW){
 	// We really only want one book. If we can't disambiguate, try harder in other tables.
-	// TODO: This is not efficient, since we keep reallocing every time.
-	book_id_list = realloc(book_id_list, sizeof(int) * ++id_list_len);
-	book_id_list[id_list_len - 1] = sqlite3_column_int(stmt, 0);
+	if (id_list_len == id_list_size){
+	    // Double the list, so it only moves a few times.
+	    id_list_size = id_list_size ? id_list_size * 2 : 16;
+	    int *grown = arena_alloc(&ids, sizeof(int) * id_list_size);
+	    if (!grown){
+		release_stmt(stmt);
+		arena_free(&ids);
+		return -1;
+	    }
+	    if (id_list_len)
+		memcpy(grown, book_id_list, sizeof(int) * id_list_len);
+	    book_id_list = grown;
+	}
+	book_id_list[id_list_len++] = sqlite3_column_int(stmt, 0);
     }
-    sqlite3_finalize(stmt);
-    if (result != SQLITE_DONE)
+    release_stmt(stmt);
+    if (result != SQLITE_DONE){
+	arena_free(&ids);
 	return -1;
+    }
     if (id_list_len > 1){
 	// TODO: Disambiguate
 
 	// Keep performing result narrowing until one result remains.
 	// TODO: More checks
     }
+    int book_id;
+    if (id_list_len == 0){
+	// No printing matches, but this may be a new printing of a book we already have.
+	if (!(stmt = get_stmt(db, "SELECT BookID FROM Book WHERE Title = ? AND Subtitle IS ?")))
+	    return -1;
+	if (sqlite3_bind_text(stmt, 1, book_info->title, -1, 0) != SQLITE_OK ||
+		sqlite3_bind_text(stmt, 2, book_info->subtitle, -1, 0) != SQLITE_OK){
+	    release_stmt(stmt);
+	    return -1;
+	}
+	result = sqlite3_step(stmt);
+	book_id = result == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : -1;
+	release_stmt(stmt);
+	if (result == SQLITE_DONE){
+	    if (!add)
+		return 0;
+	    book_id = insert_book(db, book_info);
+	}
+	if (book_id < 0)
+	    return -1;
+    }
+    else
+	// Until disambiguation is done, go with the first match.
+	book_id = book_id_list[0];
+    arena_free(&ids);
+
+    int type_id = find_or_add_type(db, book_info->binding_type ? book_info->binding_type : "Softcover", add);
+    if (type_id <= 0)
+	return type_id;
+    return find_or_add_printing(db, book_id, type_id, book_info, add);
+}
+
+/**
+ * Does the work of add(). Expects to be run inside a savepoint.
+ */
+static int add_book(sqlite3 *db, const book * const book_info){
+    int printing_id = find_printing(db, book_info, 1);
+    if (printing_id < 0)
+	return -1;
 
     // Okay, we have exactly one book, now we find the appropriate owner
-    // TODO: Implement
+    int owner_id = find_or_add_owner(db, &book_info->owner, 1);
+    if (owner_id < 0)
+	return -1;
 
     // With the appropriate owner, we add to the quantity.
+    return add_quantity(db, printing_id, owner_id, book_info->quantity > 0 ? book_info->quantity : 1);
+}
 
-    // TODO: Implement
-    return -1;
+/**
+ * Checks a string for the ASCII unit and record separators, which split the
+ * author and genre lists of search results and the keys of the id cache.
+ */
+static int has_separator(const char * const text){
+    return text && strpbrk(text, "\x1f\x1e") != 0;
+}
+
+/**
+ * Checks each part of a name for the separators.
+ */
+static int name_has_separator(const name * const person){
+    return has_separator(person->last) || has_separator(person->first) ||
+	has_separator(person->middle) || has_separator(person->suffix);
+}
+
+/**
+ * Checks every string of a book for the separators, so none are stored.
+ */
+static int book_has_separator(const book * const book_info){
+    if (has_separator(book_info->title) || has_separator(book_info->subtitle) ||
+	    has_separator(book_info->ISBN) || has_separator(book_info->binding_type) ||
+	    name_has_separator(&book_info->owner))
+	return 1;
+    for (const name *author = book_info->authors; author && author->last; ++author){
+	if (name_has_separator(author))
+	    return 1;
+    }
+    for (int i = 0; book_info->genre[i]; ++i){
+	if (has_separator(book_info->genre[i]))
+	    return 1;
+    }
+    return 0;
+}
+
+/**
+ * Does the work of add().
+ */
+static int add_in_savepoint(sqlite3 *db, const book * const book_info){
+    if (!db || !book_info || !book_info->title || !book_info->owner.last || book_has_separator(book_info))
+	return -1;
+    // Make sure no other connection has changed the rows the id cache knows about.
+    id_cache_validate(db);
+    if (sqlite3_exec(db, "SAVEPOINT add_book", 0, 0, 0) != SQLITE_OK)
+	return -1;
+    if (add_book(db, book_info) != 0){
+	sqlite3_exec(db, "ROLLBACK TO add_book", 0, 0, 0);
+	sqlite3_exec(db, "RELEASE add_book", 0, 0, 0);
+	// The id cache may now hold rows that were rolled back.
+	id_cache_clear(db);
+	return -1;
+    }
+    if (sqlite3_exec(db, "RELEASE add_book", 0, 0, 0) != SQLITE_OK)
+	return -1;
+    return 0;
+}
+
+/**
+ * Adds an entry to the database for the book specified in the arguments.
+ *
+ * @param db
+ * Reference to the current database
+ *
+ * @param book_info
+ * Reference to the book structure to add
+ *
+ * @retval 0
+ * Add was successful
+ *
+ * @retval -1
+ * Add failed, or some text of the book holds an ASCII unit or record separator.
+ *
+ * @note The add is done in a savepoint, so a failed add leaves no partial rows.
+ * This works both on its own and inside add_batch()'s transaction.
+ *
+ * @todo Handle partial info (no ISBN, etc.)
+ */
+int add(sqlite3 *db, const book * const book_info){
+    long long start = stats_start();
+    int result = add_in_savepoint(db, book_info);
+    stats_end(STATS_ADD, start, result != 0);
+    return result;
+}
+
+/**
+ * Does the work of add_copy().
+ */
+static int add_copy_in_savepoint(sqlite3 *db, sqlite3_int64 isbn13, const name * const owner){
+    if (!db || !isbn13 || !owner || !owner->last || name_has_separator(owner))
+	return -1;
+    id_cache_validate(db);
+    sqlite3_stmt *stmt = get_stmt(db, "SELECT PrintingID FROM Printing WHERE ISBN13 = ? ORDER BY PrintingID LIMIT 1");
+    if (!stmt)
+	return -1;
+    if (sqlite3_bind_int64(stmt, 1, isbn13) != SQLITE_OK){
+	release_stmt(stmt);
+	return -1;
+    }
+    int result = sqlite3_step(stmt);
+    int printing_id = result == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : 0;
+    release_stmt(stmt);
+    if (result == SQLITE_DONE)
+	return 1;
+    if (result != SQLITE_ROW)
+	return -1;
+    if (sqlite3_exec(db, "SAVEPOINT add_copy", 0, 0, 0) != SQLITE_OK)
+	return -1;
+    int owner_id = find_or_add_owner(db, owner, 1);
+    if (owner_id < 0 || add_quantity(db, printing_id, owner_id, 1) != 0){
+	sqlite3_exec(db, "ROLLBACK TO add_copy", 0, 0, 0);
+	sqlite3_exec(db, "RELEASE add_copy", 0, 0, 0);
+	id_cache_clear(db);
+	return -1;
+    }
+    if (sqlite3_exec(db, "RELEASE add_copy", 0, 0, 0) != SQLITE_OK)
+	return -1;
+    return 0;
+}
+
+/**
+ * Adds one more copy of a printing already in the database, found by its ISBN,
+ * as when a book is scanned in.
+ *
+ * @param db
+ * Reference to the current database
+ *
+ * @param isbn13
+ * The ISBN of the printing, from isbn_normalize().
+ *
+ * @param owner
+ * Who the copy belongs to.
+ *
+ * @retval 0
+ * The copy was added.
+ *
+ * @retval 1
+ * No printing has that ISBN, so nothing was added.
+ *
+ * @retval -1
+ * The add failed, or the owner's name holds an ASCII unit or record separator.
+ *
+ * @note Like add(), this works on its own or inside a larger transaction.
+ * If several printings share the ISBN, the first one added is used.
+ */
+int add_copy(sqlite3 *db, sqlite3_int64 isbn13, const name * const owner){
+    long long start = stats_start();
+    int result = add_copy_in_savepoint(db, isbn13, owner);
+    stats_end(STATS_ADD_COPY, start, result < 0);
+    return result;
+}
+
+/**
+ * Does the work of add_batch().
+ */
+static int add_in_batches(sqlite3 *db, const book * const *books, size_t count){
+    if (!db || !books)
+	return -1;
+    int added = 0;
+    size_t i = 0;
+    while (i < count){
+	if (sqlite3_exec(db, "BEGIN", 0, 0, 0) != SQLITE_OK)
+	    return -1;
+	size_t end = i + ADD_BATCH_COMMIT_ROWS < count ? i + ADD_BATCH_COMMIT_ROWS : count;
+	for (; i < end; ++i){
+	    if (add(db, books[i]) == 0)
+		++added;
+	}
+	if (sqlite3_exec(db, "COMMIT", 0, 0, 0) != SQLITE_OK){
+	    sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+	    return -1;
+	}
+    }
+    return added;
+}
+
+/**
+ * Adds many books at once.
+ * The books are added in transactions of up to ADD_BATCH_COMMIT_ROWS books,
+ * rather than committing after each one.
+ *
+ * @param db
+ * Reference to the current database
+ *
+ * @param books
+ * Array of the books to add
+ *
+ * @param count
+ * The number of books in the array
+ *
+ * @return
+ * The number of books that were added, or -1 if a transaction failed.
+ * Books that fail to add are skipped without affecting the rest.
+ */
+int add_batch(sqlite3 *db, const book * const *books, size_t count){
+    long long start = stats_start();
+    int result = add_in_batches(db, books, count);
+    stats_end(STATS_ADD_BATCH, start, result < 0);
+    return result;
+}
+
+/**
+ * Does the work of remove_book().
+ */
+static int remove_in_savepoint(sqlite3 *db, const book * const book_info){
+    if (!db || !book_info || !book_info->title || !book_info->owner.last)
+	return -1;
+    id_cache_validate(db);
+    // Nothing is added here, so a printing or owner that is not there gives 0.
+    int printing_id = find_printing(db, book_info, 0);
+    if (printing_id <= 0)
+	return -1;
+    int owner_id = find_or_add_owner(db, &book_info->owner, 0);
+    if (owner_id <= 0)
+	return -1;
+    if (sqlite3_exec(db, "SAVEPOINT remove_book", 0, 0, 0) != SQLITE_OK)
+	return -1;
+    if (remove_quantity(db, printing_id, owner_id, book_info->quantity > 0 ? book_info->quantity : 1) != 0){
+	sqlite3_exec(db, "ROLLBACK TO remove_book", 0, 0, 0);
+	sqlite3_exec(db, "RELEASE remove_book", 0, 0, 0);
+	return -1;
+    }
+    if (sqlite3_exec(db, "RELEASE remove_book", 0, 0, 0) != SQLITE_OK)
+	return -1;
+    return 0;
 }
 
 /**
  * Removes a specified quantity of a book from one owner.
+ * The owner's entry for the printing is deleted once no copies are left.
+ * The book and printing stay, so they can be added again later.
  *
  * @param db
  * The database connection we are using
  *
  * @param book_info
- * The book we wish to remove one from
+ * The book we wish to remove copies of. Its quantity is how many to remove,
+ * with 0 meaning one.
  *
  * @retval 0
  * Removal completed successfully
  *
  * @retval -1
- * Removal failed
+ * Removal failed, as when the owner does not have that many copies.
+ * Nothing is changed.
+ *
+ * @note Like add(), this works on its own or inside a larger transaction.
  */
 int remove_book(sqlite3 *db, const book * const book_info){
-    if (!db)
-	return -1;
-    // TODO: Implement
-
-    return -1;
+    long long start = stats_start();
+    int result = remove_in_savepoint(db, book_info);
+    stats_end(STATS_REMOVE, start, result != 0);
+    return result;
 }
 
 // Parallel array for the field name
@@ -129,410 +713,1305 @@ static const char * const field_name[] = {
     "TypeName",
     "Year",
     "ISBN",
-    "Genre"
+    "Genre",
+    "Any"
 };
 
-// Parallel array for the table the field is in.
-static const char * const table_name[] = {
-    "Book",
-    "Author",
-    "Owner",
-    "Type",
-    "Printing",
-    "Printing",
-    "Genre"
+/*
+ * Separators for the author and genre lists in search results.
+ * ASCII unit and record separators. add() and add_copy() refuse any text holding them,
+ * so they never appear in names.
+ */
+#define LIST_FIELD_SEP "\x1f"
+#define LIST_RECORD_SEP "\x1e"
+
+/*
+ * The part of the search query common to every field.
+ * Gives one row per printing and owner. The authors, in AuthorOrder, and the
+ * genres of each book are gathered into one column each, rather than joined on,
+ * which would repeat the row for every author and genre.
+ * Each author is last, first, middle and suffix, with an empty string for a missing name.
+ */
+#define SEARCH_COLUMNS \
+    "SELECT Book.BookID, Printing.PrintingID, Book.Title, Book.Subtitle," \
+    " OwnerLast, OwnerFirst, OwnerMiddle, OwnerSuffix," \
+    " Printing.Year, Printing.PrintingNum, BookOwner.Quantity, Printing.ISBN, TypeName," \
+    " (SELECT group_concat(AuthorName, '" LIST_RECORD_SEP "') FROM" \
+	" (SELECT AuthorLast || '" LIST_FIELD_SEP "' || AuthorFirst || '" LIST_FIELD_SEP "' ||" \
+	" ifnull(AuthorMiddle, '') || '" LIST_FIELD_SEP "' || ifnull(AuthorSuffix, '') AS AuthorName" \
+	" FROM BookAuthor JOIN Author ON Author.AuthorID = BookAuthor.AuthorID" \
+	" WHERE BookAuthor.BookID = Book.BookID ORDER BY AuthorOrder))," \
+    " (SELECT group_concat(GenreName, '" LIST_RECORD_SEP "')" \
+	" FROM BookGenre JOIN Genre ON Genre.GenreID = BookGenre.GenreID" \
+	" WHERE BookGenre.BookID = Book.BookID)"
+
+// The tables joined on after Book.
+#define SEARCH_JOINS \
+    " JOIN Printing ON Book.BookID = Printing.BookID" \
+    " JOIN BookOwner ON Printing.PrintingID = BookOwner.PrintingID" \
+    " JOIN Owner ON Owner.OwnerID = BookOwner.OwnerID" \
+    " JOIN Type ON Type.TypeID = Printing.TypeID"
+
+static const char * const search_select = SEARCH_COLUMNS " FROM Book" SEARCH_JOINS;
+
+// Column numbers in search_select.
+enum {
+    SEARCH_COL_BOOK_ID,
+    SEARCH_COL_PRINTING_ID,
+    SEARCH_COL_TITLE,
+    SEARCH_COL_SUBTITLE,
+    SEARCH_COL_OWNER_LAST,
+    SEARCH_COL_OWNER_FIRST,
+    SEARCH_COL_OWNER_MIDDLE,
+    SEARCH_COL_OWNER_SUFFIX,
+    SEARCH_COL_YEAR,
+    SEARCH_COL_EDITION,
+    SEARCH_COL_QUANTITY,
+    SEARCH_COL_ISBN,
+    SEARCH_COL_TYPE,
+    SEARCH_COL_AUTHORS,
+    SEARCH_COL_GENRES
 };
 
+/*
+ * The condition each kind of search term adds to the search query.
+ * Authors and genres are left joined, so they filter through subqueries the planner can start from.
+ */
+static const struct {
+    fields field;
+    match_type match;
+    const char *condition;
+} term_condition[] = {
+    {FIELD_TITLE, MATCH_EQUAL, "Book.Title = ?"},
+    // Everything from the prefix up to, but not including, the prefix followed by 0xFF,
+    // which no UTF-8 text contains. Unlike LIKE, this can use the index.
+    {FIELD_TITLE, MATCH_PREFIX, "Book.Title >= ? AND Book.Title < ?"},
+    {FIELD_AUTHOR, MATCH_EQUAL, "Book.BookID IN (SELECT BookID FROM BookAuthor WHERE AuthorID = ?)"},
+    {FIELD_OWNER, MATCH_EQUAL, "BookOwner.OwnerID IN (SELECT OwnerID FROM Owner"
+	" WHERE OwnerFirst = ? AND OwnerMiddle IS ? AND OwnerLast = ?)"},
+    {FIELD_BINDING, MATCH_EQUAL, "TypeName = ?"},
+    {FIELD_YEAR, MATCH_EQUAL, "Printing.Year = ?"},
+    {FIELD_YEAR, MATCH_RANGE, "Printing.Year BETWEEN ? AND ?"},
+    // A valid ISBN is matched by number, so it matches however it was written.
+    // find_condition() picks the one after it for anything else, which only matches as typed.
+    {FIELD_ISBN, MATCH_EQUAL, "Printing.ISBN13 = ?"},
+    {FIELD_ISBN, MATCH_EQUAL, "Printing.ISBN = ?"},
+    {FIELD_ISBN, MATCH_PREFIX, "Printing.ISBN >= ? AND Printing.ISBN < ?"},
+    {FIELD_GENRE, MATCH_EQUAL, "Book.BookID IN (SELECT BookID FROM BookGenre JOIN Genre ON Genre.GenreID = BookGenre.GenreID"
+	" WHERE GenreName = ?)"},
+    // The join onto BookSearch is added along with it.
+    {FIELD_ANY, MATCH_EQUAL, "BookSearch MATCH ?"}
+};
+
+#define TERM_CONDITIONS (sizeof(term_condition) / sizeof(term_condition[0]))
+
 /**
- * Search using a given field
+ * Finds the condition for a search term.
  *
- * @param db
- * The database we are using
+ * @return
+ * The index in term_condition, or -1 if the field cannot be matched that way.
+ */
+static int find_condition(const search_term * const term){
+    int skip = term->field == FIELD_ISBN && term->match == MATCH_EQUAL && !isbn_normalize(term->text);
+    for (unsigned int i = 0; i < TERM_CONDITIONS; ++i){
+	if (term_condition[i].field == term->field && term_condition[i].match == term->match && !skip--)
+	    return i;
+    }
+    return -1;
+}
+
+// How many compiled search queries are kept.
+#define SEARCH_QUERY_CACHE_SIZE 64
+
+/*
+ * Compiled search queries, by shape: which conditions are used, in order,
+ * and how the results are paged. The values searched for are not part of
+ * the shape, so each shape is compiled once and its statement reused.
+ * Shared by every connection, so it is locked.
+ */
+static struct {
+    unsigned long long shape;
+    char *sql;
+} search_queries[SEARCH_QUERY_CACHE_SIZE];
+static int search_query_count = 0;
+static pthread_mutex_t search_queries_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Shape flags for paging.
+#define SHAPE_KEYSET 1
+#define SHAPE_ORDERED 2
+#define SHAPE_LIMIT 4
+
+/**
+ * Appends text to a growing query.
  *
- * @param search_field
- * The field we will search for results
+ * @return
+ * 0 on success, -1 if out of memory. The query is freed on failure.
+ */
+static int append_sql(char **sql, size_t *len, size_t *size, const char * const text){
+    size_t add = strlen(text);
+    if (*len + add + 1 > *size){
+	size_t new_size = (*len + add + 1) * 2;
+	char *grown = realloc(*sql, new_size);
+	if (!grown){
+	    free(*sql);
+	    *sql = 0;
+	    return -1;
+	}
+	*sql = grown;
+	*size = new_size;
+    }
+    memcpy(*sql + *len, text, add + 1);
+    *len += add;
+    return 0;
+}
+
+/**
+ * Builds the query for a search shape.
  *
- * @param search_text
- * The text we will search for in the specified field
+ * @param conditions
+ * Indexes into term_condition, in the order their parameters are bound.
+ *
+ * @param count
+ * The number of conditions.
  *
- * @todo
- * In which way do I intend to give back results?
+ * @param flags
+ * SHAPE_* flags for how the results are paged.
+ *
+ * @return
+ * The query, which the caller must free(), or 0 if out of memory.
  */
-int search(sqlite3 *db, fields search_field, char * const search_text){
-    if (!db)
-	return -1;
-    // TODO: Determine an appropriate value to use for buffer length.
-    char querybuf[1000];
+static char *build_search_sql(const int *conditions, int count, int flags){
+    char *sql = 0;
+    size_t len = 0, size = 0;
+    int any = 0;
+    for (int i = 0; i < count; ++i)
+	any |= term_condition[conditions[i]].field == FIELD_ANY;
+    if (append_sql(&sql, &len, &size, search_select) != 0 ||
+	    (any && append_sql(&sql, &len, &size, " JOIN BookSearch ON BookSearch.rowid = Book.BookID") != 0))
+	return 0;
+    for (int i = 0; i < count; ++i){
+	if (append_sql(&sql, &len, &size, i ? " AND " : " WHERE ") != 0 ||
+		append_sql(&sql, &len, &size, term_condition[conditions[i]].condition) != 0)
+	    return 0;
+    }
+    // Keyset paging needs a stable order, but full-text results are ordered by rank.
+    if (flags & SHAPE_KEYSET &&
+	    append_sql(&sql, &len, &size, count ? " AND Printing.PrintingID > ?" : " WHERE Printing.PrintingID > ?") != 0)
+	return 0;
+    if (any){
+	// Best matches first. Title hits weigh most, then subtitle, authors and genres.
+	if (append_sql(&sql, &len, &size, " ORDER BY bm25(BookSearch, 10.0, 5.0, 3.0, 1.0), Printing.PrintingID") != 0)
+	    return 0;
+    }
+    else if (flags & SHAPE_ORDERED && append_sql(&sql, &len, &size, " ORDER BY Printing.PrintingID") != 0)
+	return 0;
+    if (flags & SHAPE_LIMIT && append_sql(&sql, &len, &size, " LIMIT ? OFFSET ?") != 0)
+	return 0;
+    return sql;
+}
+
+/**
+ * Gets the query for a search shape, compiling it the first time the shape is seen.
+ *
+ * @param conditions
+ * Indexes into term_condition, in the order their parameters are bound.
+ * At most SEARCH_MAX_TERMS of them.
+ *
+ * @param count
+ * The number of conditions.
+ *
+ * @param flags
+ * SHAPE_* flags for how the results are paged.
+ *
+ * @param owned
+ * Set to 1 if the caller must free() the query, which happens once the cache is full.
+ *
+ * @return
+ * The query, or 0 if out of memory.
+ */
+static const char *search_sql(const int *conditions, int count, int flags, int *owned){
+    // Five bits per condition, after the flags.
+    unsigned long long shape = flags | (unsigned long long)count << 3;
+    for (int i = 0; i < count; ++i)
+	shape |= (unsigned long long)(conditions[i] + 1) << (8 + 5 * i);
+    *owned = 0;
+    pthread_mutex_lock(&search_queries_lock);
+    for (int i = 0; i < search_query_count; ++i){
+	if (search_queries[i].shape == shape){
+	    const char *sql = search_queries[i].sql;
+	    pthread_mutex_unlock(&search_queries_lock);
+	    return sql;
+	}
+    }
+    char *sql = build_search_sql(conditions, count, flags);
+    if (sql && search_query_count < SEARCH_QUERY_CACHE_SIZE){
+	search_queries[search_query_count].shape = shape;
+	search_queries[search_query_count].sql = sql;
+	++search_query_count;
+    }
+    else
+	*owned = 1;
+    pthread_mutex_unlock(&search_queries_lock);
+    return sql;
+}
+
+/*
+ * An open search. Walks the results one row at a time,
+ * so nothing is materialized beyond the row being looked at.
+ */
+struct search_cursor {
     sqlite3_stmt *stmt;
-    // We may return more than one book with this, so allow for allocation of an array of info structures.
-    book *results;
-    // Initialize the buffer to hold the common part of the query.
-    // It is less than 1000 characters, so I can safely use strcpy()
-    strcpy(querybuf, "SELECT BookID, PrintingID, Title, Subtitle, AuthorID, OwnerID, TypeName, Year, ISBN, GenreID"
-	" FROM Book"
-	" JOIN Printing ON Book.BookID = Printing.BookID"
-	" JOIN BookOwner ON Printing.PrintingID = BookOwner.PrintingID"
-	" JOIN Type ON Type.TypeID = Printing.TypeID"
-	" JOIN BookGenre ON Book.BookID = BookGenre.BookID"
-	" JOIN BookAuthor ON Book.BookID = BookAuthor.BookID");
-    switch (search_field){
+    // The author and genre lists of the current row, split up in place.
+    char *lists;
+    size_t lists_size;
+    // The authors of the current row, with room for the terminator.
+    name *authors;
+    size_t author_slots;
+    int last_printing_id;
+    // For the search's entry in db_stats().
+    long long started;
+    int failed;
+};
+
+/**
+ * Splits a name typed as "First Last" or "First Middle Last", in place.
+ *
+ * @param text
+ * The name text. It is modified.
+ *
+ * @param parts
+ * Where to store the first, middle and last name. The middle name is null if not given.
+ */
+static void split_typed_name(char *text, char *parts[3]){
+    // For simplicity, I will assume that the name's sections are seperated by a space.
+    // strtok_r(), since searches can run on several threads at once.
+    char *save;
+    parts[0] = strtok_r(text, " ", &save);
+    parts[1] = strtok_r(0, " ", &save);
+    // This one should go to the end, so the space may be superfluous.
+    parts[2] = strtok_r(0, " ", &save);
+    // With only two parts, there is no middle name.
+    if (!parts[2]){
+	parts[2] = parts[1];
+	parts[1] = 0;
+    }
+}
+
+/**
+ * Finds the id of an author typed into a search.
+ *
+ * @param db
+ * The database we are using
+ *
+ * @param name_parts
+ * The first, middle and last name from split_typed_name().
+ *
+ * @return
+ * The AuthorID, 0 if there is no such author, or -1 on failure.
+ */
+static int find_author_id(sqlite3 *db, char *name_parts[3]){
+    // Authors without a suffix can be answered from the id cache.
+    id_cache_validate(db);
+    const char * const values[] = {name_parts[2], name_parts[0], name_parts[1], 0};
+    int complete;
+    int author_id = id_cache_get(db, 'A', values, 4, &complete);
+    if (author_id)
+	return author_id;
+    sqlite3_stmt *stmt = get_stmt(db, "SELECT AuthorID FROM Author WHERE AuthorFirst = ? AND "
+	"AuthorMiddle IS ? AND AuthorLast = ?");
+    if (!stmt)
+	return -1;
+    // Bind the parameters to prevent SQL injection
+    if (sqlite3_bind_text(stmt, 1, name_parts[0], -1, 0) != SQLITE_OK ||
+	    sqlite3_bind_text(stmt, 2, name_parts[1], -1, 0) != SQLITE_OK ||
+	    sqlite3_bind_text(stmt, 3, name_parts[2], -1, 0) != SQLITE_OK){
+	release_stmt(stmt);
+	return -1;
+    }
+    author_id = 0;
+    int result = sqlite3_step(stmt);
+    if (result == SQLITE_ROW)
+	author_id = sqlite3_column_int(stmt, 0);
+    // TODO: If more than 1 ID returned, we need to disambiguate farther.
+    release_stmt(stmt);
+    return (result == SQLITE_ROW || result == SQLITE_DONE) ? author_id : -1;
+}
+
+/**
+ * Binds one search term's values to the search query.
+ *
+ * @param param
+ * The number of the term's first parameter. Advanced past the term's parameters.
+ *
+ * @return
+ * 0 on success, -1 on failure.
+ */
+static int bind_term(sqlite3 *db, sqlite3_stmt *stmt, const search_term * const term, int *param){
+    // Names are split in place, so work on a copy. Long names are cut short, and match nothing.
+    char name_text[256];
+    char *name_parts[3];
+    sqlite3_int64 isbn13;
+    int result = SQLITE_OK;
+    switch (term->field){
+	case FIELD_ISBN:
+	    // As find_condition() chose, by number if the ISBN is valid.
+	    if (term->match == MATCH_EQUAL && (isbn13 = isbn_normalize(term->text))){
+		result = sqlite3_bind_int64(stmt, (*param)++, isbn13);
+		break;
+	    }
+	    // Fall through
 	case FIELD_TITLE:
-	    strcat(querybuf, " WHERE Title = ?");
-	    if (sqlite3_prepare_v2(db, querybuf, -1, &stmt, 0) != SQLITE_OK)
-		return -1;
-	    if (sqlite3_bind_text(stmt, 1, search_text, -1, 0) != SQLITE_OK){
-		sqlite3_finalize(stmt);
-		return -1;
+	case FIELD_BINDING:
+	case FIELD_GENRE:
+	    result = sqlite3_bind_text(stmt, (*param)++, term->text, -1, SQLITE_TRANSIENT);
+	    if (result == SQLITE_OK && term->match == MATCH_PREFIX){
+		size_t len = strlen(term->text);
+		char *upper = malloc(len + 2);
+		if (!upper)
+		    return -1;
+		memcpy(upper, term->text, len);
+		upper[len] = '\xff';
+		upper[len + 1] = '\0';
+		result = sqlite3_bind_text(stmt, (*param)++, upper, len + 1, free);
 	    }
 	    break;
-	case FIELD_AUTHOR:
-	    // Silences compiler error about declarations not being statements
-	    ;
-	    // Parse the author, get that author's id, and get that condition on the query.
-	    char *name[3];
-	    // For simplicity, I will assume that the author's name sections are seperated by a space.
-	    name[0] = strtok(search_text, " ");
-	    name[1] = strtok(0, " ");
-	    // This one should go to the end, so the space may be superfluous.
-	    name[2] = strtok(0, " ");
-	    // Now we get the author id.
-	    if (sqlite3_prepare_v2(db, "SELECT AuthorID FROM Author WHERE AuthorFirst = ? AND "
-			    "AuthorMiddle = ? AND AuthorLast = ?", -1, &stmt, 0) != SQLITE_OK)
-		return -1;
-	    // Bind the parameters to prevent SQL injection
-	    if (sqlite3_bind_text(stmt, 1, name[0], -1, 0) != SQLITE_OK){
-		sqlite3_finalize(stmt);
-		return -1;
-	    }
-	    if (sqlite3_bind_text(stmt, 2, name[1], -1, 0) != SQLITE_OK){
-		sqlite3_finalize(stmt);
-		return -1;
-	    }
-	    if (sqlite3_bind_text(stmt, 3, name[2], -1, 0) != SQLITE_OK){
-		sqlite3_finalize(stmt);
-		return -1;
-	    }
-	    int res;
-	    int *list;
-	    while (sqlite3_step(stmt) == SQLITE_ROW){
-		// TODO: Gather the list of values.
-	    }
-	    if (sizeof(list) > sizeof(int *)){
-		// TODO: If more than 1 ID returned, we need to disambiguate farther.
-		// TODO: Set result after disambiguation.
-	    }
-	    else if (sizeof(list) < sizeof(int *)){
-		// No results, so return an empty list
-		sqlite3_finalize(stmt);
-		return 0;
-	    }
-	    else{
-		res = list[0];
-	    }
-	    // TODO: Assert that result has been set.
-
-	    // TODO: Use the author id in the WHERE clause we append to the query.
-
-	    // Run the search
-	    if (sqlite3_prepare_v2(db, querybuf, -1, &stmt, 0) != SQLITE_OK)
+	case FIELD_AUTHOR:{
+	    snprintf(name_text, sizeof(name_text), "%s", term->text);
+	    split_typed_name(name_text, name_parts);
+	    // An unknown author matches nothing, which id 0 gives us.
+	    int author_id = find_author_id(db, name_parts);
+	    if (author_id < 0)
 		return -1;
+	    result = sqlite3_bind_int(stmt, (*param)++, author_id);
 	    break;
+	}
 	case FIELD_OWNER:
-	    // TODO: Parse the owner, get that owner's id, and get that condition in the query.
-	    if (sqlite3_prepare_v2(db, querybuf, -1, &stmt, 0) != SQLITE_OK)
-		return -1;
-	    break;
-	case FIELD_BINDING:
-	    strcat(querybuf, "WHERE TypeName = ?");
-	    if (sqlite3_prepare_v2(db, querybuf, -1, &stmt, 0) != SQLITE_OK)
-		return -1;
-	    if (sqlite3_bind_text(stmt, 1, search_text, -1, 0) != SQLITE_OK){
-		sqlite3_finalize(stmt);
-		return -1;
-	    }
+	    snprintf(name_text, sizeof(name_text), "%s", term->text);
+	    split_typed_name(name_text, name_parts);
+	    // First, middle and last, as find_author_id() matches them.
+	    for (int i = 0; i < 3 && result == SQLITE_OK; ++i)
+		result = sqlite3_bind_text(stmt, (*param)++, name_parts[i], -1, SQLITE_TRANSIENT);
 	    break;
 	case FIELD_YEAR:
-	    strcat(querybuf, "WHERE Year = ?");
-	    if (sqlite3_prepare_v2(db, querybuf, -1, &stmt, 0) != SQLITE_OK)
-		return -1;
-	    if (sqlite3_bind_int(stmt, 1, atoi(search_text)) != SQLITE_OK){
-		sqlite3_finalize(stmt);
-		return -1;
+	    if (term->match == MATCH_RANGE){
+		if ((result = sqlite3_bind_int(stmt, (*param)++, term->low)) == SQLITE_OK)
+		    result = sqlite3_bind_int(stmt, (*param)++, term->high);
 	    }
+	    else
+		result = sqlite3_bind_int(stmt, (*param)++, atoi(term->text));
 	    break;
-	case FIELD_ISBN:
-	    strcat(querybuf, "WHERE ISBN = ?");
-	    if (sqlite3_prepare_v2(db, querybuf, -1, &stmt, 0) != SQLITE_OK)
-		return -1;
-	    if (sqlite3_bind_text(stmt, 1, search_text, -1, 0) != SQLITE_OK){
-		sqlite3_finalize(stmt);
-		return -1;
-	    }
+	case FIELD_ANY:{
+	    // Words match by prefix, and quoted text matches as a phrase.
+	    char *match = make_match_query(term->text);
+	    // Nothing to search for gives no results, which an empty phrase does.
+	    result = sqlite3_bind_text(stmt, (*param)++, match ? match : "\"\"", -1, match ? free : 0);
 	    break;
-	case FIELD_GENRE:
-	    //TODO: Implement
-	    if (sqlite3_prepare_v2(db, querybuf, -1, &stmt, 0) != SQLITE_OK)
-		return -1;
+	}
+    }
+    return result == SQLITE_OK ? 0 : -1;
+}
+
+/**
+ * Does the work of search_open_terms().
+ */
+static search_cursor *open_terms(sqlite3 *db, const search_term * const terms, int count,
+	const search_page * const page){
+    if (!db || !terms || count < 1 || count > SEARCH_MAX_TERMS)
+	return 0;
+    // Bind the terms in a fixed order, so the same terms in any order share a query.
+    const search_term *sorted[SEARCH_MAX_TERMS];
+    int conditions[SEARCH_MAX_TERMS];
+    int any = 0;
+    for (int i = 0; i < count; ++i){
+	int condition = find_condition(&terms[i]);
+	if (condition < 0 || (terms[i].match != MATCH_RANGE && !terms[i].text))
+	    return 0;
+	// FTS5 only allows one MATCH on the table.
+	if (terms[i].field == FIELD_ANY && any++)
+	    return 0;
+	int pos = i;
+	while (pos > 0 && conditions[pos - 1] > condition){
+	    conditions[pos] = conditions[pos - 1];
+	    sorted[pos] = sorted[pos - 1];
+	    --pos;
+	}
+	conditions[pos] = condition;
+	sorted[pos] = &terms[i];
+    }
+    int keyset = page && page->after_printing_id > 0 && !any;
+    int flags = (keyset ? SHAPE_KEYSET : 0) | (page ? SHAPE_ORDERED : 0) |
+	(page && page->limit > 0 ? SHAPE_LIMIT : 0);
+    int owned;
+    const char *sql = search_sql(conditions, count, flags, &owned);
+    if (!sql)
+	return 0;
+    sqlite3_stmt *stmt = get_cursor_stmt(db, sql);
+    if (owned)
+	free((char *)sql);
+    if (!stmt)
+	return 0;
+    search_cursor *cursor = calloc(1, sizeof(search_cursor));
+    if (!cursor){
+	release_cursor_stmt(stmt);
+	return 0;
+    }
+    cursor->stmt = stmt;
+    int param = 1;
+    for (int i = 0; i < count; ++i){
+	if (bind_term(db, stmt, sorted[i], &param) != 0){
+	    search_close(cursor);
+	    return 0;
+	}
+    }
+    if (keyset && sqlite3_bind_int(stmt, param++, page->after_printing_id) != SQLITE_OK){
+	search_close(cursor);
+	return 0;
+    }
+    if (page && page->limit > 0){
+	if (sqlite3_bind_int(stmt, param, page->limit) != SQLITE_OK ||
+		sqlite3_bind_int(stmt, param + 1, page->offset) != SQLITE_OK){
+	    search_close(cursor);
+	    return 0;
+	}
+    }
+    return cursor;
+}
+
+/**
+ * Starts a search for books matching every one of several terms,
+ * such as hardcovers by one author published after 1960.
+ * The terms are compiled into a single query, which is cached by its shape.
+ *
+ * @param db
+ * The database we are using
+ *
+ * @param terms
+ * What to search for. Every term must match.
+ * Prefixes can be matched on Title and ISBN, and ranges on Year.
+ * At most one FIELD_ANY term may be given.
+ *
+ * @param count
+ * The number of terms, from 1 to SEARCH_MAX_TERMS.
+ *
+ * @param page
+ * Which part of the results to return, or 0 for all of them.
+ *
+ * @return
+ * The cursor to read the results with, or 0 on failure or if the terms are not valid.
+ * Terms that cannot match anything, like an unknown author, give a cursor with no results.
+ *
+ * @note Cursors share the cached statement for their query. A cursor opened
+ * while another of the same shape is still open gets a statement of its own.
+ */
+search_cursor *search_open_terms(sqlite3 *db, const search_term * const terms, int count,
+	const search_page * const page){
+    long long start = stats_start();
+    search_cursor *cursor = open_terms(db, terms, count, page);
+    if (cursor)
+	// Counted once the search is closed.
+	cursor->started = start;
+    else
+	stats_end(STATS_SEARCH, start, 1);
+    return cursor;
+}
+
+/**
+ * Starts a search using a given field
+ *
+ * @param db
+ * The database we are using
+ *
+ * @param search_field
+ * The field we will search for results
+ *
+ * @param search_text
+ * The text we will search for in the specified field.
+ *
+ * @param page
+ * Which part of the results to return, or 0 for all of them.
+ *
+ * @return
+ * The cursor to read the results with, or 0 on failure.
+ * A search that cannot match anything, like an unknown author, gives a
+ * cursor with no results.
+ */
+search_cursor *search_open(sqlite3 *db, fields search_field, char * const search_text, const search_page * const page){
+    if (!db || !search_text)
+	return 0;
+    if (search_field < FIELD_TITLE || search_field > FIELD_ANY)
+	// TODO: Throw an error
+	return 0;
+    const search_term term = {search_field, MATCH_EQUAL, search_text, 0, 0};
+    return search_open_terms(db, &term, 1, page);
+}
+
+// The query for search_open_books(), built the first time it is needed.
+static char *books_sql = 0;
+static pthread_once_t books_sql_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Builds the query for search_open_books(), with a parameter for each book.
+ * Parameters left unbound are NULL, and match nothing.
+ *
+ * The ids drive the join, in the order given, so rows come a book at a time
+ * and reading the first few does not mean gathering every printing of every
+ * book. Sorting them would.
+ */
+static void build_books_sql(){
+    size_t len = 0, size = 0;
+    char value[32];
+    if (append_sql(&books_sql, &len, &size, "WITH Picked(Position, BookID) AS (VALUES (1, ?)") != 0)
+	return;
+    for (int i = 2; i <= SEARCH_BOOKS_MAX; ++i){
+	snprintf(value, sizeof(value), ", (%d, ?)", i);
+	if (append_sql(&books_sql, &len, &size, value) != 0)
+	    return;
+    }
+    append_sql(&books_sql, &len, &size, ") " SEARCH_COLUMNS
+	" FROM Picked CROSS JOIN Book ON Book.BookID = Picked.BookID" SEARCH_JOINS);
+}
+
+/**
+ * Starts a search for every printing of a few books already picked out by id,
+ * e.g. by a prefix_query. Results come book by book, in the order given.
+ *
+ * @param db
+ * The database we are using
+ *
+ * @param book_ids
+ * The BookIDs to read. Ids no longer in the database are skipped.
+ *
+ * @param count
+ * The number of ids, up to SEARCH_BOOKS_MAX. With none, there are no results.
+ *
+ * @return
+ * The cursor to read the results with, or 0 on failure.
+ */
+search_cursor *search_open_books(sqlite3 *db, const int *book_ids, int count){
+    long long start = stats_start();
+    pthread_once(&books_sql_once, build_books_sql);
+    sqlite3_stmt *stmt = db && books_sql && count >= 0 && count <= SEARCH_BOOKS_MAX ? get_cursor_stmt(db, books_sql) : 0;
+    search_cursor *cursor = stmt ? calloc(1, sizeof(search_cursor)) : 0;
+    if (!cursor){
+	release_cursor_stmt(stmt);
+	stats_end(STATS_SEARCH, start, 1);
+	return 0;
+    }
+    cursor->stmt = stmt;
+    cursor->started = start;
+    // Ids bound by an earlier, longer search would otherwise still be there.
+    sqlite3_clear_bindings(stmt);
+    for (int i = 0; i < count; ++i){
+	if (sqlite3_bind_int(stmt, i + 1, book_ids[i]) != SQLITE_OK){
+	    cursor->failed = 1;
+	    search_close(cursor);
+	    return 0;
+	}
+    }
+    return cursor;
+}
+
+/**
+ * Gets the text of a column, or null if the column is NULL.
+ */
+static const char *column_text(sqlite3_stmt *stmt, int col){
+    return (const char *)sqlite3_column_text(stmt, col);
+}
+
+/**
+ * Cuts the next item off a separated list, in place.
+ *
+ * @param pos
+ * Where the list continues. Set to 0 once the list is used up.
+ *
+ * @return
+ * The item, or 0 if the list is used up.
+ */
+static char *next_list_item(char **pos, char sep){
+    char *item = *pos;
+    if (!item)
+	return 0;
+    char *end = strchr(item, sep);
+    if (end){
+	*end = '\0';
+	*pos = end + 1;
+    }
+    else
+	*pos = 0;
+    return item;
+}
+
+/**
+ * Makes sure a cursor has room for a number of authors and list characters.
+ *
+ * @return
+ * 0 on success, -1 if out of memory.
+ */
+static int reserve_lists(search_cursor *cursor, size_t authors, size_t chars){
+    if (authors > cursor->author_slots){
+	name *grown = realloc(cursor->authors, sizeof(name) * authors * 2);
+	if (!grown)
+	    return -1;
+	cursor->authors = grown;
+	cursor->author_slots = authors * 2;
+    }
+    if (chars > cursor->lists_size){
+	char *grown = realloc(cursor->lists, chars * 2);
+	if (!grown)
+	    return -1;
+	cursor->lists = grown;
+	cursor->lists_size = chars * 2;
+    }
+    return 0;
+}
+
+/**
+ * Reads the next search result.
+ *
+ * @param cursor
+ * The cursor from search_open()
+ *
+ * @param result
+ * Where to put the result. Its strings and author list borrow memory from the
+ * cursor, and are only valid until the next call on the cursor.
+ *
+ * @param genre_slots
+ * How many genre pointers the caller made room for after result.
+ * Must be at least 1, for the terminator. Genres past the room are left out.
+ *
+ * @retval 1
+ * result holds the next result.
+ *
+ * @retval 0
+ * There are no more results.
+ *
+ * @retval -1
+ * Reading the result failed.
+ *
+ * @note There is one result per printing and owner, with all of the book's
+ * authors, in order, and genres.
+ */
+int search_next(search_cursor *cursor, book *result, size_t genre_slots){
+    if (!cursor || !result || genre_slots < 1)
+	return -1;
+    sqlite3_stmt *stmt = cursor->stmt;
+    int res = sqlite3_step(stmt);
+    if (res == SQLITE_DONE)
+	return 0;
+    if (res != SQLITE_ROW){
+	cursor->failed = 1;
+	return -1;
+    }
+    cursor->last_printing_id = sqlite3_column_int(stmt, SEARCH_COL_PRINTING_ID);
+    result->title = column_text(stmt, SEARCH_COL_TITLE);
+    result->subtitle = column_text(stmt, SEARCH_COL_SUBTITLE);
+    result->owner.last = column_text(stmt, SEARCH_COL_OWNER_LAST);
+    result->owner.first = column_text(stmt, SEARCH_COL_OWNER_FIRST);
+    result->owner.middle = column_text(stmt, SEARCH_COL_OWNER_MIDDLE);
+    result->owner.suffix = column_text(stmt, SEARCH_COL_OWNER_SUFFIX);
+    result->year = sqlite3_column_int(stmt, SEARCH_COL_YEAR);
+    result->edition_num = sqlite3_column_int(stmt, SEARCH_COL_EDITION);
+    result->quantity = sqlite3_column_int(stmt, SEARCH_COL_QUANTITY);
+    result->ISBN = column_text(stmt, SEARCH_COL_ISBN);
+    result->binding_type = column_text(stmt, SEARCH_COL_TYPE);
+
+    // Copy both lists into the cursor, so they can be split in place.
+    const char *authors = column_text(stmt, SEARCH_COL_AUTHORS);
+    const char *genres = column_text(stmt, SEARCH_COL_GENRES);
+    size_t authors_len = authors ? strlen(authors) + 1 : 0;
+    size_t genres_len = genres ? strlen(genres) + 1 : 0;
+    size_t author_count = 0;
+    for (const char *c = authors; c && *c; ++c)
+	author_count += *c == LIST_RECORD_SEP[0];
+    if (authors)
+	++author_count;
+    if (reserve_lists(cursor, author_count + 1, authors_len + genres_len + 1) != 0)
+	return -1;
+    char *authors_pos = authors ? memcpy(cursor->lists, authors, authors_len) : 0;
+    char *genres_pos = genres ? memcpy(cursor->lists + authors_len, genres, genres_len) : 0;
+
+    size_t count = 0;
+    char *author;
+    while ((author = next_list_item(&authors_pos, LIST_RECORD_SEP[0]))){
+	char *parts[4];
+	char *part_pos = author;
+	for (int i = 0; i < 4; ++i){
+	    parts[i] = next_list_item(&part_pos, LIST_FIELD_SEP[0]);
+	    // Missing names were stored as empty strings.
+	    if (i >= 2 && parts[i] && !*parts[i])
+		parts[i] = 0;
+	}
+	cursor->authors[count].last = parts[0];
+	cursor->authors[count].first = parts[1];
+	cursor->authors[count].middle = parts[2];
+	cursor->authors[count].suffix = parts[3];
+	++count;
+    }
+    cursor->authors[count].last = 0;
+    result->authors = cursor->authors;
+
+    count = 0;
+    char *genre;
+    while (count + 1 < genre_slots && (genre = next_list_item(&genres_pos, LIST_RECORD_SEP[0])))
+	result->genre[count++] = genre;
+    result->genre[count] = 0;
+    return 1;
+}
+
+/**
+ * Copies a book, with its authors, genres and every string, into an arena.
+ *
+ * @param pool
+ * The arena to copy into.
+ *
+ * @param info
+ * The book to copy.
+ *
+ * @return
+ * The copy, or 0 if out of memory.
+ */
+book *copy_book(arena *pool, const book * const info){
+    size_t authors = 0, genres = 0;
+    while (info->authors && info->authors[authors].last)
+	++authors;
+    while (info->genre[genres])
+	++genres;
+    book *copy = arena_alloc(pool, sizeof(book) + sizeof(const char *) * (genres + 1));
+    name *author_copy = arena_alloc(pool, sizeof(name) * (authors + 1));
+    if (!copy || !author_copy)
+	return 0;
+    copy->title = arena_strdup(pool, info->title);
+    copy->subtitle = arena_strdup(pool, info->subtitle);
+    copy->owner.last = arena_strdup(pool, info->owner.last);
+    copy->owner.first = arena_strdup(pool, info->owner.first);
+    copy->owner.middle = arena_strdup(pool, info->owner.middle);
+    copy->owner.suffix = arena_strdup(pool, info->owner.suffix);
+    copy->year = info->year;
+    copy->edition_num = info->edition_num;
+    copy->quantity = info->quantity;
+    copy->ISBN = arena_strdup(pool, info->ISBN);
+    copy->binding_type = arena_strdup(pool, info->binding_type);
+    for (size_t i = 0; i < authors; ++i){
+	author_copy[i].last = arena_strdup(pool, info->authors[i].last);
+	author_copy[i].first = arena_strdup(pool, info->authors[i].first);
+	author_copy[i].middle = arena_strdup(pool, info->authors[i].middle);
+	author_copy[i].suffix = arena_strdup(pool, info->authors[i].suffix);
+    }
+    author_copy[authors].last = 0;
+    copy->authors = author_copy;
+    for (size_t i = 0; i < genres; ++i)
+	copy->genre[i] = arena_strdup(pool, info->genre[i]);
+    copy->genre[genres] = 0;
+    return copy;
+}
+
+/**
+ * Reads the next page of search results into an arena.
+ * Every book, author list and string is copied into the arena, so the
+ * whole page is freed at once with arena_free(), and reading a page costs
+ * a handful of allocations rather than several per result.
+ *
+ * @param cursor
+ * The cursor from search_open()
+ *
+ * @param pool
+ * The arena to copy the results into.
+ *
+ * @param max
+ * The most results to read.
+ *
+ * @param count
+ * Where to store the number of results read. Fewer than max means the
+ * search has no more results.
+ *
+ * @return
+ * Array of the results, allocated in the arena, or 0 on failure.
+ * At most SEARCH_MAX_GENRES genres are kept per result.
+ */
+book **search_collect(search_cursor *cursor, arena *pool, size_t max, size_t *count){
+    *count = 0;
+    if (!cursor || !pool)
+	return 0;
+    book **results = arena_alloc(pool, sizeof(book *) * (max ? max : 1));
+    // Scratch space for each row, with room for the genres and the terminator.
+    book *row = arena_alloc(pool, sizeof(book) + sizeof(const char *) * (SEARCH_MAX_GENRES + 1));
+    if (!results || !row)
+	return 0;
+    int res = 0;
+    while (*count < max && (res = search_next(cursor, row, SEARCH_MAX_GENRES + 1)) == 1){
+	book *copy = copy_book(pool, row);
+	if (!copy){
+	    res = -1;
 	    break;
-	default:
-	    ;// TODO: Throw an error
+	}
+	results[(*count)++] = copy;
     }
-    // Now we get the return values.
-    while (sqlite3_step(stmt) == SQLITE_ROW){
-	// TODO: Get the values
+    return res < 0 ? 0 : results;
+}
+
+/**
+ * Gets the PrintingID of the last result read, to continue from with
+ * search_page.after_printing_id.
+ *
+ * @param cursor
+ * The cursor from search_open()
+ *
+ * @return
+ * The PrintingID, or 0 if no result has been read.
+ */
+int search_last_printing(const search_cursor * const cursor){
+    return cursor ? cursor->last_printing_id : 0;
+}
+
+/**
+ * Ends a search and frees the cursor.
+ *
+ * @param cursor
+ * The cursor from search_open(). May be 0.
+ */
+void search_close(search_cursor *cursor){
+    if (!cursor)
+	return;
+    // A cursor that never got going is counted by whoever opened it.
+    if (cursor->started)
+	stats_end(STATS_SEARCH, cursor->started, cursor->failed);
+    release_cursor_stmt(cursor->stmt);
+    free(cursor->lists);
+    free(cursor->authors);
+    free(cursor);
+}
+
+/**
+ * Search using a given field
+ *
+ * @param db
+ * The database we are using
+ *
+ * @param search_field
+ * The field we will search for results
+ *
+ * @param search_text
+ * The text we will search for in the specified field
+ *
+ * @return
+ * The number of results, or -1 on failure.
+ *
+ * @note Use search_open() to read the results themselves.
+ */
+int search(sqlite3 *db, fields search_field, char * const search_text){
+    search_cursor *cursor = search_open(db, search_field, search_text, 0);
+    if (!cursor)
+	return -1;
+    // Only counting, so no room for genres is needed beyond the terminator.
+    book *result = malloc(sizeof(book) + sizeof(const char *));
+    if (!result){
+	search_close(cursor);
+	return -1;
     }
-    // TODO: Implement
-    return -1;
+    int count = 0;
+    int res;
+    while ((res = search_next(cursor, result, 1)) == 1)
+	++count;
+    free(result);
+    search_close(cursor);
+    return res == 0 ? count : -1;
+}
+
+/**
+ * Checks that every indexed search path is planned as an index search,
+ * rather than a full scan of one of the tables.
+ *
+ * @param db
+ * The database we are using. Must have the current schema.
+ *
+ * @retval 0
+ * All search paths use indexes.
+ *
+ * @retval -1
+ * A search path scans a table, or the plan could not be retrieved.
+ * The offending plan step is written to stderr.
+ */
+int check_query_plans(sqlite3 *db){
+    if (!db)
+	return -1;
+    int failed = 0;
+    // Every condition on its own, then all the non-text ones together.
+    for (unsigned int i = 0; i <= TERM_CONDITIONS; ++i){
+	int conditions[SEARCH_MAX_TERMS];
+	int count = 0;
+	char label[100];
+	if (i < TERM_CONDITIONS){
+	    conditions[count++] = i;
+	    snprintf(label, sizeof(label), "%s%s", field_name[term_condition[i].field - 1],
+		term_condition[i].match == MATCH_PREFIX ? " prefix" :
+		term_condition[i].match == MATCH_RANGE ? " range" : "");
+	}
+	else{
+	    for (unsigned int j = 0; j < TERM_CONDITIONS && count < SEARCH_MAX_TERMS; ++j){
+		if (term_condition[j].field != FIELD_ANY && term_condition[j].field != FIELD_TITLE)
+		    conditions[count++] = j;
+	    }
+	    snprintf(label, sizeof(label), "several fields");
+	}
+	char *query = build_search_sql(conditions, count, 0);
+	size_t len = query ? strlen(query) : 0;
+	char *explain = query ? malloc(len + 20) : 0;
+	if (!explain){
+	    free(query);
+	    return -1;
+	}
+	memcpy(explain, "EXPLAIN QUERY PLAN ", 19);
+	memcpy(explain + 19, query, len + 1);
+	free(query);
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(db, explain, -1, &stmt, 0) != SQLITE_OK){
+	    fprintf(stderr, "Search on %s cannot be planned: %s\n", label, sqlite3_errmsg(db));
+	    free(explain);
+	    return -1;
+	}
+	free(explain);
+	int result;
+	while ((result = sqlite3_step(stmt)) == SQLITE_ROW){
+	    // The last column holds the description of the step, e.g. "SCAN Book".
+	    // Full-text lookups show up as scans of the virtual table, but use its index.
+	    // Type only holds the few kinds of binding, so the planner may rightly scan it.
+	    // The author list is sorted into a subquery holding one book's authors, then read back.
+	    const char *detail = (const char *)sqlite3_column_text(stmt, 3);
+	    if (detail && strncmp(detail, "SCAN ", 5) == 0 && !strstr(detail, "VIRTUAL TABLE INDEX") &&
+		    strcmp(detail, "SCAN Type") != 0 && strncmp(detail, "SCAN (subquery", 14) != 0){
+		fprintf(stderr, "Search on %s scans a table: %s\n", label, detail);
+		failed = 1;
+	    }
+	}
+	sqlite3_finalize(stmt);
+	if (result != SQLITE_DONE)
+	    return -1;
+    }
+    return failed ? -1 : 0;
 }
 
+/*
+ * Secondary indexes for the search and add paths.
+ * The composite ones carry the join columns along, so SQLite can use them
+ * without going back to the table.
+ */
+static const char * const index_sql[] = {
+    "CREATE INDEX IF NOT EXISTS BookTitleIndex ON Book(Title, Subtitle)",
+    "CREATE INDEX IF NOT EXISTS PrintingBookIndex ON Printing(BookID, ISBN, Year, TypeID, PrintingNum)",
+    "CREATE INDEX IF NOT EXISTS PrintingISBNIndex ON Printing(ISBN, BookID, TypeID)",
+    "CREATE INDEX IF NOT EXISTS PrintingYearIndex ON Printing(Year, BookID, TypeID)",
+    "CREATE INDEX IF NOT EXISTS PrintingTypeIndex ON Printing(TypeID, BookID)",
+    "CREATE INDEX IF NOT EXISTS TypeNameIndex ON Type(TypeName)",
+    "CREATE INDEX IF NOT EXISTS BookAuthorAuthorIndex ON BookAuthor(AuthorID, BookID)",
+    "CREATE INDEX IF NOT EXISTS BookGenreGenreIndex ON BookGenre(GenreID, BookID)",
+    "CREATE INDEX IF NOT EXISTS BookOwnerOwnerIndex ON BookOwner(OwnerID, PrintingID)",
+    "CREATE INDEX IF NOT EXISTS AuthorNameIndex ON Author(AuthorLast, AuthorFirst)",
+    "CREATE INDEX IF NOT EXISTS OwnerNameIndex ON Owner(OwnerLast, OwnerFirst)",
+    "CREATE INDEX IF NOT EXISTS GenreNameIndex ON Genre(GenreName)"
+};
+
 /**
- * Create a new book database.
+ * Creates the secondary indexes.
+ * Used both by new_db() and when upgrading to schema versions 2 and 4.
  *
  * @param db
- * Reference to the database being created.
+ * The database to index
  *
  * @retval 0
- * Successfully created the database.
+ * All indexes exist.
  *
  * @retval -1
- * Failed to create the database.
+ * Failed to create an index.
  */
-int new_db(sqlite3 *db){
+int create_indexes(sqlite3 *db){
     if (!db)
 	return -1;
-    sqlite3_stmt *stmt;
-    // TODO: Make this a transaction
+    for (unsigned int i = 0; i < sizeof(index_sql) / sizeof(index_sql[0]); ++i){
+	if (sqlite3_exec(db, index_sql[i], 0, 0, 0) != SQLITE_OK)
+	    return -1;
+    }
+    // Statistics are gathered by db_upgrade() once its steps are committed,
+    // so they do not hold the step's write lock. A new database has none to gather.
+    return 0;
+}
 
-    // Table creation.
+/**
+ * Gathers statistics for the planner from a sample of each index.
+ * Sampling is plenty for the planner, and much quicker than a full ANALYZE
+ * on a large catalog, so it does not hold the write lock for long.
+ *
+ * Statistics are optional: without them the planner still uses the indexes,
+ * so callers carry on if this fails. The sample limit is reset either way,
+ * so a later ANALYZE on the connection is not sampled by accident.
+ *
+ * @param db
+ * The database to analyze
+ */
+void analyze_sampled(sqlite3 *db){
+    if (sqlite3_exec(db, "PRAGMA analysis_limit = 1000", 0, 0, 0) == SQLITE_OK)
+	sqlite3_exec(db, "ANALYZE", 0, 0, 0);
+    sqlite3_exec(db, "PRAGMA analysis_limit = 0", 0, 0, 0);
+}
 
-    // Book
-    if (sqlite3_prepare_v2(db, "CREATE TABLE Book("
+/*
+ * The tables and initial data of a new database, as one script.
+ * Indexes and the full-text index are added after it by new_db(),
+ * since upgrades need to create those on their own.
+ */
+static const char schema_sql[] =
+    "CREATE TABLE Book("
 	"BookID   INTEGER PRIMARY KEY,"
 	"Title    TEXT NOT NULL,"
-	"Subtitle TEXT)", -1, &stmt, 0) != SQLITE_OK)
-	  return -1;
-    if (sqlite3_step(stmt) != SQLITE_DONE){
-	sqlite3_finalize(stmt);
-	return -1;
-    }
-    sqlite3_finalize(stmt);
-
-    // Owner
-    if (sqlite3_prepare_v2(db, "CREATE TABLE Owner("
+	"Subtitle TEXT);"
+    "CREATE TABLE Owner("
 	"OwnerID     INTEGER PRIMARY KEY,"
 	"OwnerLast   TEXT NOT NULL,"
 	"OwnerFirst  TEXT NOT NULL,"
 	"OwnerMiddle TEXT,"
-	"OwnerSuffix TEXT)", -1, &stmt, 0) != SQLITE_OK)
-	  return -1;
-    if (sqlite3_step(stmt) != SQLITE_DONE){
-	sqlite3_finalize(stmt);
-	return -1;
-    }
-    sqlite3_finalize(stmt);
-
-    // Type
-    if (sqlite3_prepare_v2(db, "CREATE TABLE Type("
+	"OwnerSuffix TEXT);"
+    "CREATE TABLE Type("
 	"TypeID   INTEGER PRIMARY KEY,"
-	"TypeName TEXT NOT NULL)", -1, &stmt, 0) != SQLITE_OK)
-	  return -1;
-    if (sqlite3_step(stmt) != SQLITE_DONE){
-	sqlite3_finalize(stmt);
-	return -1;
-    }
-    sqlite3_finalize(stmt);
-
-    // Genre
-    if (sqlite3_prepare_v2(db, "CREATE TABLE Genre("
+	"TypeName TEXT NOT NULL);"
+    "CREATE TABLE Genre("
 	"GenreID   INTEGER PRIMARY KEY,"
-	"GenreName TEXT NOT NULL)", -1, &stmt, 0) != SQLITE_OK)
-	  return -1;
-    if (sqlite3_step(stmt) != SQLITE_DONE){
-	sqlite3_finalize(stmt);
-	return -1;
-    }
-    sqlite3_finalize(stmt);
-
-    // Author
-    if (sqlite3_prepare_v2(db, "CREATE_TABLE Author("
+	"GenreName TEXT NOT NULL);"
+    "CREATE TABLE Author("
 	"AuthorID     INTEGER PRIMARY KEY,"
 	"AuthorLast   TEXT NOT NULL,"
 	"AuthorFirst  TEXT NOT NULL,"
 	"AuthorMiddle TEXT,"
-	"AuthorSuffix TEXT)", -1, &stmt, 0) != SQLITE_OK)
-	  return -1;
-    if (sqlite3_step(stmt) != SQLITE_DONE){
-	sqlite3_finalize(stmt);
-	return -1;
-    }
-    sqlite3_finalize(stmt);
-
-    // Printing
-    if (sqlite3_prepare_v2(db, "CREATE TABLE Printing("
+	"AuthorSuffix TEXT);"
+    "CREATE TABLE Printing("
 	"PrintingID  INTEGER PRIMARY KEY,"
 	"BookID      INTEGER REFERENCES Book(BookID),"
 	"ISBN        TEXT,"
 	"Year        INTEGER,"
 	"TypeID      INTEGER REFERENCES Type(TypeID),"
-	"PrintingNum INTEGER)", -1, &stmt, 0) != SQLITE_OK)
-	  return -1;
-    if (sqlite3_step(stmt) != SQLITE_DONE){
-	sqlite3_finalize(stmt);
-	return -1;
-    }
-    sqlite3_finalize(stmt);
-
-    // BookOwner
-    if (sqlite3_prepare_v2(db, "CREATE TABLE BookOwner("
+	"PrintingNum INTEGER,"
+	"ISBN13      INTEGER);"
+    "CREATE TABLE BookOwner("
 	"PrintingID INTEGER REFERENCES Printing(PrintingID),"
 	"OwnerID    INTEGER REFERENCES Owner(OwnerID),"
-	"Quantity   INTEGER NOT NULL),"
-	"PRIMARY KEY(PrintingID, OwnerID))", -1, &stmt, 0) != SQLITE_OK)
-	  return -1;
-    if (sqlite3_step(stmt) != SQLITE_DONE){
-	sqlite3_finalize(stmt);
-	return -1;
-    }
-    sqlite3_finalize(stmt);
-
-    // BookGenre
-    if (sqlite3_prepare_v2(db, "CREATE TABLE BookGenre("
+	"Quantity   INTEGER NOT NULL,"
+	"PRIMARY KEY(PrintingID, OwnerID));"
+    "CREATE TABLE BookGenre("
 	"BookID  INTEGER REFERENCES Book(BookID),"
 	"GenreID INTEGER REFERENCES Genre(GenreID),"
-	"PRIMARY KEY(BookID, GenreID))", -1, &stmt, 0) != SQLITE_OK)
-	  return -1;
-    if (sqlite3_step(stmt) != SQLITE_DONE){
-	sqlite3_finalize(stmt);
-	return -1;
-    }
-    sqlite3_finalize(stmt);
-
-    // BookAuthor
-    if (sqlite3_prepare_v2(db, "CREATE TABLE BookAuthor("
+	"PRIMARY KEY(BookID, GenreID));"
+    "CREATE TABLE BookAuthor("
 	"BookID      INTEGER REFERENCES Book(BookID),"
 	"AuthorID    INTEGER REFERENCES Author(AuthorID),"
 	"AuthorOrder INTEGER,"
-	"PRIMARY KEY(BookID, AuthorID))", -1, &stmt, 0) != SQLITE_OK)
-	  return -1;
-    if (sqlite3_step(stmt) != SQLITE_DONE){
-	sqlite3_finalize(stmt);
-	return -1;
-    }
-    sqlite3_finalize(stmt);
+	"PRIMARY KEY(BookID, AuthorID));"
+    "CREATE TABLE Version("
+	"SchemaVersion INTEGER NOT NULL);"
+    // The book types -- hardcover & softcover
+    "INSERT INTO Type (TypeID, TypeName) VALUES (1, 'Hardcover'), (2, 'Softcover');";
 
-    // Version
-    if (sqlite3_prepare(db, "CREATE TABLE Version("
-	"SchemaVersion INTEGER NOT NULL)", -1, &stmt, 0) != SQLITE_OK)
-	  return -1;
-    if (sqlite3_step(stmt) != SQLITE_DONE){
-	sqlite3_finalize(stmt);
-	return -1;
-    }
-    sqlite3_finalize(stmt);
-
-    // Now we add the initial data
-
-    // First, add the schema version
-    if (sqlite3_prepare_v2(db, "INSERT INTO Version VALUES (?)", -1, &stmt, 0) != SQLITE_OK)
+/**
+ * Create a new book database.
+ * Everything is created in one transaction, so a failure leaves the database empty.
+ *
+ * @param db
+ * Reference to the database being created.
+ *
+ * @retval 0
+ * Successfully created the database.
+ *
+ * @retval -1
+ * Failed to create the database.
+ */
+int new_db(sqlite3 *db){
+    if (!db)
 	return -1;
-    if (sqlite3_bind_int(stmt, 1, DB_SCHEMA_VERSION) != SQLITE_OK){
-	sqlite3_finalize(stmt);
+    long long start = stats_start();
+    if (sqlite3_exec(db, "BEGIN", 0, 0, 0) != SQLITE_OK){
+	stats_end(STATS_NEW_DB, start, 1);
 	return -1;
     }
-    if (sqlite3_step(stmt) != SQLITE_DONE){
-	sqlite3_finalize(stmt);
+    // The version is not a literal in the script, so it cannot drift from DB_SCHEMA_VERSION.
+    char version_sql[60];
+    snprintf(version_sql, sizeof(version_sql), "INSERT INTO Version VALUES (%d)", DB_SCHEMA_VERSION);
+    if (sqlite3_exec(db, schema_sql, 0, 0, 0) != SQLITE_OK ||
+	    sqlite3_exec(db, version_sql, 0, 0, 0) != SQLITE_OK ||
+	    create_indexes(db) != 0 ||
+	    // Full-text index for FIELD_ANY
+	    create_fulltext(db) != 0 ||
+	    create_isbn13(db) != 0 ||
+	    create_change_log(db) != 0 ||
+	    sqlite3_exec(db, "COMMIT", 0, 0, 0) != SQLITE_OK){
+	sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+	stats_end(STATS_NEW_DB, start, 1);
 	return -1;
     }
-    sqlite3_finalize(stmt);
+    // Initialization completed.
+    stats_end(STATS_NEW_DB, start, 0);
+    return 0;
+}
 
-    // Second, add the book types -- hardcover & softcover
+/*
+ * Connection settings for each performance profile. Indexed by db_profile.
+ */
+static const struct {
+    const char *name;
+    int open_flags;
+    // 0 leaves the journal mode as the database has it.
+    const char *journal_mode;
+    // 0 = OFF, 1 = NORMAL, 2 = FULL
+    int synchronous;
+    // Negative values are in KiB, as for PRAGMA cache_size.
+    int cache_size;
+    long long mmap_size;
+    // 1 = FILE, 2 = MEMORY
+    int temp_store;
+    // In milliseconds
+    int busy_timeout;
+} profiles[] = {
+    // Readers never wait on the writer under WAL, and NORMAL is still safe with it.
+    {"interactive", SQLITE_OPEN_READWRITE, "WAL", 1, -8192, 268435456LL, 2, 5000},
+    // WAL with NORMAL syncs only at checkpoints, so large batches cost little to keep safe.
+    // A power loss can lose the last batches, but not corrupt the database.
+    {"bulk-load", SQLITE_OPEN_READWRITE, "WAL", 1, -65536, 268435456LL, 2, 30000},
+    // Read only, with a large cache and map. The writer decides the journal mode.
+    {"read-only", SQLITE_OPEN_READONLY, 0, 1, -32768, 1073741824LL, 2, 5000}
+};
 
-    // Hardcover is added first.
-    if (sqlite3_prepare_v2(db, "INSERT INTO Type (TypeID, TypeName) "
-	"VALUES (?,?)", -1, &stmt, 0) != SQLITE_OK)
-	  return -1;
-    if (sqlite3_bind_int(stmt, 1, 1) != SQLITE_OK){
-	sqlite3_finalize(stmt);
-	return -1;
-    }
-    if (sqlite3_bind_text(stmt, 2, "Hardcover", -1, 0) != SQLITE_OK){
-	sqlite3_finalize(stmt);
-	return -1;
-    }
-    if (sqlite3_step(stmt) != SQLITE_DONE){
-	sqlite3_finalize(stmt);
-	return -1;
+/**
+ * Looks up a profile by the name describe_db_settings() reports.
+ *
+ * @param profile_name
+ * The name of the profile, e.g. "interactive".
+ *
+ * @return
+ * The profile, or -1 if there is no such profile.
+ */
+int find_profile(const char * const profile_name){
+    for (unsigned int i = 0; i < sizeof(profiles) / sizeof(profiles[0]); ++i){
+	if (strcmp(profiles[i].name, profile_name) == 0)
+	    return (int)i;
     }
-    sqlite3_finalize(stmt);
+    return -1;
+}
 
-    // Softcover is added second.
-    if (sqlite3_prepare_v2(db, "INSERT INTO Type (TypeID, TypeName) "
-	"VALUES (?,?)", -1, &stmt, 0) != SQLITE_OK)
-	  return -1;
-    if (sqlite3_bind_int(stmt, 1, 2) != SQLITE_OK){
-	sqlite3_finalize(stmt);
-	return -1;
+/**
+ * Applies the settings of a performance profile to a connection.
+ *
+ * @retval 0
+ * All settings applied.
+ *
+ * @retval -1
+ * A setting could not be applied.
+ */
+static int apply_profile(sqlite3 *db, db_profile profile){
+    char pragma[200];
+    if (profiles[profile].journal_mode){
+	snprintf(pragma, sizeof(pragma), "PRAGMA journal_mode = %s", profiles[profile].journal_mode);
+	if (sqlite3_exec(db, pragma, 0, 0, 0) != SQLITE_OK)
+	    return -1;
     }
-    if (sqlite3_bind_text(stmt, 2, "Softcover", -1, 0) != SQLITE_OK){
-	sqlite3_finalize(stmt);
+    snprintf(pragma, sizeof(pragma), "PRAGMA synchronous = %d; PRAGMA cache_size = %d;"
+	" PRAGMA mmap_size = %lld; PRAGMA temp_store = %d", profiles[profile].synchronous,
+	profiles[profile].cache_size, profiles[profile].mmap_size, profiles[profile].temp_store);
+    if (sqlite3_exec(db, pragma, 0, 0, 0) != SQLITE_OK)
 	return -1;
-    }
-    if (sqlite3_step(stmt) != SQLITE_DONE){
-	sqlite3_finalize(stmt);
+    if (profile == PROFILE_READ_ONLY && sqlite3_exec(db, "PRAGMA query_only = 1", 0, 0, 0) != SQLITE_OK)
 	return -1;
-    }
-    sqlite3_finalize(stmt);
+    return sqlite3_busy_timeout(db, profiles[profile].busy_timeout) == SQLITE_OK ? 0 : -1;
+}
 
-    // Initialization completed.
-    return 0;
+/**
+ * Gets the integer result of a pragma.
+ */
+static sqlite3_int64 pragma_int(sqlite3 *db, const char * const sql){
+    sqlite3_stmt *stmt = get_stmt(db, sql);
+    if (!stmt)
+	return -1;
+    sqlite3_int64 value = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : -1;
+    release_stmt(stmt);
+    return value;
 }
 
 /**
- * Opens a database and performs some sanity checks.
+ * Describes the settings a connection is really running with,
+ * as read back from SQLite rather than as requested.
  *
  * @param db
- * A reference to the database pointer. The opened database will
- * be stored in the database pointer
+ * The connection to describe
  *
- * @param path
- * The database file to attempt to open.
+ * @param profile
+ * The profile the connection was opened with.
+ *
+ * @param buf
+ * Where to write the description.
+ *
+ * @param len
+ * The size of buf.
+ *
+ * @retval 0
+ * Description written.
  *
  * @retval -1
- * Opening the database failed.
+ * The settings could not be read.
+ */
+int describe_db_settings(sqlite3 *db, db_profile profile, char *buf, size_t len){
+    if (!db)
+	return -1;
+    sqlite3_stmt *stmt = get_stmt(db, "PRAGMA journal_mode");
+    if (!stmt)
+	return -1;
+    char journal_mode[20] = "unknown";
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+	snprintf(journal_mode, sizeof(journal_mode), "%s", (const char *)sqlite3_column_text(stmt, 0));
+    release_stmt(stmt);
+    // busy_timeout can only be read back through the pragma.
+    snprintf(buf, len, "profile=%s journal_mode=%s synchronous=%lld cache_size=%lld"
+	" mmap_size=%lld temp_store=%lld busy_timeout=%lld", profiles[profile].name, journal_mode,
+	(long long)pragma_int(db, "PRAGMA synchronous"), (long long)pragma_int(db, "PRAGMA cache_size"),
+	(long long)pragma_int(db, "PRAGMA mmap_size"), (long long)pragma_int(db, "PRAGMA temp_store"),
+	(long long)pragma_int(db, "PRAGMA busy_timeout"));
+    return 0;
+}
+
+/**
+ * Checks that a database has the schema version this program expects.
+ *
+ * @param conn
+ * The connection to check.
+ *
+ * @retval -1
+ * The version could not be read.
  *
  * @retval 1
- * The database exists, but is not the correct version.
+ * The database is not the correct version.
+ *
+ * @retval 2
+ * The database is an older version, which db_upgrade() can bring up to date.
  *
  * @retval 0
- * Database exists and passes all sanity checks.
+ * The database is the correct version.
  */
-int open_db(const char * const path){
-    int result = sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE, 0);
-    // Register a function to close the db on exit.
-    // This is before the result check since we need to close the db even if we fail.
-    atexit(close_db);
-    if (result != SQLITE_OK)
-	return -1;
-    // Check the schema version of the db. Handle a mismatch in either direction.
-    sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, "SELECT SchemaVersion FROM Version", -1, &stmt, 0) != SQLITE_OK)
+static int check_version(sqlite3 *conn){
+    // Handle a mismatch in either direction.
+    sqlite3_stmt *stmt = get_stmt(conn, "SELECT SchemaVersion FROM Version");
+    if (!stmt)
 	return -1;
     /*
      * There should only be one value in this table.
      * We will see if more exist and throw an error if there are, but assume the
      * first error is correct.
      */
-    result = sqlite3_step(stmt);
+    int result = sqlite3_step(stmt);
     if (result == SQLITE_ROW){
 	int ver = sqlite3_column_int(stmt, 0);
 	if (ver < DB_SCHEMA_VERSION){
-	    // db has lower version, offer to upgrade
-	    // TODO: Offer upgrade
+	    // db has lower version; the caller offers to upgrade it with db_upgrade().
+	    release_stmt(stmt);
+	    return 2;
 	}
 	else if (ver > DB_SCHEMA_VERSION){
 	    // TODO: Disallow -- this program is older.
 
-	    sqlite3_finalize(stmt);
+	    release_stmt(stmt);
 	    return 1;
 	}
 	else{
@@ -540,32 +2019,296 @@ int open_db(const char * const path){
 	    // Check for additional records in Version.
 	    if (sqlite3_step(stmt) != SQLITE_DONE){
 		// TODO: Give error of malformed table.
-		sqlite3_finalize(stmt);
+		release_stmt(stmt);
 		return 1;
 	    }
-	    sqlite3_finalize(stmt);
+	    release_stmt(stmt);
 	    return 0;
 	}
     }
     else if (result == SQLITE_DONE){
 	// TODO: Throw an error saying there is no schema version.
-	sqlite3_finalize(stmt);
+	release_stmt(stmt);
 	return 1;
     }
     else{
 	// TODO: Throw an error saying the database could not be accessed.
-	sqlite3_finalize(stmt);
+	release_stmt(stmt);
+	return -1;
+    }
+    release_stmt(stmt);
+    return 0;
+}
+
+/**
+ * Opens a connection to a database and performs some sanity checks.
+ *
+ * @param path
+ * The database file to attempt to open.
+ *
+ * @param profile
+ * The performance profile to open the connection with.
+ *
+ * @param extra_flags
+ * Flags for sqlite3_open_v2() on top of the profile's.
+ *
+ * @param conn
+ * Where to store the connection. It is set even on failure, and must be closed.
+ *
+ * @param timed
+ * Nonzero to record each step as a startup phase, for db_stats().
+ *
+ * @return
+ * As open_db().
+ */
+static int connect_db(const char * const path, db_profile profile, int extra_flags, sqlite3 **conn, int timed){
+    // SQLite opens the file lazily, so most of the time goes on the first reads:
+    // the header for the journal mode, then the schema for the version check.
+    long long phase = stats_start();
+    int result = sqlite3_open_v2(path, conn, profiles[profile].open_flags | extra_flags, 0) == SQLITE_OK ? 0 : -1;
+    if (timed)
+	stats_phase("open", phase);
+    if (result != 0)
+	return -1;
+    phase = stats_start();
+    result = apply_profile(*conn, profile);
+    if (timed)
+	stats_phase("apply_profile", phase);
+    if (result != 0)
+	return -1;
+    phase = stats_start();
+    result = check_version(*conn);
+    if (timed)
+	stats_phase("check_version", phase);
+    return result;
+}
+
+static pthread_once_t close_db_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Registers close_db() to run at exit. Only the first call does anything,
+ * however many times the database is opened.
+ */
+static void register_close_db(){
+    atexit(close_db);
+}
+
+/**
+ * Opens a database and performs some sanity checks.
+ *
+ * @param path
+ * The database file to attempt to open.
+ *
+ * @param profile
+ * The performance profile to open the connection with.
+ *
+ * @retval -1
+ * Opening the database failed.
+ *
+ * @retval 1
+ * The database exists, but is not the correct version.
+ *
+ * @retval 2
+ * The database exists, but is an older version. It is left open so db_upgrade() can be run.
+ *
+ * @retval 0
+ * Database exists and passes all sanity checks.
+ */
+int open_db(const char * const path, db_profile profile){
+    long long start = stats_start();
+    // Register a function to close the db on exit.
+    // This is before the open since we need to close the db even if we fail.
+    pthread_once(&close_db_once, register_close_db);
+    // Only the global connection's opening is part of starting up.
+    int result = connect_db(path, profile, 0, &db, 1);
+    // An older version is not a failure; it gets upgraded.
+    stats_end(STATS_OPEN_DB, start, result != 0 && result != 2);
+    return result;
+}
+
+/**
+ * Opens a connection for use by a single thread, apart from the global db.
+ * SQLite's own locking of the connection is skipped, so only one thread may use it at a time.
+ *
+ * @param path
+ * The database file to attempt to open.
+ *
+ * @param profile
+ * The performance profile to open the connection with.
+ *
+ * @return
+ * The connection, or 0 if it could not be opened or is not the correct version.
+ * Close it with close_connection().
+ */
+sqlite3 *open_connection(const char * const path, db_profile profile){
+    sqlite3 *conn = 0;
+    if (connect_db(path, profile, SQLITE_OPEN_NOMUTEX, &conn, 0) != 0){
+	close_connection(conn);
+	return 0;
+    }
+    return conn;
+}
+
+/**
+ * Opens a connection for use by a single thread, like open_connection(),
+ * but keeps a database of an older version open so it can be upgraded.
+ *
+ * @param path
+ * The database file to attempt to open.
+ *
+ * @param profile
+ * The performance profile to open the connection with.
+ *
+ * @param conn
+ * Where to store the connection. Set to 0 unless the result is 0 or 2.
+ *
+ * @return
+ * The same as open_db().
+ */
+int open_connection_upgradable(const char * const path, db_profile profile, sqlite3 **conn){
+    long long start = stats_start();
+    *conn = 0;
+    int result = connect_db(path, profile, SQLITE_OPEN_NOMUTEX, conn, 0);
+    if (result != 0 && result != 2){
+	close_connection(*conn);
+	*conn = 0;
+    }
+    stats_end(STATS_OPEN_DB, start, result != 0 && result != 2);
+    return result;
+}
+
+/**
+ * Creates a new database file and opens it.
+ *
+ * @param path
+ * The database file to create. It must not already exist.
+ *
+ * @param profile
+ * The performance profile to open the connection with. Cannot be PROFILE_READ_ONLY.
+ *
+ * @retval -1
+ * Creating the database failed.
+ *
+ * @retval 0
+ * Database created and opened.
+ */
+int create_db(const char * const path, db_profile profile){
+    if (profile == PROFILE_READ_ONLY)
+	return -1;
+    int result = sqlite3_open_v2(path, &db, profiles[profile].open_flags | SQLITE_OPEN_CREATE, 0);
+    // Register a function to close the db on exit, same as open_db().
+    pthread_once(&close_db_once, register_close_db);
+    if (result != SQLITE_OK)
+	return -1;
+    if (apply_profile(db, profile) != 0)
+	return -1;
+    return new_db(db);
+}
+
+/**
+ * Closes the database and removes a copy that could not be finished,
+ * along with any journal it left.
+ */
+static void discard_copy(const char * const path){
+    close_db();
+    char extra[4200];
+    unlink(path);
+    snprintf(extra, sizeof(extra), "%s-journal", path);
+    unlink(extra);
+    snprintf(extra, sizeof(extra), "%s-wal", path);
+    unlink(extra);
+    snprintf(extra, sizeof(extra), "%s-shm", path);
+    unlink(extra);
+}
+
+/**
+ * Does the work of create_db_from_template().
+ */
+static int copy_template(const char * const path, const char * const template_path, db_profile profile){
+    if (profile == PROFILE_READ_ONLY || strlen(path) >= 4096)
+	return -1;
+    // Check the template first, so a bad one does not leave a file behind.
+    sqlite3 *source = open_connection(template_path, PROFILE_READ_ONLY);
+    if (!source)
+	return 1;
+    // Claim the path, so an existing catalog is never copied over.
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0){
+	close_connection(source);
+	return -1;
+    }
+    close(fd);
+    int result = sqlite3_open_v2(path, &db, profiles[profile].open_flags, 0);
+    // Register a function to close the db on exit, same as open_db().
+    pthread_once(&close_db_once, register_close_db);
+    // Copy every page in one step.
+    sqlite3_backup *backup = result == SQLITE_OK ? sqlite3_backup_init(db, "main", source, "main") : 0;
+    if (backup){
+	result = sqlite3_backup_step(backup, -1);
+	sqlite3_backup_finish(backup);
+    }
+    close_connection(source);
+    // The copy keeps the template's settings, so apply the profile afterward.
+    if (!backup || result != SQLITE_DONE || apply_profile(db, profile) != 0){
+	discard_copy(path);
 	return -1;
     }
-    sqlite3_finalize(stmt);
     return 0;
 }
 
+/**
+ * Creates a new database file by copying a template database, and opens it.
+ * Much faster than create_db() on slow storage, since no schema has to be built.
+ *
+ * @param path
+ * The database file to create. It must not already exist.
+ * If it does, or the copy fails, nothing is left open or written there.
+ *
+ * @param template_path
+ * A database made by create_db(), possibly seeded with data, to copy.
+ * It must have the current schema version.
+ *
+ * @param profile
+ * The performance profile to open the connection with. Cannot be PROFILE_READ_ONLY.
+ *
+ * @retval -1
+ * Creating the database failed, or the file already exists.
+ *
+ * @retval 1
+ * The template could not be opened, or is not the correct version.
+ *
+ * @retval 0
+ * Database created and opened.
+ */
+int create_db_from_template(const char * const path, const char * const template_path, db_profile profile){
+    long long start = stats_start();
+    int result = copy_template(path, template_path, profile);
+    stats_end(STATS_CREATE_FROM_TEMPLATE, start, result != 0);
+    return result;
+}
+
 /**
  * Closes the database
  *
  * Cannot have any parameters, since it is used by atexit().
  */
 void close_db(){
-    sqlite3_close_v2(db);
+    close_connection(db);
+    // Closing again, such as from atexit(), is then harmless.
+    db = 0;
+}
+
+/**
+ * Closes a connection along with its caches.
+ *
+ * @param conn
+ * The connection to close. May be 0.
+ */
+void close_connection(sqlite3 *conn){
+    if (!conn)
+	return;
+    id_cache_free(conn);
+    // Cached statements would otherwise keep the connection alive.
+    finalize_stmts(conn);
+    sqlite3_close_v2(conn);
 }
@@ -7,17 +7,36 @@
 #define DB_ACCESS_H
 
 #include <sqlite3.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "arena.h"
 #include "book.h"
 
 /*
  * Define the schema version.
  * This should always be an integer and should never be decreased.
  */
-#define DB_SCHEMA_VERSION 1
+#define DB_SCHEMA_VERSION 7
+
+/*
+ * The most books add_batch() will add in one transaction.
+ */
+#define ADD_BATCH_COMMIT_ROWS 5000
+
+/*
+ * The most rows an upgrade rewrites in one transaction.
+ */
+#define UPGRADE_CHUNK_ROWS 2000
+
+/*
+ * The most author, owner, genre and type ids kept in memory per connection.
+ */
+#define ID_CACHE_MAX_ENTRIES 50000
 
 /*
  * Also, but the database pointer declaration out here.
  * It is needed for close_db() to work in atexit().
+ * Threaded callers should use a db_pool instead.
  */
 extern sqlite3 *db;
 
@@ -27,8 +46,12 @@ extern sqlite3 *db;
 
 int add(sqlite3 *db, const book * const book_info);
 
+int add_batch(sqlite3 *db, const book * const *books, size_t count);
+
 int remove_book(sqlite3 *db, const book * const book_info);
 
+int add_copy(sqlite3 *db, sqlite3_int64 isbn13, const name * const owner);
+
 // An enum for the search function.
 typedef enum {
     FIELD_TITLE = 1,
@@ -37,18 +60,392 @@ typedef enum {
     FIELD_BINDING,
     FIELD_YEAR,
     FIELD_ISBN,
-    FIELD_GENRE
+    FIELD_GENRE,
+    // Full-text search over title, subtitle, author names and genres.
+    FIELD_ANY
 } fields;
 
+// How a search term compares its field.
+typedef enum {
+    MATCH_EQUAL,
+    // The field starts with the text. Title and ISBN only.
+    MATCH_PREFIX,
+    // The field is between low and high, inclusive. Year only.
+    MATCH_RANGE
+} match_type;
+
+// One condition of a compound search.
+typedef struct {
+    fields field;
+    match_type match;
+    // What to look for. Names are typed "First Last" or "First Middle Last".
+    // Not used by MATCH_RANGE.
+    const char *text;
+    // The bounds for MATCH_RANGE.
+    int low;
+    int high;
+} search_term;
+
+// The most genres search_collect() keeps for each result.
+#define SEARCH_MAX_GENRES 16
+
+// The most terms a compound search can have.
+#define SEARCH_MAX_TERMS 8
+
+// The most books search_open_books() can read at once.
+#define SEARCH_BOOKS_MAX 64
+
+// Which part of a search's results to return.
+typedef struct {
+    // The most results to return, or 0 for no limit.
+    int limit;
+    // How many results to skip. Only used with a limit.
+    int offset;
+    // Only return printings after this PrintingID, from search_last_printing().
+    // 0 starts from the beginning. Ignored for FIELD_ANY, which is ordered by rank.
+    int after_printing_id;
+} search_page;
+
+// An open search. Defined in db_access.c.
+typedef struct search_cursor search_cursor;
+
 int search(sqlite3 *db, fields search_field, char * const search_text);
 
+search_cursor *search_open(sqlite3 *db, fields search_field, char * const search_text, const search_page * const page);
+
+search_cursor *search_open_terms(sqlite3 *db, const search_term * const terms, int count,
+	const search_page * const page);
+
+search_cursor *search_open_books(sqlite3 *db, const int *book_ids, int count);
+
+int search_next(search_cursor *cursor, book *result, size_t genre_slots);
+
+book **search_collect(search_cursor *cursor, arena *pool, size_t max, size_t *count);
+
+book *copy_book(arena *pool, const book * const info);
+
+int search_last_printing(const search_cursor * const cursor);
+
+void search_close(search_cursor *cursor);
+
+int check_query_plans(sqlite3 *db);
+
+int create_indexes(sqlite3 *db);
+
+void analyze_sampled(sqlite3 *db);
+
 int new_db(sqlite3 *db);
 
-int open_db(const char * const path);
+// Performance profiles for opening a database.
+typedef enum {
+    // For the GUI and lookups: WAL, so readers do not block behind a writer.
+    PROFILE_INTERACTIVE,
+    // For imports: WAL, syncing only at checkpoints, and a large cache.
+    PROFILE_BULK_LOAD,
+    // For read-only copies: no writes, large cache and memory map.
+    PROFILE_READ_ONLY
+} db_profile;
+
+int find_profile(const char * const profile_name);
+
+int describe_db_settings(sqlite3 *db, db_profile profile, char *buf, size_t len);
+
+int open_db(const char * const path, db_profile profile);
+
+int create_db(const char * const path, db_profile profile);
+
+int create_db_from_template(const char * const path, const char * const template_path, db_profile profile);
 
 void close_db();
 
+sqlite3 *open_connection(const char * const path, db_profile profile);
+
+int open_connection_upgradable(const char * const path, db_profile profile, sqlite3 **conn);
+
+void close_connection(sqlite3 *conn);
+
+/* db_pool.c */
+// A pool of connections to one database. Defined in db_pool.c.
+typedef struct db_pool db_pool;
+
+db_pool *pool_open(const char * const path);
+
+sqlite3 *pool_reader(db_pool *pool);
+
+sqlite3 *pool_writer_acquire(db_pool *pool);
+
+void pool_writer_release(db_pool *pool);
+
+void pool_close(db_pool *pool);
+
+/* ingest.c */
+// How many scans can wait to be added. Must be a power of two.
+#define INGEST_QUEUE_SIZE 1024
+// The most scans added in one transaction.
+#define INGEST_GROUP_MAX 256
+// Latency histogram buckets. Bucket 0 is under 1us, bucket i under 2^i us,
+// and the last takes everything slower.
+#define INGEST_LATENCY_BUCKETS 24
+
+// Takes in barcode scans. Defined in ingest.c.
+typedef struct ingest ingest;
+
+// How an ingest is going.
+typedef struct {
+    // Scans queued, and scans turned away because the queue was full.
+    unsigned long queued;
+    unsigned long full;
+    // Scans added, scans of ISBNs not in the database, and scans whose commit failed.
+    unsigned long added;
+    unsigned long unknown;
+    unsigned long failed;
+    // Transactions committed.
+    unsigned long commits;
+    // Time from scan to commit, for every scan dealt with.
+    unsigned long latency[INGEST_LATENCY_BUCKETS];
+} ingest_stats;
+
+ingest *ingest_start(db_pool *pool, const name * const owner);
+
+int ingest_scan(ingest *in, const char * const isbn);
+
+void ingest_get_stats(ingest *in, ingest_stats *stats);
+
+void ingest_stop(ingest *in, ingest_stats *stats);
+
+/* db_worker.c */
+// Runs database work on a thread of its own, for the GUI. Defined in db_worker.c.
+typedef struct db_worker db_worker;
+
+// The outcome of a db_worker request.
+typedef struct {
+    // What the operation returned, 0 on success.
+    int status;
+    // Nonzero if the request was dropped, e.g. a newer search replaced it.
+    int cancelled;
+    // Search results, only valid until the callback returns.
+    book **books;
+    size_t count;
+} db_reply;
+
+// Called with the outcome of a db_worker request, on the thread the dispatch hook picks.
+typedef void (*db_reply_cb)(const db_reply *reply, void *data);
+
+// Called as an upgrade started by db_worker_open() goes along. step is a constant string.
+typedef void (*db_progress_cb)(int version, const char *step, long done, long total, void *data);
+
+/*
+ * Hands a reply from the worker thread to the thread that should see it,
+ * such as the GUI's main loop, which must then call deliver(data) once.
+ */
+typedef void (*db_dispatch)(void (*deliver)(void *data), void *data, void *context);
+
+db_worker *db_worker_start(db_dispatch dispatch, void *context);
+
+int db_worker_open(db_worker *worker, const char * const path, db_profile profile, db_progress_cb progress,
+	db_reply_cb callback, void *data);
+
+int db_worker_add(db_worker *worker, const book * const info, db_reply_cb callback, void *data);
+
+int db_worker_remove(db_worker *worker, const book * const info, db_reply_cb callback, void *data);
+
+int db_worker_search(db_worker *worker, const search_term * const terms, int count, size_t max, int debounce_ms,
+	db_reply_cb callback, void *data);
+
+void db_worker_cancel_searches(db_worker *worker);
+
+void db_worker_stop(db_worker *worker);
+
+#ifdef HAVE_GLIB
+void db_worker_glib_dispatch(void (*deliver)(void *data), void *data, void *context);
+#endif
+
+/* db_check.c */
+// A check for damage running in the background. Defined in db_check.c.
+typedef struct db_check db_check;
+
+// The room db_check_stop() needs for a message.
+#define DB_CHECK_MESSAGE_LEN 256
+
+db_check *db_check_start(const char * const path);
+
+int db_check_stop(db_check *check, int wait, char message[DB_CHECK_MESSAGE_LEN]);
+
+/* prefix_index.c */
+// Sorted titles and author last names, for searching as the user types. Defined in prefix_index.c.
+typedef struct prefix_index prefix_index;
+
+// The longest text a prefix_query matches on. The rest is ignored.
+#define PREFIX_MAX_LEN 255
+
+// A search being typed, narrowed a keystroke at a time.
+typedef struct {
+    const prefix_index *index;
+    // The case folded text matched.
+    char text[PREFIX_MAX_LEN + 1];
+    size_t len;
+    // The index entries starting with text.
+    size_t low;
+    size_t high;
+} prefix_query;
+
+prefix_index *prefix_index_build(sqlite3 *db);
+
+int prefix_index_is_current(const prefix_index *index, sqlite3 *db);
+
+void prefix_index_free(prefix_index *index);
+
+void prefix_query_init(prefix_query *query, const prefix_index *index);
+
+size_t prefix_query_set(prefix_query *query, const char * const text);
+
+int prefix_query_books(const prefix_query *query, int *book_ids, int max);
+
+search_cursor *prefix_query_open(const prefix_query *query, sqlite3 *db, int limit);
+
 /* db_upgrade.c */
-int db_upgrade(int old_version);
+/*
+ * Reports how far an upgrade has got, e.g. to drive a progress dialog.
+ * step describes what is being done to reach version. done counts up to total,
+ * which is 0 when the step cannot be measured.
+ * Return nonzero to stop; the upgrade picks up where it left off next time.
+ */
+typedef int (*upgrade_progress)(void *data, int version, const char *step, long done, long total);
+
+int db_upgrade(sqlite3 *db, upgrade_progress progress, void *data);
+
+/* db_stats.c */
+// The operations whose calls and time are counted.
+typedef enum {
+    STATS_OPEN_DB,
+    STATS_NEW_DB,
+    STATS_CREATE_FROM_TEMPLATE,
+    STATS_UPGRADE,
+    STATS_ADD,
+    STATS_ADD_BATCH,
+    STATS_ADD_COPY,
+    STATS_REMOVE,
+    // From search_open() to search_close().
+    STATS_SEARCH,
+    STATS_EXPORT_SNAPSHOT,
+    STATS_IMPORT_SNAPSHOT,
+    STATS_EXPORT_CHANGES,
+    STATS_APPLY_CHANGES,
+    STATS_OPS
+} stats_op;
+
+// The counts for one operation.
+typedef struct {
+    const char *name;
+    unsigned long calls;
+    unsigned long errors;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+} op_stats;
+
+// The counts for one cached statement.
+typedef struct {
+    const char *sql;
+    // Runs finished, from sqlite3_stmt_status().
+    unsigned long runs;
+    // Only counted while stmt_cache_trace() is on.
+    unsigned long rows;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    // From sqlite3_stmt_status().
+    int fullscan_steps;
+    int sorts;
+    int autoindexes;
+    int vm_steps;
+} stmt_stats;
+
+long long stats_start();
+
+void stats_end(stats_op op, long long start, int failed);
+
+void stats_phase(const char * const phase, long long start);
+
+void db_op_stats(op_stats *stats);
+
+int db_stats(sqlite3 *db, FILE *out);
+
+/* fulltext.c */
+int create_fulltext(sqlite3 *db);
+
+int update_fulltext(sqlite3 *db);
+
+int index_book(sqlite3 *db, sqlite3_int64 book_id);
+
+int fill_fulltext(sqlite3 *db, sqlite3_int64 after, int limit, sqlite3_int64 *last);
+
+char *make_match_query(const char * const text);
+
+/* isbn.c */
+sqlite3_int64 isbn_normalize(const char * const text);
+
+int create_isbn13(sqlite3 *db);
+
+int fill_isbn13(sqlite3 *db, sqlite3_int64 after, int limit, sqlite3_int64 *last);
+
+/* id_cache.c */
+void id_cache_validate(sqlite3 *db);
+
+int id_cache_get(sqlite3 *db, char tag, const char * const *values, int count, int *complete);
+
+void id_cache_put(sqlite3 *db, char tag, const char * const *values, int count, int id);
+
+void id_cache_expect_insert(sqlite3 *db, char tag);
+
+void id_cache_clear(sqlite3 *db);
+
+void id_cache_free(sqlite3 *db);
+
+void id_cache_stats(sqlite3 *db, unsigned long *hits, unsigned long *misses, unsigned long *entries);
+
+/* import.c */
+// Limits on the list columns of a single imported book.
+#define IMPORT_MAX_AUTHORS 16
+#define IMPORT_MAX_GENRES 32
+// Room for an imported book and its null-terminated genre list.
+#define IMPORT_BOOK_SIZE (sizeof(book) + sizeof(const char *) * (IMPORT_MAX_GENRES + 1))
+
+int import_file(sqlite3 *db, const char * const path, FILE *errors, int *skipped);
+
+int parse_book_record(char *text, size_t len, char delim, book *info, name *authors);
+
+/* snapshot.c */
+sqlite3_int64 export_snapshot(sqlite3 *db, FILE *out, int compress, sqlite3_int64 *seq);
+
+sqlite3_int64 import_snapshot(sqlite3 *db, FILE *in, sqlite3_int64 *seq);
+
+sqlite3_int64 export_changes(sqlite3 *db, sqlite3_int64 since, FILE *out, int compress, sqlite3_int64 *seq);
+
+sqlite3_int64 apply_changes(sqlite3 *db, FILE *in, sqlite3_int64 *seq);
+
+int create_change_log(sqlite3 *db);
+
+sqlite3_int64 prune_changes(sqlite3 *db, sqlite3_int64 seq);
+
+/* batch.c */
+int run_batch(sqlite3 *db, FILE *in, FILE *out);
+
+void write_json_string(FILE *out, const char *text);
+
+/* stmt_cache.c */
+sqlite3_stmt *get_stmt(sqlite3 *db, const char * const sql);
+
+void release_stmt(sqlite3_stmt *stmt);
+
+sqlite3_stmt *get_cursor_stmt(sqlite3 *db, const char * const sql);
+
+void release_cursor_stmt(sqlite3_stmt *stmt);
+
+void finalize_stmts(sqlite3 *db);
+
+void stmt_cache_trace(int on);
+
+void stmt_cache_stats(sqlite3 *db, unsigned long *hits, unsigned long *misses);
+
+int stmt_cache_each(sqlite3 *db, stmt_stats *stats, int max);
 
 #endif
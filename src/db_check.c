@@ -0,0 +1,160 @@
+/*
+    BookDBLite, a book database management solution using SQLite.
+    Copyright (C) 2015-2016  SilverNexus
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file db_check.c
+ * Checks a database for damage on a thread of its own, after it is opened,
+ * so starting up does not wait on reading the whole file.
+ *
+ * The check reads every page, so once it is done the file is in the
+ * operating system's cache and the first searches do not go to disk.
+ *
+ * Upgrades are not deferred this way, since every mode needs the current
+ * schema before it starts; see open_existing() in main.c.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "db_access.h"
+
+struct db_check {
+    pthread_t thread;
+    char *path;
+    // Guards conn, so db_check_stop() never interrupts a connection being closed.
+    pthread_mutex_t lock;
+    sqlite3 *conn;
+    int stopping;
+    // Set by the thread, and read once it has been joined.
+    int result;
+    char message[DB_CHECK_MESSAGE_LEN];
+};
+
+/**
+ * Closes the check's connection, once db_check_stop() can no longer interrupt it.
+ */
+static void close_check(struct db_check *check){
+    pthread_mutex_lock(&check->lock);
+    sqlite3 *conn = check->conn;
+    check->conn = 0;
+    pthread_mutex_unlock(&check->lock);
+    close_connection(conn);
+}
+
+/**
+ * The checking thread. Runs PRAGMA quick_check on a read-only connection of its own.
+ */
+static void *run_check(void *data){
+    struct db_check *check = data;
+    check->result = -1;
+    sqlite3 *conn = open_connection(check->path, PROFILE_READ_ONLY);
+    if (!conn){
+	snprintf(check->message, sizeof(check->message), "could not open the database");
+	return 0;
+    }
+    pthread_mutex_lock(&check->lock);
+    check->conn = conn;
+    int stopping = check->stopping;
+    pthread_mutex_unlock(&check->lock);
+    sqlite3_stmt *stmt;
+    if (stopping || sqlite3_prepare_v2(conn, "PRAGMA quick_check(1)", -1, &stmt, 0) != SQLITE_OK){
+	snprintf(check->message, sizeof(check->message), "%s", stopping ? "stopped" : sqlite3_errmsg(conn));
+	close_check(check);
+	return 0;
+    }
+    // One row, "ok" if nothing is wrong, or else the first problem found.
+    if (sqlite3_step(stmt) == SQLITE_ROW){
+	const char *text = (const char *)sqlite3_column_text(stmt, 0);
+	snprintf(check->message, sizeof(check->message), "%s", text ? text : "");
+	check->result = text && strcmp(text, "ok") == 0 ? 0 : 1;
+    }
+    else
+	snprintf(check->message, sizeof(check->message), "%s", sqlite3_errmsg(conn));
+    sqlite3_finalize(stmt);
+    close_check(check);
+    return 0;
+}
+
+/**
+ * Starts checking a database in the background.
+ *
+ * @param path
+ * The database file. It is copied.
+ *
+ * @return
+ * The check, or 0 if it could not be started. Finish it with db_check_stop().
+ */
+db_check *db_check_start(const char * const path){
+    struct db_check *check = calloc(1, sizeof(struct db_check));
+    if (!check)
+	return 0;
+    pthread_mutex_init(&check->lock, 0);
+    if (!(check->path = strdup(path)) || pthread_create(&check->thread, 0, run_check, check) != 0){
+	pthread_mutex_destroy(&check->lock);
+	free(check->path);
+	free(check);
+	return 0;
+    }
+    return check;
+}
+
+/**
+ * Finishes a check, waiting for it if wait is set, or else cutting it short.
+ *
+ * @param check
+ * The check from db_check_start(). It is freed. May be 0.
+ *
+ * @param wait
+ * Nonzero to let the check finish, which can take a while on a large database.
+ *
+ * @param message
+ * Where to store the first problem found, or why the check did not finish. May be 0.
+ *
+ * @retval 0
+ * The database is sound.
+ *
+ * @retval 1
+ * The database is damaged. message says how.
+ *
+ * @retval -1
+ * The check did not finish.
+ */
+int db_check_stop(db_check *check, int wait, char message[DB_CHECK_MESSAGE_LEN]){
+    if (!check)
+	return -1;
+    if (!wait){
+	// The check is one long step, so it is interrupted rather than asked to stop.
+	pthread_mutex_lock(&check->lock);
+	check->stopping = 1;
+	if (check->conn)
+	    sqlite3_interrupt(check->conn);
+	pthread_mutex_unlock(&check->lock);
+    }
+    pthread_join(check->thread, 0);
+    int result = check->result;
+    if (message)
+	memcpy(message, check->message, DB_CHECK_MESSAGE_LEN);
+    pthread_mutex_destroy(&check->lock);
+    free(check->path);
+    free(check);
+    return result;
+}
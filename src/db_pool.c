@@ -0,0 +1,196 @@
+/*
+    BookDBLite, a book database management solution using SQLite.
+    Copyright (C) 2015-2016  SilverNexus
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file db_pool.c
+ * Hands out connections to one database for use by several threads.
+ *
+ * Each thread gets its own read-only connection, so searches never wait on
+ * each other. Writes all go through one writer connection, taken in turn.
+ * The database is in WAL mode, so readers keep reading while it writes.
+ */
+
+#include <pthread.h>
+#include <sqlite3.h>
+#include "db_access.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct pool_reader {
+    sqlite3 *db;
+    db_pool *pool;
+    // Set while a thread is using this connection.
+    int in_use;
+    struct pool_reader *next;
+};
+
+struct db_pool {
+    char *path;
+    // Each thread's pool_reader.
+    pthread_key_t reader_key;
+    // Guards the list of readers.
+    pthread_mutex_t readers_lock;
+    struct pool_reader *readers;
+    sqlite3 *writer;
+    pthread_mutex_t writer_lock;
+};
+
+/**
+ * Hands a thread's reader back to the pool when the thread exits,
+ * so the next new thread can use it.
+ */
+static void reader_done(void *data){
+    struct pool_reader *reader = data;
+    pthread_mutex_lock(&reader->pool->readers_lock);
+    reader->in_use = 0;
+    pthread_mutex_unlock(&reader->pool->readers_lock);
+}
+
+/**
+ * Opens a pool of connections to a database.
+ * The writer connection is opened straight away; readers are opened as threads ask for them.
+ *
+ * @param path
+ * The database file. It must already exist.
+ *
+ * @return
+ * The pool, or 0 if the database could not be opened.
+ */
+db_pool *pool_open(const char * const path){
+    db_pool *pool = calloc(1, sizeof(db_pool));
+    if (!pool)
+	return 0;
+    if (!(pool->path = strdup(path))){
+	free(pool);
+	return 0;
+    }
+    // The interactive profile puts the database in WAL mode, which read-only readers depend on.
+    if (!(pool->writer = open_connection(path, PROFILE_INTERACTIVE))){
+	free(pool->path);
+	free(pool);
+	return 0;
+    }
+    if (pthread_key_create(&pool->reader_key, reader_done) != 0){
+	close_connection(pool->writer);
+	free(pool->path);
+	free(pool);
+	return 0;
+    }
+    pthread_mutex_init(&pool->readers_lock, 0);
+    pthread_mutex_init(&pool->writer_lock, 0);
+    return pool;
+}
+
+/**
+ * Gets the calling thread's read-only connection, opening it on first use.
+ * The connection stays with the thread until it exits.
+ *
+ * @param pool
+ * The pool to get the connection from.
+ *
+ * @return
+ * The connection, or 0 if it could not be opened.
+ *
+ * @note Only the calling thread may use the connection.
+ * Writes through it fail; use pool_writer_acquire() for those.
+ */
+sqlite3 *pool_reader(db_pool *pool){
+    struct pool_reader *reader = pthread_getspecific(pool->reader_key);
+    if (reader)
+	return reader->db;
+    // Reuse a connection left by a thread that has exited.
+    pthread_mutex_lock(&pool->readers_lock);
+    for (reader = pool->readers; reader; reader = reader->next){
+	if (!reader->in_use)
+	    break;
+    }
+    if (reader)
+	reader->in_use = 1;
+    pthread_mutex_unlock(&pool->readers_lock);
+
+    if (!reader){
+	if (!(reader = calloc(1, sizeof(struct pool_reader))))
+	    return 0;
+	if (!(reader->db = open_connection(pool->path, PROFILE_READ_ONLY))){
+	    free(reader);
+	    return 0;
+	}
+	reader->pool = pool;
+	reader->in_use = 1;
+	pthread_mutex_lock(&pool->readers_lock);
+	reader->next = pool->readers;
+	pool->readers = reader;
+	pthread_mutex_unlock(&pool->readers_lock);
+    }
+    if (pthread_setspecific(pool->reader_key, reader) != 0){
+	reader_done(reader);
+	return 0;
+    }
+    return reader->db;
+}
+
+/**
+ * Takes the pool's writer connection, waiting for any other thread using it.
+ * Pass it to add(), add_batch() or remove_book(), then hand it back with pool_writer_release().
+ *
+ * @param pool
+ * The pool to get the writer from.
+ *
+ * @return
+ * The writer connection.
+ */
+sqlite3 *pool_writer_acquire(db_pool *pool){
+    pthread_mutex_lock(&pool->writer_lock);
+    return pool->writer;
+}
+
+/**
+ * Hands the writer connection back after pool_writer_acquire().
+ *
+ * @param pool
+ * The pool the writer came from.
+ */
+void pool_writer_release(db_pool *pool){
+    pthread_mutex_unlock(&pool->writer_lock);
+}
+
+/**
+ * Closes every connection in a pool and frees it.
+ * No other thread may be using the pool.
+ *
+ * @param pool
+ * The pool to close. May be 0.
+ */
+void pool_close(db_pool *pool){
+    if (!pool)
+	return;
+    pthread_key_delete(pool->reader_key);
+    struct pool_reader *reader = pool->readers;
+    while (reader){
+	struct pool_reader *next = reader->next;
+	close_connection(reader->db);
+	free(reader);
+	reader = next;
+    }
+    close_connection(pool->writer);
+    pthread_mutex_destroy(&pool->readers_lock);
+    pthread_mutex_destroy(&pool->writer_lock);
+    free(pool->path);
+    free(pool);
+}
@@ -0,0 +1,209 @@
+/*
+    BookDBLite, a book database management solution using SQLite.
+    Copyright (C) 2015-2016  SilverNexus
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file db_stats.c
+ * Counts calls, failures and time for each database operation,
+ * and reports them along with the statement cache's hits, misses and per-statement counts.
+ *
+ * Recording an operation costs two clock reads and a few relaxed atomic
+ * adds, so the counts are always kept.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "db_access.h"
+
+// The operation names, by stats_op.
+static const char * const op_names[STATS_OPS] = {
+    "open_db",
+    "new_db",
+    "create_db_from_template",
+    "db_upgrade",
+    "add",
+    "add_batch",
+    "add_copy",
+    "remove_book",
+    "search",
+    "export_snapshot",
+    "import_snapshot",
+    "export_changes",
+    "apply_changes"
+};
+
+// Counts for each operation, shared by every thread.
+static struct {
+    atomic_ulong calls;
+    atomic_ulong errors;
+    atomic_ullong total_ns;
+    atomic_ullong max_ns;
+} op_counts[STATS_OPS];
+
+// The most startup phases kept.
+#define STATS_MAX_PHASES 16
+
+// How long each phase of starting up took, the last time it ran.
+static struct {
+    const char *name;
+    long long ns;
+} phases[STATS_MAX_PHASES];
+static int phase_count = 0;
+static pthread_mutex_t phases_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Notes the time an operation starts.
+ *
+ * @return
+ * The time, to pass to stats_end().
+ */
+long long stats_start(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Records an operation once it is done.
+ *
+ * @param op
+ * The operation.
+ *
+ * @param start
+ * From stats_start() when the operation began.
+ *
+ * @param failed
+ * Nonzero if the operation failed.
+ */
+void stats_end(stats_op op, long long start, int failed){
+    unsigned long long ns = (unsigned long long)(stats_start() - start);
+    atomic_fetch_add_explicit(&op_counts[op].calls, 1, memory_order_relaxed);
+    if (failed)
+	atomic_fetch_add_explicit(&op_counts[op].errors, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&op_counts[op].total_ns, ns, memory_order_relaxed);
+    unsigned long long max = atomic_load_explicit(&op_counts[op].max_ns, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&op_counts[op].max_ns, &max, ns,
+	    memory_order_relaxed, memory_order_relaxed))
+	;
+}
+
+/**
+ * Records how long a phase of starting up took, in place of any earlier time for it.
+ *
+ * @param phase
+ * The phase's name. It must be a constant string.
+ *
+ * @param start
+ * From stats_start() when the phase began.
+ */
+void stats_phase(const char * const phase, long long start){
+    long long ns = stats_start() - start;
+    pthread_mutex_lock(&phases_lock);
+    int i = 0;
+    while (i < phase_count && strcmp(phases[i].name, phase) != 0)
+	++i;
+    if (i < STATS_MAX_PHASES){
+	phases[i].name = phase;
+	phases[i].ns = ns;
+	if (i == phase_count)
+	    ++phase_count;
+    }
+    pthread_mutex_unlock(&phases_lock);
+}
+
+/**
+ * Gets the counts for every operation so far.
+ *
+ * @param stats
+ * Room for STATS_OPS entries, filled in stats_op order.
+ */
+void db_op_stats(op_stats *stats){
+    for (int i = 0; i < STATS_OPS; ++i){
+	stats[i].name = op_names[i];
+	stats[i].calls = atomic_load_explicit(&op_counts[i].calls, memory_order_relaxed);
+	stats[i].errors = atomic_load_explicit(&op_counts[i].errors, memory_order_relaxed);
+	stats[i].total_ns = atomic_load_explicit(&op_counts[i].total_ns, memory_order_relaxed);
+	stats[i].max_ns = atomic_load_explicit(&op_counts[i].max_ns, memory_order_relaxed);
+    }
+}
+
+/**
+ * Writes how long each phase of starting up took, every operation's counts,
+ * how often a connection's statement cache saved preparing a statement,
+ * and the counts for each statement it has run, as a JSON object.
+ *
+ * @param db
+ * The connection whose statements to report, or 0 for operations only.
+ *
+ * @param out
+ * Where to write the report.
+ *
+ * @return
+ * 0 on success, -1 if the statement counts could not be gathered.
+ *
+ * @note Call this from the thread using db, before the connection is closed.
+ * Times are in microseconds.
+ */
+int db_stats(sqlite3 *db, FILE *out){
+    op_stats ops[STATS_OPS];
+    db_op_stats(ops);
+    fputs("{\"startup\": [", out);
+    pthread_mutex_lock(&phases_lock);
+    for (int i = 0; i < phase_count; ++i)
+	fprintf(out, "%s\n  {\"phase\": \"%s\", \"us\": %.1f}", i ? "," : "", phases[i].name, phases[i].ns / 1e3);
+    pthread_mutex_unlock(&phases_lock);
+    fputs("],\n \"operations\": [", out);
+    int first = 1;
+    for (int i = 0; i < STATS_OPS; ++i){
+	if (!ops[i].calls)
+	    continue;
+	fprintf(out, "%s\n  {\"name\": \"%s\", \"calls\": %lu, \"errors\": %lu, \"total_us\": %.1f,"
+	    " \"mean_us\": %.1f, \"max_us\": %.1f}", first ? "" : ",", ops[i].name, ops[i].calls,
+	    ops[i].errors, ops[i].total_ns / 1e3, ops[i].total_ns / 1e3 / ops[i].calls, ops[i].max_ns / 1e3);
+	first = 0;
+    }
+    unsigned long hits, misses;
+    stmt_cache_stats(db, &hits, &misses);
+    fprintf(out, "],\n \"stmt_cache\": {\"hits\": %lu, \"misses\": %lu},", hits, misses);
+    fputs("\n \"statements\": [", out);
+    int result = 0;
+    int count = db ? stmt_cache_each(db, 0, 0) : 0;
+    stmt_stats *stmts = count > 0 ? malloc(sizeof(stmt_stats) * count) : 0;
+    if (count > 0 && !stmts)
+	result = -1;
+    else if (stmts){
+	count = stmt_cache_each(db, stmts, count);
+	for (int i = 0; i < count; ++i){
+	    fputs(i ? ",\n  {\"sql\": " : "\n  {\"sql\": ", out);
+	    write_json_string(out, stmts[i].sql);
+	    fprintf(out, ", \"runs\": %lu, \"rows\": %lu, \"total_us\": %.1f, \"max_us\": %.1f,"
+		" \"fullscan_steps\": %d, \"sorts\": %d, \"autoindexes\": %d, \"vm_steps\": %d}",
+		stmts[i].runs, stmts[i].rows, stmts[i].total_ns / 1e3, stmts[i].max_ns / 1e3,
+		stmts[i].fullscan_steps, stmts[i].sorts, stmts[i].autoindexes, stmts[i].vm_steps);
+	}
+    }
+    free(stmts);
+    fputs("]}\n", out);
+    return result;
+}
@@ -20,30 +20,250 @@
 /**
  * @file db_upgrade.c
  * Contains the schema upgrade path to ensure proper upgrades of the db.
+ *
+ * Each version is reached by its own step, committed together with the new
+ * SchemaVersion, so an interrupted upgrade never leaves a version half applied.
+ * Steps that rewrite every row of a large table do it in chunks, each in a
+ * short transaction of its own, so other connections are not locked out for
+ * the length of the upgrade. How far a chunked step has got is kept in the
+ * UpgradeProgress table, and the next upgrade resumes from there.
+ *
+ * Statistics for the planner are gathered after the last step is committed,
+ * from a sample of each index, so no step holds the write lock for a full scan.
  */
 
 #include <sqlite3.h>
 #include "db_access.h"
 
+/*
+ * The upgrade steps, in version order.
+ */
+static const struct {
+    // The version the step upgrades to.
+    int version;
+    // Shown while the step runs.
+    const char *description;
+    // Schema changes, run in one transaction. Must be safe to run again.
+    int (*apply)(sqlite3 *db);
+    // Optional. Rewrites the next chunk of rows after apply, the way fill_fulltext() does.
+    int (*chunk)(sqlite3 *db, sqlite3_int64 after, int limit, sqlite3_int64 *last);
+    // Counts the rows chunk will go through, for progress.
+    const char *count_sql;
+    // Counts the rows up to and including a key chunk returned, when resuming.
+    const char *done_sql;
+} upgrade_steps[] = {
+    // Version 2 adds indexes for the search and add paths.
+    {2, "Adding search indexes", create_indexes, 0, 0, 0},
+    // Version 3 adds the full-text index for FIELD_ANY searches.
+    {3, "Building the full-text index", create_fulltext, fill_fulltext,
+	"SELECT count(*) FROM Book", "SELECT count(*) FROM Book WHERE BookID <= ?"},
+    // Version 4 adds an index for owner searches. The existing indexes are skipped.
+    {4, "Adding the owner search index", create_indexes, 0, 0, 0},
+    // Version 5 adds ISBNs as numbers, so they match however they were written.
+    {5, "Normalizing ISBNs", create_isbn13, fill_isbn13,
+	"SELECT count(*) FROM Printing", "SELECT count(*) FROM Printing WHERE PrintingID <= ?"},
+    // Version 6 logs changes, so copies can be brought up to date with only what changed.
+    {6, "Adding the change log", create_change_log, 0, 0, 0},
+    // Version 7 indexes a new book once its authors and genres are linked, not once per link.
+    {7, "Updating the full-text triggers", update_fulltext, 0, 0, 0}
+};
+
+/**
+ * Reads the schema version of a database.
+ *
+ * @return
+ * The version, or -1 if it could not be read.
+ */
+static int read_version(sqlite3 *db){
+    sqlite3_stmt *stmt = get_stmt(db, "SELECT SchemaVersion FROM Version");
+    if (!stmt)
+	return -1;
+    int version = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : -1;
+    release_stmt(stmt);
+    return version;
+}
+
+/**
+ * Runs a statement taking up to two integer parameters, ?1 and ?2.
+ *
+ * @return
+ * 0 on success, -1 on failure.
+ */
+static int exec_with_ints(sqlite3 *db, const char * const sql, sqlite3_int64 first, sqlite3_int64 second){
+    sqlite3_stmt *stmt = get_stmt(db, sql);
+    if (!stmt)
+	return -1;
+    int params = sqlite3_bind_parameter_count(stmt);
+    int result = (params < 1 || sqlite3_bind_int64(stmt, 1, first) == SQLITE_OK) &&
+	(params < 2 || sqlite3_bind_int64(stmt, 2, second) == SQLITE_OK) ? sqlite3_step(stmt) : SQLITE_ERROR;
+    release_stmt(stmt);
+    return result == SQLITE_DONE ? 0 : -1;
+}
+
 /**
- * Upgrades the schema from an old version to the new version.
+ * Gets an integer from a query, with up to one integer parameter.
  *
- * @param old_version
- * The schema version of the detected database.
- * Assumed to be less than DB_SCHEMA_VERSION.
+ * @param fallback
+ * Returned when the query gives no row.
+ *
+ * @return
+ * The first column of the first row, fallback if there is none, or -1 on failure.
+ */
+static sqlite3_int64 query_int(sqlite3 *db, const char * const sql, sqlite3_int64 param, sqlite3_int64 fallback){
+    sqlite3_stmt *stmt = get_stmt(db, sql);
+    if (!stmt)
+	return -1;
+    sqlite3_int64 value = -1;
+    if (param < 0 || sqlite3_bind_int64(stmt, 1, param) == SQLITE_OK){
+	int result = sqlite3_step(stmt);
+	if (result == SQLITE_ROW)
+	    value = sqlite3_column_int64(stmt, 0);
+	else if (result == SQLITE_DONE)
+	    value = fallback;
+    }
+    release_stmt(stmt);
+    return value;
+}
+
+/**
+ * Commits the current transaction, or rolls it back if ok is 0.
+ *
+ * @return
+ * 0 if committed, -1 otherwise.
+ */
+static int finish_transaction(sqlite3 *db, int ok){
+    if (ok && sqlite3_exec(db, "COMMIT", 0, 0, 0) == SQLITE_OK)
+	return 0;
+    sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+    return -1;
+}
+
+/**
+ * Runs one upgrade step, resuming it if an earlier upgrade was stopped partway.
  *
  * @retval 0
- * Upgrade successful
+ * The database is now at the step's version.
  *
- * @retval -1
- * Upgrade failed
+ * @retval 1
+ * Stopped by the progress callback. The next upgrade carries on from here.
  *
- * @note It is assumed that db is already open when this function is reached.
+ * @retval -1
+ * The step failed. Committed chunks are kept, and the next upgrade carries on from them.
  */
-int db_upgrade(int old_version){
-    // Use a switch statement with fallthrough for upgrade.
-    switch (old_version){
-	// There are no upgrades at this time.
+static int run_step(sqlite3 *db, int step, upgrade_progress progress, void *data){
+    int version = upgrade_steps[step].version;
+    const char *description = upgrade_steps[step].description;
+    if (progress && progress(data, version, description, 0, 0))
+	return 1;
+    // Rows already done by an earlier, stopped upgrade. -1 means the step has not started.
+    sqlite3_int64 last = -1;
+    if (upgrade_steps[step].chunk){
+	if (sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS UpgradeProgress("
+		"Version INTEGER PRIMARY KEY,"
+		"LastKey INTEGER NOT NULL)", 0, 0, 0) != SQLITE_OK)
+	    return -1;
+	last = query_int(db, "SELECT LastKey FROM UpgradeProgress WHERE Version = ?", version, -1);
+    }
+    if (last < 0){
+	// Schema changes first. For a chunked step, record that the rewrite can start.
+	if (sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0) != SQLITE_OK)
+	    return -1;
+	int ok = upgrade_steps[step].apply(db) == 0;
+	if (ok && upgrade_steps[step].chunk)
+	    ok = exec_with_ints(db, "INSERT INTO UpgradeProgress (Version, LastKey) VALUES (?1, 0)", version, 0) == 0;
+	else if (ok)
+	    ok = exec_with_ints(db, "UPDATE Version SET SchemaVersion = ?1", version, 0) == 0;
+	if (finish_transaction(db, ok) != 0)
+	    return -1;
+	if (!upgrade_steps[step].chunk)
+	    return progress && progress(data, version, description, 1, 1) ? 1 : 0;
+	last = 0;
     }
+
+    long total = (long)query_int(db, upgrade_steps[step].count_sql, -1, 0);
+    long done = last > 0 ? (long)query_int(db, upgrade_steps[step].done_sql, last, 0) : 0;
+    if (total < 0 || done < 0)
+	return -1;
+    for (;;){
+	// The end is reported once, after the loop.
+	if (progress && done < total && progress(data, version, description, done, total))
+	    return 1;
+	if (sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0) != SQLITE_OK)
+	    return -1;
+	sqlite3_int64 next = last;
+	int count = upgrade_steps[step].chunk(db, last, UPGRADE_CHUNK_ROWS, &next);
+	int ok = count >= 0;
+	// The last chunk bumps the version, in the same transaction.
+	if (ok && count == 0)
+	    ok = exec_with_ints(db, "DELETE FROM UpgradeProgress WHERE Version = ?1", version, 0) == 0 &&
+		exec_with_ints(db, "UPDATE Version SET SchemaVersion = ?1", version, 0) == 0;
+	else if (ok)
+	    ok = exec_with_ints(db, "UPDATE UpgradeProgress SET LastKey = ?2 WHERE Version = ?1", version, next) == 0;
+	if (finish_transaction(db, ok) != 0)
+	    return -1;
+	if (count == 0)
+	    break;
+	last = next;
+	done += count;
+    }
+    if (progress && progress(data, version, description, total, total))
+	return 1;
     return 0;
 }
+
+/**
+ * Does the work of db_upgrade().
+ */
+static int run_steps(sqlite3 *db, upgrade_progress progress, void *data){
+    if (!db)
+	return -1;
+    int version = read_version(db);
+    if (version < 1)
+	return -1;
+    int from = version;
+    for (unsigned int i = 0; i < sizeof(upgrade_steps) / sizeof(upgrade_steps[0]); ++i){
+	if (upgrade_steps[i].version <= version)
+	    continue;
+	int result = run_step(db, i, progress, data);
+	if (result != 0)
+	    return result;
+	version = upgrade_steps[i].version;
+    }
+    // Every step is done, so nothing is left to resume.
+    if (sqlite3_exec(db, "DROP TABLE IF EXISTS UpgradeProgress", 0, 0, 0) != SQLITE_OK)
+	return -1;
+    if (version > from)
+	analyze_sampled(db);
+    return 0;
+}
+
+/**
+ * Upgrades the schema of a database to DB_SCHEMA_VERSION.
+ * Can be run while other connections use the database, and resumes an upgrade
+ * that was stopped or failed partway.
+ *
+ * @param db
+ * The database to upgrade. It must be open for writing.
+ *
+ * @param progress
+ * Called before and during each step. May be 0.
+ *
+ * @param data
+ * Passed to progress.
+ *
+ * @retval 0
+ * Upgrade successful
+ *
+ * @retval 1
+ * Stopped by the progress callback. Upgrading again carries on from where it stopped.
+ *
+ * @retval -1
+ * Upgrade failed. Completed steps are kept.
+ */
+int db_upgrade(sqlite3 *db, upgrade_progress progress, void *data){
+    long long start = stats_start();
+    int result = run_steps(db, progress, data);
+    // Being stopped by the callback is not a failure.
+    stats_end(STATS_UPGRADE, start, result < 0);
+    return result;
+}
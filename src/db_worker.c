@@ -0,0 +1,651 @@
+/*
+    BookDBLite, a book database management solution using SQLite.
+    Copyright (C) 2015-2016  SilverNexus
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file db_worker.c
+ * Runs opens, upgrades, adds, removes and searches on a thread of its own,
+ * so the GUI never waits on SQLite.
+ *
+ * Requests are queued and return at once. The worker thread owns its own
+ * connection and runs them in order, then hands each outcome to a dispatch
+ * hook, which passes it to the thread that should see it; with GLib,
+ * db_worker_glib_dispatch() runs callbacks on the main loop.
+ *
+ * Searches are treated differently, since the user keeps typing. Only the
+ * newest search is kept: a new one replaces any search still waiting, and
+ * interrupts one already running, and each waits out its debounce time before
+ * it starts. A search that was replaced is answered as cancelled, never with
+ * results that no longer match what was typed.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "db_access.h"
+
+// How many SQLite VM steps a search runs between checks that it is still wanted.
+#define STALE_CHECK_STEPS 1000
+
+// The least time between upgrade progress reports, in nanoseconds.
+#define PROGRESS_INTERVAL_NS 33000000LL
+
+typedef enum {
+    REQUEST_OPEN,
+    REQUEST_ADD,
+    REQUEST_REMOVE,
+    REQUEST_SEARCH
+} request_type;
+
+struct db_request {
+    struct db_request *next;
+    request_type type;
+    db_reply_cb callback;
+    void *data;
+    db_reply reply;
+    // Holds the copied arguments and the results.
+    arena pool;
+    // For opens.
+    struct db_worker *worker;
+    char *path;
+    db_profile profile;
+    db_progress_cb progress;
+    long long last_progress;
+    // For adds and removes.
+    book *info;
+    // For searches.
+    search_term *terms;
+    int term_count;
+    size_t max;
+    unsigned long generation;
+    // When the search may start, in nanoseconds.
+    long long due;
+};
+
+// An upgrade progress report on its way to the caller.
+struct progress_report {
+    db_progress_cb progress;
+    void *data;
+    int version;
+    const char *step;
+    long done;
+    long total;
+};
+
+struct db_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    // Opens, adds and removes, in the order they were asked for. Under the lock.
+    struct db_request *head;
+    struct db_request *tail;
+    // The newest search, waiting to start. Under the lock.
+    struct db_request *search;
+    // Bumped by each new search, so older ones know to give up.
+    atomic_ulong search_generation;
+    // The generation of the search running. Only used by the worker thread.
+    unsigned long running_generation;
+    atomic_int stopping;
+    db_dispatch dispatch;
+    void *context;
+    // The worker's connection. Only used by the worker thread.
+    sqlite3 *conn;
+};
+
+/**
+ * The monotonic clock, in nanoseconds.
+ */
+static long long now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Calls a request's callback, then frees the request.
+ * Runs wherever the dispatch hook sends it.
+ */
+static void deliver_reply(void *data){
+    struct db_request *req = data;
+    if (req->callback)
+	req->callback(&req->reply, req->data);
+    arena_free(&req->pool);
+    free(req);
+}
+
+/**
+ * Calls an upgrade progress callback, then frees the report.
+ */
+static void deliver_progress(void *data){
+    struct progress_report *report = data;
+    report->progress(report->version, report->step, report->done, report->total, report->data);
+    free(report);
+}
+
+/**
+ * Hands a finished request over to be answered.
+ */
+static void finish_request(struct db_worker *worker, struct db_request *req){
+    if (worker->dispatch)
+	worker->dispatch(deliver_reply, req, worker->context);
+    else
+	deliver_reply(req);
+}
+
+/**
+ * Passes upgrade progress on, no more than about thirty times a second.
+ * Stops the upgrade if the worker is stopping.
+ */
+static int report_upgrade(void *data, int version, const char *step, long done, long total){
+    struct db_request *req = data;
+    struct db_worker *worker = req->worker;
+    if (atomic_load(&worker->stopping))
+	return 1;
+    long long now = now_ns();
+    if (!req->progress || (done != 0 && done != total && now - req->last_progress < PROGRESS_INTERVAL_NS))
+	return 0;
+    req->last_progress = now;
+    struct progress_report *report = malloc(sizeof(struct progress_report));
+    if (!report)
+	return 0;
+    *report = (struct progress_report){req->progress, req->data, version, step, done, total};
+    if (worker->dispatch)
+	worker->dispatch(deliver_progress, report, worker->context);
+    else
+	deliver_progress(report);
+    return 0;
+}
+
+/**
+ * Interrupts a running search once a newer one has been asked for,
+ * or the worker is stopping. Called by SQLite as the search runs.
+ */
+static int stale_search(void *data){
+    struct db_worker *worker = data;
+    return atomic_load_explicit(&worker->search_generation, memory_order_relaxed) != worker->running_generation ||
+	atomic_load_explicit(&worker->stopping, memory_order_relaxed);
+}
+
+/**
+ * Opens the database for a request, upgrading it if it is an older version.
+ * Any database already open is closed first.
+ */
+static void run_open(struct db_worker *worker, struct db_request *req){
+    close_connection(worker->conn);
+    worker->conn = 0;
+    int result = open_connection_upgradable(req->path, req->profile, &worker->conn);
+    if (result == 2 && req->profile != PROFILE_READ_ONLY){
+	int upgraded = db_upgrade(worker->conn, report_upgrade, req);
+	if (upgraded == 1)
+	    req->reply.cancelled = 1;
+	result = upgraded == 0 ? 0 : -1;
+    }
+    if (result != 0){
+	close_connection(worker->conn);
+	worker->conn = 0;
+    }
+    req->reply.status = result;
+}
+
+/**
+ * Runs a search for a request, collecting up to its maximum number of results.
+ */
+static void run_search(struct db_worker *worker, struct db_request *req){
+    worker->running_generation = req->generation;
+    if (stale_search(worker)){
+	req->reply.cancelled = 1;
+	return;
+    }
+    sqlite3_progress_handler(worker->conn, STALE_CHECK_STEPS, stale_search, worker);
+    search_cursor *cursor = search_open_terms(worker->conn, req->terms, req->term_count, 0);
+    if (cursor){
+	req->reply.books = search_collect(cursor, &req->pool, req->max, &req->reply.count);
+	if (!req->reply.books)
+	    req->reply.status = -1;
+	search_close(cursor);
+    }
+    else
+	req->reply.status = -1;
+    sqlite3_progress_handler(worker->conn, 0, 0, 0);
+    // Results for a search that has since been replaced are of no use.
+    if (stale_search(worker)){
+	req->reply.cancelled = 1;
+	req->reply.status = 0;
+	req->reply.books = 0;
+	req->reply.count = 0;
+    }
+}
+
+/**
+ * Runs one request on the worker's connection.
+ */
+static void run_request(struct db_worker *worker, struct db_request *req){
+    if (req->reply.cancelled)
+	return;
+    if (req->type == REQUEST_OPEN){
+	run_open(worker, req);
+	return;
+    }
+    if (!worker->conn){
+	req->reply.status = -1;
+	return;
+    }
+    switch (req->type){
+	case REQUEST_ADD:
+	    req->reply.status = add(worker->conn, req->info);
+	    break;
+	case REQUEST_REMOVE:
+	    req->reply.status = remove_book(worker->conn, req->info);
+	    break;
+	default:
+	    run_search(worker, req);
+	    break;
+    }
+}
+
+/**
+ * Waits for the next request to run, under the lock. Changes go first;
+ * the waiting search only once its debounce time is up.
+ *
+ * @return
+ * The request, or 0 once the worker is stopping and has nothing left to do.
+ */
+static struct db_request *next_request(struct db_worker *worker){
+    for (;;){
+	if (worker->head){
+	    struct db_request *req = worker->head;
+	    if (!(worker->head = req->next))
+		worker->tail = 0;
+	    return req;
+	}
+	struct db_request *search = worker->search;
+	if (search && atomic_load(&worker->stopping)){
+	    worker->search = 0;
+	    search->reply.cancelled = 1;
+	    return search;
+	}
+	if (atomic_load(&worker->stopping))
+	    return 0;
+	if (search){
+	    long long now = now_ns();
+	    if (now >= search->due){
+		worker->search = 0;
+		return search;
+	    }
+	    struct timespec until = {search->due / 1000000000LL, search->due % 1000000000LL};
+	    pthread_cond_timedwait(&worker->wake, &worker->lock, &until);
+	}
+	else
+	    pthread_cond_wait(&worker->wake, &worker->lock);
+    }
+}
+
+/**
+ * The worker thread. Runs requests until stopped, then closes its connection.
+ */
+static void *run_worker(void *data){
+    struct db_worker *worker = data;
+    pthread_mutex_lock(&worker->lock);
+    struct db_request *req;
+    while ((req = next_request(worker))){
+	pthread_mutex_unlock(&worker->lock);
+	run_request(worker, req);
+	finish_request(worker, req);
+	pthread_mutex_lock(&worker->lock);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    close_connection(worker->conn);
+    worker->conn = 0;
+    return 0;
+}
+
+/**
+ * Starts a worker thread. It has no database until db_worker_open().
+ *
+ * @param dispatch
+ * Hands each reply to the thread that should see it, e.g. db_worker_glib_dispatch().
+ * If 0, callbacks are called on the worker thread.
+ *
+ * @param context
+ * Passed to dispatch, e.g. the GMainContext, or 0 for the default.
+ *
+ * @return
+ * The worker, or 0 if it could not be started.
+ */
+db_worker *db_worker_start(db_dispatch dispatch, void *context){
+    struct db_worker *worker = calloc(1, sizeof(struct db_worker));
+    if (!worker)
+	return 0;
+    worker->dispatch = dispatch;
+    worker->context = context;
+    // Debounce deadlines are on the monotonic clock, so the wait must be too.
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int ok = pthread_cond_init(&worker->wake, &attr) == 0;
+    pthread_condattr_destroy(&attr);
+    if (!ok){
+	free(worker);
+	return 0;
+    }
+    pthread_mutex_init(&worker->lock, 0);
+    if (pthread_create(&worker->thread, 0, run_worker, worker) != 0){
+	pthread_mutex_destroy(&worker->lock);
+	pthread_cond_destroy(&worker->wake);
+	free(worker);
+	return 0;
+    }
+    return worker;
+}
+
+/**
+ * Makes a request, with room for its arguments.
+ */
+static struct db_request *new_request(request_type type, size_t block_size, db_reply_cb callback, void *data){
+    struct db_request *req = calloc(1, sizeof(struct db_request));
+    if (!req)
+	return 0;
+    req->type = type;
+    req->callback = callback;
+    req->data = data;
+    arena_init(&req->pool, 0, 0, block_size);
+    return req;
+}
+
+/**
+ * Frees a request that was never queued.
+ */
+static void free_request(struct db_request *req){
+    arena_free(&req->pool);
+    free(req);
+}
+
+/**
+ * Queues a change or open behind those already asked for.
+ */
+static void queue_request(struct db_worker *worker, struct db_request *req){
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail)
+	worker->tail->next = req;
+    else
+	worker->head = req;
+    worker->tail = req;
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+/**
+ * Asks the worker to open a database, in place of any it has open.
+ * An older database is upgraded, unless opened read only.
+ *
+ * @param worker
+ * The worker from db_worker_start().
+ *
+ * @param path
+ * The database file. It is copied.
+ *
+ * @param profile
+ * The performance profile to open the connection with.
+ *
+ * @param progress
+ * Called as an upgrade goes along, through the dispatch hook. May be 0.
+ *
+ * @param callback
+ * Called once the database is open. The status is open_db()'s, except that an
+ * older database gives 0 once upgraded, or -1 if the upgrade failed. May be 0.
+ *
+ * @param data
+ * Passed to progress and callback.
+ *
+ * @return
+ * 0 if queued, -1 if out of memory, in which case callback is never called.
+ */
+int db_worker_open(db_worker *worker, const char * const path, db_profile profile, db_progress_cb progress,
+	db_reply_cb callback, void *data){
+    struct db_request *req = new_request(REQUEST_OPEN, 1024, callback, data);
+    if (!req)
+	return -1;
+    if (!(req->path = arena_strdup(&req->pool, path))){
+	free_request(req);
+	return -1;
+    }
+    req->worker = worker;
+    req->profile = profile;
+    req->progress = progress;
+    queue_request(worker, req);
+    return 0;
+}
+
+/**
+ * Queues an add() or remove_book() of a copy of a book.
+ */
+static int queue_change(db_worker *worker, request_type type, const book * const info, db_reply_cb callback,
+	void *data){
+    struct db_request *req = new_request(type, 4096, callback, data);
+    if (!req)
+	return -1;
+    if (!(req->info = copy_book(&req->pool, info))){
+	free_request(req);
+	return -1;
+    }
+    queue_request(worker, req);
+    return 0;
+}
+
+/**
+ * Asks the worker to add a book, as add() does.
+ *
+ * @param worker
+ * The worker from db_worker_start().
+ *
+ * @param info
+ * The book to add. It is copied.
+ *
+ * @param callback
+ * Called with add()'s result once done. May be 0.
+ *
+ * @param data
+ * Passed to callback.
+ *
+ * @return
+ * 0 if queued, -1 if out of memory, in which case callback is never called.
+ */
+int db_worker_add(db_worker *worker, const book * const info, db_reply_cb callback, void *data){
+    return queue_change(worker, REQUEST_ADD, info, callback, data);
+}
+
+/**
+ * Asks the worker to remove a book, as remove_book() does.
+ *
+ * @param worker
+ * The worker from db_worker_start().
+ *
+ * @param info
+ * The book to remove. It is copied.
+ *
+ * @param callback
+ * Called with remove_book()'s result once done. May be 0.
+ *
+ * @param data
+ * Passed to callback.
+ *
+ * @return
+ * 0 if queued, -1 if out of memory, in which case callback is never called.
+ */
+int db_worker_remove(db_worker *worker, const book * const info, db_reply_cb callback, void *data){
+    return queue_change(worker, REQUEST_REMOVE, info, callback, data);
+}
+
+/**
+ * Asks the worker to search, in place of any search asked for before.
+ * Call it on every keystroke; the older searches are dropped or interrupted,
+ * and answered as cancelled.
+ *
+ * @param worker
+ * The worker from db_worker_start().
+ *
+ * @param terms
+ * The conditions, as for search_open_terms(). They are copied.
+ *
+ * @param count
+ * The number of terms.
+ *
+ * @param max
+ * The most results to return.
+ *
+ * @param debounce_ms
+ * How long to wait for a newer search before starting this one, in milliseconds.
+ *
+ * @param callback
+ * Called with the results, or as cancelled. The results are only valid until
+ * it returns. The status is 0, or -1 if the search failed. May be 0.
+ *
+ * @param data
+ * Passed to callback.
+ *
+ * @return
+ * 0 if queued, -1 if out of memory, in which case callback is never called.
+ */
+int db_worker_search(db_worker *worker, const search_term * const terms, int count, size_t max, int debounce_ms,
+	db_reply_cb callback, void *data){
+    struct db_request *req = new_request(REQUEST_SEARCH, 0, callback, data);
+    if (!req)
+	return -1;
+    req->terms = arena_alloc(&req->pool, sizeof(search_term) * (count > 0 ? count : 1));
+    if (!req->terms){
+	free_request(req);
+	return -1;
+    }
+    for (int i = 0; i < count; ++i){
+	req->terms[i] = terms[i];
+	if (terms[i].text && !(req->terms[i].text = arena_strdup(&req->pool, terms[i].text))){
+	    free_request(req);
+	    return -1;
+	}
+    }
+    req->term_count = count;
+    req->max = max;
+    req->due = now_ns() + debounce_ms * 1000000LL;
+    pthread_mutex_lock(&worker->lock);
+    req->generation = atomic_fetch_add(&worker->search_generation, 1) + 1;
+    struct db_request *replaced = worker->search;
+    worker->search = req;
+    // The replaced search is answered by the worker, not on the caller's thread.
+    if (replaced){
+	replaced->reply.cancelled = 1;
+	replaced->next = 0;
+	if (worker->tail)
+	    worker->tail->next = replaced;
+	else
+	    worker->head = replaced;
+	worker->tail = replaced;
+    }
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+    return 0;
+}
+
+/**
+ * Drops the waiting search and interrupts a running one, e.g. when the
+ * search box is cleared. Both are answered as cancelled.
+ *
+ * @param worker
+ * The worker from db_worker_start().
+ */
+void db_worker_cancel_searches(db_worker *worker){
+    pthread_mutex_lock(&worker->lock);
+    atomic_fetch_add(&worker->search_generation, 1);
+    struct db_request *replaced = worker->search;
+    worker->search = 0;
+    if (replaced){
+	replaced->reply.cancelled = 1;
+	if (worker->tail)
+	    worker->tail->next = replaced;
+	else
+	    worker->head = replaced;
+	worker->tail = replaced;
+	pthread_cond_signal(&worker->wake);
+    }
+    pthread_mutex_unlock(&worker->lock);
+}
+
+/**
+ * Stops a worker once the changes already asked for are done, and closes its
+ * database. Searches are cancelled, and an upgrade stops where it is, to carry
+ * on next time.
+ *
+ * @param worker
+ * The worker to stop. It is freed. May be 0.
+ *
+ * @note Replies already handed to the dispatch hook are still delivered
+ * afterwards, and own everything they point to.
+ */
+void db_worker_stop(db_worker *worker){
+    if (!worker)
+	return;
+    pthread_mutex_lock(&worker->lock);
+    atomic_store(&worker->stopping, 1);
+    pthread_cond_signal(&worker->wake);
+    pthread_mutex_unlock(&worker->lock);
+    pthread_join(worker->thread, 0);
+    pthread_mutex_destroy(&worker->lock);
+    pthread_cond_destroy(&worker->wake);
+    free(worker);
+}
+
+#ifdef HAVE_GLIB
+#include <glib.h>
+
+// A reply on its way to the GLib main loop.
+struct glib_delivery {
+    void (*deliver)(void *data);
+    void *data;
+};
+
+/**
+ * Runs a delivery from the main loop, once.
+ */
+static gboolean run_delivery(gpointer data){
+    struct glib_delivery *delivery = data;
+    delivery->deliver(delivery->data);
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * A dispatch hook for db_worker_start() that runs callbacks on a GLib main loop.
+ * Replies are idle sources, so drawing and input go first and the GUI keeps
+ * its frame rate while results come in.
+ *
+ * @param context
+ * The GMainContext to run callbacks on, or 0 for the default one GTK uses.
+ */
+void db_worker_glib_dispatch(void (*deliver)(void *data), void *data, void *context){
+    struct glib_delivery *delivery = g_new(struct glib_delivery, 1);
+    delivery->deliver = deliver;
+    delivery->data = data;
+    GSource *source = g_idle_source_new();
+    g_source_set_priority(source, G_PRIORITY_DEFAULT_IDLE);
+    g_source_set_callback(source, run_delivery, delivery, g_free);
+    g_source_attach(source, context);
+    g_source_unref(source);
+}
+#endif
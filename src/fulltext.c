@@ -0,0 +1,265 @@
+/*
+    BookDBLite, a book database management solution using SQLite.
+    Copyright (C) 2015-2016  SilverNexus
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file fulltext.c
+ * Maintains the FTS5 index behind FIELD_ANY searches.
+ *
+ * BookSearch holds one row per book, with the same rowid as the BookID.
+ * A new book is indexed by index_book() once its authors and genres are linked,
+ * so its row is written once rather than again for every link.
+ * From then on, triggers on Book, BookAuthor, Author, BookGenre and Genre keep it in sync.
+ */
+
+#include <sqlite3.h>
+#include "db_access.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Expression giving the space-separated author names of the book with id BOOK_ID_EXPR.
+#define AUTHOR_NAMES(book_id_expr) \
+    "(SELECT group_concat(trim(AuthorFirst || ' ' || ifnull(AuthorMiddle, '') || ' ' ||" \
+    " AuthorLast || ' ' || ifnull(AuthorSuffix, '')), ' ')" \
+    " FROM BookAuthor JOIN Author ON Author.AuthorID = BookAuthor.AuthorID" \
+    " WHERE BookAuthor.BookID = " book_id_expr ")"
+
+// Expression giving the space-separated genre names of the book with id BOOK_ID_EXPR.
+#define GENRE_NAMES(book_id_expr) \
+    "(SELECT group_concat(GenreName, ' ')" \
+    " FROM BookGenre JOIN Genre ON Genre.GenreID = BookGenre.GenreID" \
+    " WHERE BookGenre.BookID = " book_id_expr ")"
+
+static const char * const fulltext_sql[] = {
+    "CREATE VIRTUAL TABLE IF NOT EXISTS BookSearch USING fts5("
+	"Title, Subtitle, Authors, Genres, tokenize = 'unicode61 remove_diacritics 2')",
+
+    // Book rows carry the title and subtitle.
+    "CREATE TRIGGER IF NOT EXISTS BookSearchUpdate AFTER UPDATE OF Title, Subtitle ON Book BEGIN"
+	" UPDATE BookSearch SET Title = NEW.Title, Subtitle = NEW.Subtitle WHERE rowid = NEW.BookID;"
+	" END",
+    "CREATE TRIGGER IF NOT EXISTS BookSearchDelete AFTER DELETE ON Book BEGIN"
+	" DELETE FROM BookSearch WHERE rowid = OLD.BookID;"
+	" END",
+
+    // Author names change when a book gains or loses an author, or an author is renamed.
+    // A book still being linked has no row yet, and is indexed with all its authors after.
+    "CREATE TRIGGER IF NOT EXISTS BookSearchAuthorAdd AFTER INSERT ON BookAuthor"
+	" WHEN EXISTS (SELECT 1 FROM BookSearch WHERE rowid = NEW.BookID) BEGIN"
+	" UPDATE BookSearch SET Authors = " AUTHOR_NAMES("NEW.BookID") " WHERE rowid = NEW.BookID;"
+	" END",
+    "CREATE TRIGGER IF NOT EXISTS BookSearchAuthorRemove AFTER DELETE ON BookAuthor BEGIN"
+	" UPDATE BookSearch SET Authors = " AUTHOR_NAMES("OLD.BookID") " WHERE rowid = OLD.BookID;"
+	" END",
+    "CREATE TRIGGER IF NOT EXISTS BookSearchAuthorRename AFTER UPDATE ON Author BEGIN"
+	" UPDATE BookSearch SET Authors = " AUTHOR_NAMES("BookSearch.rowid")
+	" WHERE rowid IN (SELECT BookID FROM BookAuthor WHERE AuthorID = NEW.AuthorID);"
+	" END",
+
+    // Likewise for genres.
+    "CREATE TRIGGER IF NOT EXISTS BookSearchGenreAdd AFTER INSERT ON BookGenre"
+	" WHEN EXISTS (SELECT 1 FROM BookSearch WHERE rowid = NEW.BookID) BEGIN"
+	" UPDATE BookSearch SET Genres = " GENRE_NAMES("NEW.BookID") " WHERE rowid = NEW.BookID;"
+	" END",
+    "CREATE TRIGGER IF NOT EXISTS BookSearchGenreRemove AFTER DELETE ON BookGenre BEGIN"
+	" UPDATE BookSearch SET Genres = " GENRE_NAMES("OLD.BookID") " WHERE rowid = OLD.BookID;"
+	" END",
+    "CREATE TRIGGER IF NOT EXISTS BookSearchGenreRename AFTER UPDATE ON Genre BEGIN"
+	" UPDATE BookSearch SET Genres = " GENRE_NAMES("BookSearch.rowid")
+	" WHERE rowid IN (SELECT BookID FROM BookGenre WHERE GenreID = NEW.GenreID);"
+	" END"
+};
+
+/**
+ * Creates the full-text index and the triggers that maintain it.
+ * Books already in the database are indexed by fill_fulltext().
+ * Used both by new_db() and when upgrading to schema version 3.
+ *
+ * @param db
+ * The database to index
+ *
+ * @retval 0
+ * The full-text index is ready.
+ *
+ * @retval -1
+ * Failed to create the index. SQLite may have been built without FTS5.
+ */
+int create_fulltext(sqlite3 *db){
+    if (!db)
+	return -1;
+    for (unsigned int i = 0; i < sizeof(fulltext_sql) / sizeof(fulltext_sql[0]); ++i){
+	if (sqlite3_exec(db, fulltext_sql[i], 0, 0, 0) != SQLITE_OK)
+	    return -1;
+    }
+    return 0;
+}
+
+/**
+ * Replaces the triggers of schema version 3, which indexed a book as soon as its
+ * Book row was added and then rewrote its row for every author and genre linked.
+ * Used when upgrading to schema version 7.
+ *
+ * @param db
+ * The database to update.
+ *
+ * @retval 0
+ * The triggers are replaced.
+ *
+ * @retval -1
+ * Failed to replace them.
+ */
+int update_fulltext(sqlite3 *db){
+    if (!db || sqlite3_exec(db, "DROP TRIGGER IF EXISTS BookSearchInsert;"
+	    " DROP TRIGGER IF EXISTS BookSearchAuthorAdd;"
+	    " DROP TRIGGER IF EXISTS BookSearchGenreAdd", 0, 0, 0) != SQLITE_OK)
+	return -1;
+    return create_fulltext(db);
+}
+
+/**
+ * Adds a book to the full-text index, once its authors and genres are linked.
+ * A book that is already indexed is left as it is.
+ *
+ * @param db
+ * The database the book is in.
+ *
+ * @param book_id
+ * The BookID of the book.
+ *
+ * @return
+ * 0 on success, -1 on failure.
+ */
+int index_book(sqlite3 *db, sqlite3_int64 book_id){
+    sqlite3_stmt *stmt = get_stmt(db, "INSERT INTO BookSearch (rowid, Title, Subtitle, Authors, Genres)"
+	" SELECT BookID, Title, Subtitle, " AUTHOR_NAMES("Book.BookID") ", " GENRE_NAMES("Book.BookID")
+	" FROM Book WHERE BookID = ?1 AND NOT EXISTS (SELECT 1 FROM BookSearch WHERE rowid = ?1)");
+    if (!stmt)
+	return -1;
+    int result = sqlite3_bind_int64(stmt, 1, book_id) == SQLITE_OK ? sqlite3_step(stmt) : SQLITE_ERROR;
+    release_stmt(stmt);
+    return result == SQLITE_DONE ? 0 : -1;
+}
+
+/**
+ * Indexes the next chunk of books that were there before the full-text index existed.
+ * Each call is small enough to run in a short transaction of its own,
+ * while add() indexes books added in the meantime.
+ *
+ * @param db
+ * The database to index.
+ *
+ * @param after
+ * Only books with a higher BookID are indexed. 0 starts from the beginning.
+ *
+ * @param limit
+ * The most books to look at.
+ *
+ * @param last
+ * Where to store the highest BookID looked at, to pass as after next time.
+ *
+ * @return
+ * The number of books looked at, 0 once every book is indexed, or -1 on failure.
+ */
+int fill_fulltext(sqlite3 *db, sqlite3_int64 after, int limit, sqlite3_int64 *last){
+    sqlite3_stmt *stmt = get_stmt(db, "SELECT count(*), max(BookID) FROM"
+	" (SELECT BookID FROM Book WHERE BookID > ? ORDER BY BookID LIMIT ?)");
+    if (!stmt)
+	return -1;
+    if (sqlite3_bind_int64(stmt, 1, after) != SQLITE_OK || sqlite3_bind_int(stmt, 2, limit) != SQLITE_OK ||
+	    sqlite3_step(stmt) != SQLITE_ROW){
+	release_stmt(stmt);
+	return -1;
+    }
+    int count = sqlite3_column_int(stmt, 0);
+    sqlite3_int64 upper = sqlite3_column_int64(stmt, 1);
+    release_stmt(stmt);
+    if (count == 0)
+	return 0;
+    // Books add() has already indexed are skipped.
+    stmt = get_stmt(db, "INSERT INTO BookSearch (rowid, Title, Subtitle, Authors, Genres)"
+	" SELECT BookID, Title, Subtitle, " AUTHOR_NAMES("Book.BookID") ", " GENRE_NAMES("Book.BookID")
+	" FROM Book WHERE BookID > ? AND BookID <= ?"
+	" AND NOT EXISTS (SELECT 1 FROM BookSearch WHERE rowid = Book.BookID)");
+    if (!stmt)
+	return -1;
+    int result = sqlite3_bind_int64(stmt, 1, after) == SQLITE_OK &&
+	sqlite3_bind_int64(stmt, 2, upper) == SQLITE_OK ? sqlite3_step(stmt) : SQLITE_ERROR;
+    release_stmt(stmt);
+    if (result != SQLITE_DONE)
+	return -1;
+    *last = upper;
+    return count;
+}
+
+/**
+ * Turns what the user typed into an FTS5 query.
+ * Every bare word becomes a prefix search, so partial words match.
+ * Text in double quotes is searched for as an exact phrase.
+ * All words and phrases must match.
+ *
+ * @param text
+ * What the user typed.
+ *
+ * @return
+ * The query, which the caller must free(), or 0 if there is nothing
+ * to search for or memory ran out.
+ */
+char *make_match_query(const char * const text){
+    // Worst case, every character becomes a quoted term of its own.
+    size_t len = strlen(text);
+    char *query = malloc(len * 5 + 1);
+    if (!query)
+	return 0;
+    char *out = query;
+    const char *pos = text;
+    while (*pos){
+	while (*pos == ' ' || *pos == '\t')
+	    ++pos;
+	if (!*pos)
+	    break;
+	int phrase = *pos == '"';
+	if (phrase)
+	    ++pos;
+	if (out != query)
+	    *out++ = ' ';
+	*out++ = '"';
+	const char *start = out;
+	while (*pos && (phrase ? *pos != '"' : (*pos != ' ' && *pos != '\t' && *pos != '"'))){
+	    // Quotes are doubled inside an FTS5 string.
+	    if (*pos == '"')
+		*out++ = '"';
+	    *out++ = *pos++;
+	}
+	if (phrase && *pos == '"')
+	    ++pos;
+	if (out == start){
+	    // Empty term, so take back the opening quote.
+	    out -= (out - 1 == query) ? 1 : 2;
+	    continue;
+	}
+	*out++ = '"';
+	if (!phrase)
+	    *out++ = '*';
+    }
+    *out = '\0';
+    if (out == query){
+	free(query);
+	return 0;
+    }
+    return query;
+}
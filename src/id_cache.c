@@ -0,0 +1,636 @@
+/*
+    BookDBLite, a book database management solution using SQLite.
+    Copyright (C) 2015-2016  SilverNexus
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file id_cache.c
+ * Remembers the ids of authors, owners, genres and binding types,
+ * so adds do not have to look them up in the database every time.
+ *
+ * Each table is loaded the first time it is used. If the whole table fits,
+ * the cache knows a name that is not cached is not in the table either,
+ * and the lookup query can be skipped. Once full, entries are evicted
+ * in clock order, and the table is no longer known to be complete.
+ *
+ * The entries and hash buckets start small and grow as rows are cached,
+ * up to ID_CACHE_MAX_ENTRIES, so a connection that only looks up a few
+ * names does not pay for a full cache.
+ *
+ * The cache stays coherent by:
+ *  - recording every row add() inserts,
+ *  - no longer taking a table to be complete once anything else inserts into it,
+ *  - dropping rows deleted or changed on this connection, via the update hook,
+ *  - clearing itself when a transaction is rolled back, and
+ *  - clearing itself when another connection has changed the database,
+ *    which PRAGMA data_version reports.
+ */
+
+#include <pthread.h>
+#include <sqlite3.h>
+#include "db_access.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Entries made room for when the first row is cached.
+#define ID_CACHE_INITIAL_ENTRIES 64
+
+struct id_entry {
+    char *key;
+    unsigned long hash;
+    int id;
+    char tag;
+    // Set when used, cleared as the clock hand passes.
+    char referenced;
+    // Next entry in the same key bucket, or -1.
+    int next;
+    // Next entry in the same id bucket, or -1.
+    int id_next;
+};
+
+struct id_cache {
+    sqlite3 *db;
+    struct id_entry *entries;
+    int capacity;
+    // Entries by key, and by tag and id for rows deleted or changed.
+    // Both have bucket_count buckets, a power of two at least the capacity.
+    int *buckets;
+    int *id_buckets;
+    int bucket_count;
+    int used;
+    int clock_hand;
+    // Whether each table has been loaded, and whether all of it is cached. Indexed by tag.
+    char loaded[128];
+    char complete[128];
+    // The tag of the insert id_cache_put() is about to record, or 0.
+    char expected_insert;
+    sqlite3_int64 data_version;
+    unsigned long hits;
+    unsigned long misses;
+    struct id_cache *next;
+};
+
+// One cache per open connection. The list is shared between threads, so it is locked.
+static struct id_cache *id_caches = 0;
+static pthread_mutex_t id_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * What each tag stands for.
+ * The load query returns the id followed by the key values, in key order.
+ */
+static const struct {
+    char tag;
+    const char *table;
+    const char *load_sql;
+} id_tables[] = {
+    {'A', "Author", "SELECT AuthorID, AuthorLast, AuthorFirst, AuthorMiddle, AuthorSuffix FROM Author"},
+    {'O', "Owner", "SELECT OwnerID, OwnerLast, OwnerFirst, OwnerMiddle, OwnerSuffix FROM Owner"},
+    {'G', "Genre", "SELECT GenreID, GenreName FROM Genre"},
+    {'T', "Type", "SELECT TypeID, TypeName FROM Type"}
+};
+
+/**
+ * FNV-1a hash of a key.
+ */
+static unsigned long hash_key(const char *key){
+    unsigned long hash = 2166136261UL;
+    while (*key){
+	hash ^= (unsigned char)*key++;
+	hash *= 16777619UL;
+    }
+    return hash;
+}
+
+/**
+ * Hash of a row's tag and id, for finding it when the row is deleted or changed.
+ */
+static unsigned long hash_id(char tag, int id){
+    return ((unsigned long)(unsigned int)id * 2654435761UL) ^ (unsigned char)tag;
+}
+
+/**
+ * Builds the key for a row out of its tag and values.
+ * Empty strings and nulls are treated alike.
+ *
+ * @retval 0
+ * Key built
+ *
+ * @retval -1
+ * The values do not fit in the buffer, so the row cannot be cached.
+ */
+static int make_key(char *buf, size_t len, char tag, const char * const *values, int count){
+    size_t pos = 0;
+    buf[pos++] = tag;
+    for (int i = 0; i < count; ++i){
+	// Separate the fields with unit separators.
+	const char *val = values[i] ? values[i] : "";
+	size_t val_len = strlen(val);
+	if (pos + val_len + 2 > len)
+	    return -1;
+	buf[pos++] = '\x1f';
+	memcpy(buf + pos, val, val_len);
+	pos += val_len;
+    }
+    buf[pos] = '\0';
+    return 0;
+}
+
+/**
+ * Empties a cache, and gives back its memory.
+ */
+static void clear_cache(struct id_cache *cache){
+    for (int i = 0; i < cache->used; ++i)
+	free(cache->entries[i].key);
+    free(cache->entries);
+    free(cache->buckets);
+    free(cache->id_buckets);
+    cache->entries = 0;
+    cache->buckets = 0;
+    cache->id_buckets = 0;
+    cache->capacity = 0;
+    cache->bucket_count = 0;
+    cache->used = 0;
+    cache->clock_hand = 0;
+    memset(cache->loaded, 0, sizeof(cache->loaded));
+    memset(cache->complete, 0, sizeof(cache->complete));
+}
+
+/**
+ * Puts an entry at the head of its key and id bucket chains.
+ */
+static void link_entry(struct id_cache *cache, int index){
+    struct id_entry *entry = &cache->entries[index];
+    int *bucket = &cache->buckets[entry->hash & (cache->bucket_count - 1)];
+    entry->next = *bucket;
+    *bucket = index;
+    bucket = &cache->id_buckets[hash_id(entry->tag, entry->id) & (cache->bucket_count - 1)];
+    entry->id_next = *bucket;
+    *bucket = index;
+}
+
+/**
+ * Takes an entry out of its bucket chains.
+ */
+static void unlink_entry(struct id_cache *cache, int index){
+    struct id_entry *entry = &cache->entries[index];
+    int *link = &cache->buckets[entry->hash & (cache->bucket_count - 1)];
+    while (*link != index)
+	link = &cache->entries[*link].next;
+    *link = entry->next;
+    link = &cache->id_buckets[hash_id(entry->tag, entry->id) & (cache->bucket_count - 1)];
+    while (*link != index)
+	link = &cache->entries[*link].id_next;
+    *link = entry->id_next;
+}
+
+/**
+ * Makes room for more entries, doubling the space up to ID_CACHE_MAX_ENTRIES.
+ * The buckets grow along with it, and every entry is linked into them again.
+ *
+ * @retval 0
+ * There is room for another entry.
+ *
+ * @retval -1
+ * The cache is at its limit, or out of memory. It is left as it was.
+ */
+static int grow_entries(struct id_cache *cache){
+    int capacity = cache->capacity ? cache->capacity * 2 : ID_CACHE_INITIAL_ENTRIES;
+    if (capacity > ID_CACHE_MAX_ENTRIES)
+	capacity = ID_CACHE_MAX_ENTRIES;
+    if (capacity <= cache->capacity)
+	return -1;
+    int bucket_count = cache->bucket_count ? cache->bucket_count : 1;
+    while (bucket_count < capacity)
+	bucket_count *= 2;
+    int *buckets = 0, *id_buckets = 0;
+    if (bucket_count != cache->bucket_count){
+	buckets = malloc(bucket_count * sizeof(int));
+	id_buckets = malloc(bucket_count * sizeof(int));
+	if (!buckets || !id_buckets){
+	    free(buckets);
+	    free(id_buckets);
+	    if (!cache->bucket_count)
+		return -1;
+	    // Longer chains will do until there is memory to spread them out.
+	    buckets = id_buckets = 0;
+	}
+    }
+    struct id_entry *entries = realloc(cache->entries, capacity * sizeof(struct id_entry));
+    if (!entries){
+	free(buckets);
+	free(id_buckets);
+	return -1;
+    }
+    cache->entries = entries;
+    cache->capacity = capacity;
+    if (!buckets)
+	return 0;
+    free(cache->buckets);
+    free(cache->id_buckets);
+    cache->buckets = buckets;
+    cache->id_buckets = id_buckets;
+    cache->bucket_count = bucket_count;
+    for (int i = 0; i < bucket_count; ++i)
+	buckets[i] = id_buckets[i] = -1;
+    for (int i = 0; i < cache->used; ++i)
+	link_entry(cache, i);
+    return 0;
+}
+
+/**
+ * Frees up an entry slot, evicting in clock order once the cache is full.
+ *
+ * @return
+ * The index of the free slot, or -1 if there is no memory for one.
+ */
+static int free_slot(struct id_cache *cache){
+    if (cache->used < cache->capacity || grow_entries(cache) == 0)
+	return cache->used++;
+    if (cache->used == 0)
+	return -1;
+    // Skip over recently used entries, giving each a second chance.
+    while (cache->entries[cache->clock_hand].referenced){
+	cache->entries[cache->clock_hand].referenced = 0;
+	cache->clock_hand = (cache->clock_hand + 1) % cache->used;
+    }
+    int victim = cache->clock_hand;
+    cache->clock_hand = (cache->clock_hand + 1) % cache->used;
+    unlink_entry(cache, victim);
+    // Part of that table is no longer cached, so a miss means nothing now.
+    cache->complete[(int)cache->entries[victim].tag] = 0;
+    free(cache->entries[victim].key);
+    return victim;
+}
+
+/**
+ * Adds a key to a cache, or updates its id.
+ */
+static void insert_entry(struct id_cache *cache, const char *key, unsigned long hash, char tag, int id){
+    for (int i = cache->bucket_count ? cache->buckets[hash & (cache->bucket_count - 1)] : -1; i >= 0;
+	    i = cache->entries[i].next){
+	if (cache->entries[i].hash == hash && strcmp(cache->entries[i].key, key) == 0){
+	    // The id decides the id bucket, so move it over.
+	    unlink_entry(cache, i);
+	    cache->entries[i].id = id;
+	    link_entry(cache, i);
+	    return;
+	}
+    }
+    char *copy = strdup(key);
+    int slot = copy ? free_slot(cache) : -1;
+    if (slot < 0){
+	// Could not cache it, so the table is not fully cached anymore.
+	cache->complete[(int)tag] = 0;
+	free(copy);
+	return;
+    }
+    cache->entries[slot].key = copy;
+    cache->entries[slot].hash = hash;
+    cache->entries[slot].id = id;
+    cache->entries[slot].tag = tag;
+    cache->entries[slot].referenced = 0;
+    link_entry(cache, slot);
+}
+
+/**
+ * Drops the entry for a deleted or changed row.
+ */
+static void forget_id(struct id_cache *cache, char tag, int id){
+    if (!cache->bucket_count)
+	return;
+    int i = cache->id_buckets[hash_id(tag, id) & (cache->bucket_count - 1)];
+    while (i >= 0 && (cache->entries[i].tag != tag || cache->entries[i].id != id))
+	i = cache->entries[i].id_next;
+    if (i < 0)
+	return;
+    unlink_entry(cache, i);
+    free(cache->entries[i].key);
+    // Move the last entry into the hole, so the used entries stay packed.
+    int last = --cache->used;
+    if (i != last){
+	unlink_entry(cache, last);
+	cache->entries[i] = cache->entries[last];
+	link_entry(cache, i);
+    }
+    if (cache->clock_hand >= cache->used)
+	cache->clock_hand = 0;
+}
+
+/**
+ * Notices rows added to, deleted from or changed in the cached tables on this connection.
+ */
+static void update_hook(void *data, int op, const char *db_name, const char *table, sqlite3_int64 rowid){
+    (void)db_name;
+    struct id_cache *cache = data;
+    for (unsigned int i = 0; i < sizeof(id_tables) / sizeof(id_tables[0]); ++i){
+	if (strcmp(table, id_tables[i].table) == 0){
+	    char tag = id_tables[i].tag;
+	    if (op == SQLITE_INSERT){
+		// A row added behind the cache's back is not cached, so a miss proves nothing.
+		if (cache->expected_insert != tag)
+		    cache->complete[(int)tag] = 0;
+		cache->expected_insert = 0;
+		return;
+	    }
+	    forget_id(cache, tag, (int)rowid);
+	    // A changed row may now go by a name that is not cached,
+	    // so a miss no longer proves a name is not in the table.
+	    if (op == SQLITE_UPDATE)
+		cache->complete[(int)tag] = 0;
+	    return;
+	}
+    }
+}
+
+/**
+ * Throws the cache away when a transaction is rolled back,
+ * since it may hold rows that no longer exist.
+ */
+static void rollback_hook(void *data){
+    clear_cache(data);
+}
+
+/**
+ * Reads the data version of a connection, which changes whenever another
+ * connection commits a change to the database.
+ *
+ * @return
+ * The data version, or -1 if it could not be read.
+ */
+static sqlite3_int64 read_data_version(sqlite3 *db){
+    sqlite3_stmt *stmt = get_stmt(db, "PRAGMA data_version");
+    if (!stmt)
+	return -1;
+    sqlite3_int64 version = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : -1;
+    release_stmt(stmt);
+    return version;
+}
+
+/**
+ * Finds the cache belonging to a connection.
+ *
+ * @return
+ * The cache, or 0 if the connection does not have one.
+ */
+static struct id_cache *lookup_cache(sqlite3 *db){
+    struct id_cache *cache;
+    pthread_mutex_lock(&id_caches_lock);
+    for (cache = id_caches; cache; cache = cache->next){
+	if (cache->db == db)
+	    break;
+    }
+    pthread_mutex_unlock(&id_caches_lock);
+    return cache;
+}
+
+/**
+ * Finds the cache belonging to a connection, making it if needed.
+ */
+static struct id_cache *find_cache(sqlite3 *db){
+    struct id_cache *cache = lookup_cache(db);
+    if (cache)
+	return cache;
+    // Only the connection's own thread makes its cache, so nobody else can add it meanwhile.
+    // The entries are only made room for as rows are cached.
+    cache = calloc(1, sizeof(struct id_cache));
+    if (!cache)
+	return 0;
+    cache->db = db;
+    clear_cache(cache);
+    cache->data_version = read_data_version(db);
+    cache->hits = 0;
+    cache->misses = 0;
+    pthread_mutex_lock(&id_caches_lock);
+    cache->next = id_caches;
+    id_caches = cache;
+    pthread_mutex_unlock(&id_caches_lock);
+    sqlite3_update_hook(db, update_hook, cache);
+    sqlite3_rollback_hook(db, rollback_hook, cache);
+    return cache;
+}
+
+/**
+ * Loads every row of a table into the cache, if they all fit.
+ */
+static void load_table(struct id_cache *cache, char tag){
+    cache->loaded[(int)tag] = 1;
+    const char *load_sql = 0;
+    for (unsigned int i = 0; i < sizeof(id_tables) / sizeof(id_tables[0]); ++i){
+	if (id_tables[i].tag == tag)
+	    load_sql = id_tables[i].load_sql;
+    }
+    if (!load_sql)
+	return;
+    // Count first, so a table too big to fit is not loaded only to be evicted again.
+    char count_sql[100];
+    strcpy(count_sql, "SELECT count(*)");
+    strcat(count_sql, strstr(load_sql, " FROM "));
+    sqlite3_stmt *stmt = get_stmt(cache->db, count_sql);
+    if (!stmt)
+	return;
+    int rows = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : -1;
+    release_stmt(stmt);
+    if (rows < 0 || rows > ID_CACHE_MAX_ENTRIES - cache->used)
+	return;
+    if (!(stmt = get_stmt(cache->db, load_sql)))
+	return;
+    int count = sqlite3_column_count(stmt) - 1;
+    cache->complete[(int)tag] = 1;
+    while (sqlite3_step(stmt) == SQLITE_ROW){
+	const char *values[4];
+	for (int i = 0; i < count && i < 4; ++i)
+	    values[i] = (const char *)sqlite3_column_text(stmt, i + 1);
+	char key[1024];
+	if (make_key(key, sizeof(key), tag, values, count) != 0){
+	    cache->complete[(int)tag] = 0;
+	    continue;
+	}
+	insert_entry(cache, key, hash_key(key), tag, sqlite3_column_int(stmt, 0));
+    }
+    release_stmt(stmt);
+}
+
+/**
+ * Throws away the cache if another connection has changed the database.
+ * Call before relying on the cache at the start of an operation.
+ *
+ * @param db
+ * The connection whose cache to check.
+ */
+void id_cache_validate(sqlite3 *db){
+    struct id_cache *cache = find_cache(db);
+    if (!cache)
+	return;
+    sqlite3_int64 version = read_data_version(db);
+    if (version != cache->data_version){
+	clear_cache(cache);
+	cache->data_version = version;
+    }
+}
+
+/**
+ * Looks up the id of a row by its values.
+ *
+ * @param db
+ * The connection the row is in.
+ *
+ * @param tag
+ * Which table: 'A'uthor, 'O'wner, 'G'enre or 'T'ype.
+ *
+ * @param values
+ * The values identifying the row, e.g. last, first, middle and suffix name.
+ *
+ * @param count
+ * The number of values.
+ *
+ * @param complete
+ * Set to 1 if the whole table is cached, meaning a miss proves the row does
+ * not exist. Set to 0 otherwise.
+ *
+ * @return
+ * The id, or 0 if the row is not cached.
+ */
+int id_cache_get(sqlite3 *db, char tag, const char * const *values, int count, int *complete){
+    *complete = 0;
+    struct id_cache *cache = find_cache(db);
+    if (!cache)
+	return 0;
+    if (!cache->loaded[(int)tag])
+	load_table(cache, tag);
+    char key[1024];
+    if (make_key(key, sizeof(key), tag, values, count) != 0)
+	return 0;
+    unsigned long hash = hash_key(key);
+    for (int i = cache->bucket_count ? cache->buckets[hash & (cache->bucket_count - 1)] : -1; i >= 0;
+	    i = cache->entries[i].next){
+	if (cache->entries[i].hash == hash && strcmp(cache->entries[i].key, key) == 0){
+	    cache->entries[i].referenced = 1;
+	    ++cache->hits;
+	    return cache->entries[i].id;
+	}
+    }
+    ++cache->misses;
+    *complete = cache->complete[(int)tag];
+    return 0;
+}
+
+/**
+ * Records the id of a row that was looked up or inserted.
+ *
+ * @param db
+ * The connection the row is in.
+ *
+ * @param tag
+ * Which table, as for id_cache_get().
+ *
+ * @param values
+ * The values identifying the row.
+ *
+ * @param count
+ * The number of values.
+ *
+ * @param id
+ * The id of the row.
+ */
+void id_cache_put(sqlite3 *db, char tag, const char * const *values, int count, int id){
+    struct id_cache *cache = find_cache(db);
+    if (!cache)
+	return;
+    char key[1024];
+    if (make_key(key, sizeof(key), tag, values, count) != 0){
+	cache->complete[(int)tag] = 0;
+	return;
+    }
+    insert_entry(cache, key, hash_key(key), tag, id);
+}
+
+/**
+ * Says the next insert into a cached table is one id_cache_put() will record,
+ * so it does not stop the table being taken as complete.
+ * Call just before running the insert, and again with 0 once it has run.
+ *
+ * @param db
+ * The connection the row is inserted on.
+ *
+ * @param tag
+ * Which table, as for id_cache_get(), or 0 to expect nothing.
+ */
+void id_cache_expect_insert(sqlite3 *db, char tag){
+    struct id_cache *cache = lookup_cache(db);
+    if (cache)
+	cache->expected_insert = tag;
+}
+
+/**
+ * Empties the cache for a connection.
+ * Needed when a savepoint is rolled back, since the rollback hook only
+ * covers whole transactions.
+ *
+ * @param db
+ * The connection whose cache to empty.
+ */
+void id_cache_clear(sqlite3 *db){
+    struct id_cache *cache = lookup_cache(db);
+    if (cache)
+	clear_cache(cache);
+}
+
+/**
+ * Drops the cache for a connection. Must be called before the connection is closed.
+ *
+ * @param db
+ * The connection whose cache to drop.
+ */
+void id_cache_free(sqlite3 *db){
+    struct id_cache *cache;
+    pthread_mutex_lock(&id_caches_lock);
+    for (struct id_cache **prev = &id_caches; (cache = *prev); prev = &cache->next){
+	if (cache->db == db){
+	    *prev = cache->next;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&id_caches_lock);
+    if (!cache)
+	return;
+    sqlite3_update_hook(db, 0, 0);
+    sqlite3_rollback_hook(db, 0, 0);
+    clear_cache(cache);
+    free(cache);
+}
+
+/**
+ * Reports how well the id cache for a connection is working.
+ *
+ * @param db
+ * The connection to report on.
+ *
+ * @param hits
+ * Where to store the number of lookups answered by the cache.
+ *
+ * @param misses
+ * Where to store the number of lookups the cache could not answer.
+ *
+ * @param entries
+ * Where to store the number of ids currently cached.
+ */
+void id_cache_stats(sqlite3 *db, unsigned long *hits, unsigned long *misses, unsigned long *entries){
+    struct id_cache *cache = lookup_cache(db);
+    *hits = cache ? cache->hits : 0;
+    *misses = cache ? cache->misses : 0;
+    *entries = cache ? (unsigned long)cache->used : 0;
+}
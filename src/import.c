@@ -0,0 +1,459 @@
+/*
+    BookDBLite, a book database management solution using SQLite.
+    Copyright (C) 2015-2016  SilverNexus
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file import.c
+ * Bulk loads books from a CSV or tab-separated file.
+ * The file layout is described in doc/Import_Format.
+ *
+ * The file is memory mapped and split into fields in place, so no field is
+ * ever copied or allocated. Once a chunk of rows has been added, the pages
+ * it came from are dropped, so memory use does not grow with the file size.
+ */
+
+#define _DEFAULT_SOURCE
+#include <sqlite3.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "book.h"
+#include "db_access.h"
+
+// How many rows are read before handing them to add_batch().
+#define IMPORT_CHUNK_ROWS 4096
+
+// The columns of a row, in order.
+enum {
+    COL_TITLE,
+    COL_SUBTITLE,
+    COL_AUTHORS,
+    COL_OWNER,
+    COL_YEAR,
+    COL_EDITION,
+    COL_QUANTITY,
+    COL_ISBN,
+    COL_BINDING,
+    COL_GENRES,
+    COL_COUNT
+};
+
+/*
+ * Walks the mapped file one record at a time.
+ * The byte at end is always a writable null, so the last field of the
+ * file can be terminated in place even without a trailing newline.
+ */
+struct tokenizer {
+    char *pos;
+    char *end;
+    char delim;
+    // The line pos is on, and the line the record last read started on. Both count from 1.
+    int line;
+    int record_line;
+};
+
+/**
+ * Reads the next record, splitting its fields in place.
+ * Fields may be quoted with double quotes, in which case they can contain
+ * the delimiter or newlines, and a doubled quote stands for one quote.
+ * Blank lines and lines starting with # are skipped.
+ *
+ * @param tok
+ * The tokenizer to read from.
+ *
+ * @param cols
+ * Where to store the start of each field. Each field is null-terminated.
+ *
+ * @param max_cols
+ * The size of cols. Any further fields in the record are ignored.
+ *
+ * @return
+ * The number of fields in the record, or -1 at the end of the file.
+ */
+static int next_record(struct tokenizer *tok, char **cols, int max_cols){
+    char *pos = tok->pos;
+    // Skip blank lines and comments.
+    while (pos < tok->end && (*pos == '\n' || *pos == '\r' || *pos == '#')){
+	if (*pos == '#'){
+	    while (pos < tok->end && *pos != '\n')
+		++pos;
+	}
+	else if (*pos++ == '\n')
+	    ++tok->line;
+    }
+    if (pos >= tok->end){
+	tok->pos = pos;
+	return -1;
+    }
+    tok->record_line = tok->line;
+    int count = 0;
+    for (;;){
+	char *field = pos;
+	char *out;
+	if (*pos == '"'){
+	    // Quoted field. Unescape into the same space, since it can only shrink.
+	    out = pos++;
+	    while (pos < tok->end){
+		if (*pos == '"'){
+		    if (pos[1] != '"'){
+			++pos;
+			break;
+		    }
+		    ++pos;
+		}
+		if (*pos == '\n')
+		    ++tok->line;
+		*out++ = *pos++;
+	    }
+	    // Keep anything stray after the closing quote.
+	    while (pos < tok->end && *pos != tok->delim && *pos != '\n' && *pos != '\r')
+		*out++ = *pos++;
+	}
+	else{
+	    while (pos < tok->end && *pos != tok->delim && *pos != '\n' && *pos != '\r')
+		++pos;
+	    out = pos;
+	}
+	char term = pos < tok->end ? *pos : '\n';
+	*out = '\0';
+	if (count < max_cols)
+	    cols[count++] = field;
+	if (pos < tok->end)
+	    ++pos;
+	if (term == tok->delim)
+	    continue;
+	if (term == '\r' && pos < tok->end && *pos == '\n')
+	    ++pos;
+	++tok->line;
+	tok->pos = pos;
+	return count;
+    }
+}
+
+/**
+ * Splits the next item off of a separated list, in place.
+ *
+ * @param cursor
+ * Points to the rest of the list. Advanced past the item.
+ *
+ * @param sep
+ * The separator between items.
+ *
+ * @return
+ * The item, or 0 when the list is used up. Empty items are skipped.
+ */
+static char *next_item(char **cursor, char sep){
+    char *item = *cursor;
+    while (item && *item == sep)
+	++item;
+    if (!item || !*item)
+	return 0;
+    char *next = strchr(item, sep);
+    if (next)
+	*next++ = '\0';
+    *cursor = next;
+    return item;
+}
+
+/**
+ * Turns empty fields into null pointers, so they are stored as NULL.
+ */
+static const char *null_if_empty(const char *field){
+    return (field && *field) ? field : 0;
+}
+
+/**
+ * Splits a name field of the form Last|First|Middle|Suffix in place.
+ * Trailing parts may be left off.
+ *
+ * @param text
+ * The name text. It is modified.
+ *
+ * @param out
+ * Where to store the name parts.
+ */
+static void parse_name(char *text, name *out){
+    char *parts[4] = {0, 0, 0, 0};
+    for (int i = 0; i < 4 && text; ++i){
+	parts[i] = text;
+	text = strchr(text, '|');
+	if (text)
+	    *text++ = '\0';
+    }
+    out->last = null_if_empty(parts[0]);
+    out->first = parts[1] ? parts[1] : "";
+    out->middle = null_if_empty(parts[2]);
+    out->suffix = null_if_empty(parts[3]);
+}
+
+/**
+ * Fills a book from the fields of a record.
+ *
+ * @param cols
+ * The fields of the record. They are modified.
+ *
+ * @param info
+ * The book to fill, with room for IMPORT_MAX_GENRES genres.
+ *
+ * @param authors
+ * Room for IMPORT_MAX_AUTHORS authors and the terminator.
+ *
+ * @retval 0
+ * The record was parsed.
+ *
+ * @retval -1
+ * The record is missing required fields.
+ */
+static int parse_row(char **cols, book *info, name *authors){
+    if (!*cols[COL_TITLE] || !*cols[COL_OWNER])
+	return -1;
+    info->title = cols[COL_TITLE];
+    info->subtitle = null_if_empty(cols[COL_SUBTITLE]);
+    parse_name(cols[COL_OWNER], &info->owner);
+    info->year = atoi(cols[COL_YEAR]);
+    info->edition_num = atoi(cols[COL_EDITION]);
+    info->quantity = atoi(cols[COL_QUANTITY]);
+    info->ISBN = null_if_empty(cols[COL_ISBN]);
+    info->binding_type = null_if_empty(cols[COL_BINDING]);
+
+    int author_count = 0;
+    char *cursor = cols[COL_AUTHORS];
+    char *item;
+    while (author_count < IMPORT_MAX_AUTHORS && (item = next_item(&cursor, ';')))
+	parse_name(item, &authors[author_count++]);
+    authors[author_count].last = 0;
+    info->authors = authors;
+
+    int genre_count = 0;
+    cursor = cols[COL_GENRES];
+    while (genre_count < IMPORT_MAX_GENRES && (item = next_item(&cursor, ';')))
+	info->genre[genre_count++] = item;
+    info->genre[genre_count] = 0;
+    return 0;
+}
+
+/**
+ * Parses one record in the import format, e.g. a line of a batch file.
+ *
+ * @param text
+ * The record. It is split up in place, and must have a writable null at text[len].
+ *
+ * @param len
+ * The length of the record.
+ *
+ * @param delim
+ * The field separator.
+ *
+ * @param info
+ * The book to fill, with room for IMPORT_MAX_GENRES genres.
+ * Its strings point into text.
+ *
+ * @param authors
+ * Room for IMPORT_MAX_AUTHORS authors and the terminator.
+ *
+ * @retval 0
+ * The record was parsed.
+ *
+ * @retval -1
+ * The record is empty or missing fields.
+ */
+int parse_book_record(char *text, size_t len, char delim, book *info, name *authors){
+    struct tokenizer tok = {text, text + len, delim, 1, 1};
+    char *cols[COL_COUNT];
+    if (next_record(&tok, cols, COL_COUNT) < COL_COUNT)
+	return -1;
+    return parse_row(cols, info, authors);
+}
+
+/**
+ * Maps a file privately, with a writable null byte just past its end.
+ * An anonymous mapping one byte longer than the file is made first,
+ * then the file is mapped over the start of it.
+ *
+ * @param fd
+ * The open file.
+ *
+ * @param size
+ * The size of the file. Must be nonzero.
+ *
+ * @return
+ * The start of the mapping, or 0 on failure.
+ */
+static char *map_file(int fd, size_t size){
+    char *base = mmap(0, size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+	return 0;
+    if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED){
+	munmap(base, size + 1);
+	return 0;
+    }
+    // We read straight through, so let the kernel read ahead.
+    madvise(base, size, MADV_SEQUENTIAL);
+    return base;
+}
+
+/**
+ * Reports the books of a chunk that add_batch() could not add.
+ * It only says how many, so the lines of the whole chunk are given.
+ *
+ * @return
+ * The number of books not added.
+ */
+static int skip_added(FILE *errors, size_t count, int added, int first_line, int last_line){
+    int failed = (int)count - added;
+    if (failed > 0 && errors)
+	fprintf(errors, "Skipped %d of the books on lines %d to %d: could not add them\n", failed,
+	    first_line, last_line);
+    return failed;
+}
+
+/**
+ * Imports every book in a CSV or tab-separated file.
+ * If the first record contains a tab, the file is read as tab-separated.
+ * Otherwise it is read as comma-separated.
+ *
+ * @param db
+ * The database to add the books to
+ *
+ * @param path
+ * The file to read.
+ *
+ * @param errors
+ * Where to report each record skipped, with its line number. May be 0.
+ *
+ * @param skipped
+ * Where to store the number of records skipped. May be 0.
+ *
+ * @return
+ * The number of books imported, or -1 if the file could not be read
+ * or a batch failed to commit.
+ *
+ * @note Malformed records and books that fail to add are skipped, and the rest imported.
+ */
+int import_file(sqlite3 *db, const char * const path, FILE *errors, int *skipped){
+    int skip_count = 0;
+    if (skipped)
+	*skipped = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0){
+	close(fd);
+	return -1;
+    }
+    if (st.st_size == 0){
+	close(fd);
+	return 0;
+    }
+    size_t size = (size_t)st.st_size;
+    char *base = map_file(fd, size);
+    // The mapping keeps its own reference to the file.
+    close(fd);
+    if (!base)
+	return -1;
+
+    // Storage for one chunk of rows, reused for every chunk.
+    char *book_space = malloc(IMPORT_BOOK_SIZE * IMPORT_CHUNK_ROWS);
+    name *authors = malloc(sizeof(name) * (IMPORT_MAX_AUTHORS + 1) * IMPORT_CHUNK_ROWS);
+    const book **books = malloc(sizeof(book *) * IMPORT_CHUNK_ROWS);
+    if (!book_space || !authors || !books){
+	free(book_space);
+	free(authors);
+	free(books);
+	munmap(base, size + 1);
+	return -1;
+    }
+
+    struct tokenizer tok = {base, base + size, ',', 1, 1};
+    // Sniff the delimiter from the first record that is not a comment.
+    char *first = base;
+    while (first < tok.end && (*first == '#' || *first == '\n' || *first == '\r')){
+	char *eol = memchr(first, '\n', tok.end - first);
+	first = eol ? eol + 1 : tok.end;
+    }
+    char *first_end = memchr(first, '\n', tok.end - first);
+    if (memchr(first, '\t', (first_end ? first_end : tok.end) - first))
+	tok.delim = '\t';
+
+    long page = sysconf(_SC_PAGESIZE);
+    char *released = base;
+    int total = 0;
+    size_t count = 0;
+    char *cols[COL_COUNT];
+    int ncols;
+    int first_record = 1;
+    // The lines the rows waiting for add_batch() start on.
+    int first_line = 0, last_line = 0;
+    while ((ncols = next_record(&tok, cols, COL_COUNT)) >= 0){
+	// Spreadsheet exports usually start with a row of column names.
+	if (first_record){
+	    first_record = 0;
+	    if (strcasecmp(cols[COL_TITLE], "Title") == 0)
+		continue;
+	}
+	book *info = (book *)(book_space + IMPORT_BOOK_SIZE * count);
+	if (ncols < COL_COUNT || parse_row(cols, info, authors + (IMPORT_MAX_AUTHORS + 1) * count) != 0){
+	    ++skip_count;
+	    if (errors && ncols < COL_COUNT)
+		fprintf(errors, "Skipped line %d: %d fields, not %d\n", tok.record_line, ncols, COL_COUNT);
+	    else if (errors)
+		fprintf(errors, "Skipped line %d: no title or owner\n", tok.record_line);
+	    // The last record may be the one skipped, so the rows still waiting go in after the loop.
+	    continue;
+	}
+	if (!count)
+	    first_line = tok.record_line;
+	last_line = tok.record_line;
+	books[count] = info;
+	if (++count < IMPORT_CHUNK_ROWS && tok.pos < tok.end)
+	    continue;
+	int added = add_batch(db, books, count);
+	if (added < 0){
+	    count = 0;
+	    total = -1;
+	    break;
+	}
+	skip_count += skip_added(errors, count, added, first_line, last_line);
+	count = 0;
+	total += added;
+	// Nothing refers to the rows before the read position anymore, so drop those pages.
+	char *done = base + ((tok.pos - base) / page) * page;
+	if (done > released){
+	    madvise(released, done - released, MADV_DONTNEED);
+	    released = done;
+	}
+    }
+    if (count && total >= 0){
+	int added = add_batch(db, books, count);
+	if (added >= 0)
+	    skip_count += skip_added(errors, count, added, first_line, last_line);
+	total = added < 0 ? -1 : total + added;
+    }
+    if (skipped)
+	*skipped = skip_count;
+    free(book_space);
+    free(authors);
+    free(books);
+    munmap(base, size + 1);
+    return total;
+}
@@ -0,0 +1,352 @@
+/*
+    BookDBLite, a book database management solution using SQLite.
+    Copyright (C) 2015-2016  SilverNexus
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file ingest.c
+ * Takes in barcode scans faster than they could be committed one at a time.
+ *
+ * Scans go into a fixed-size ring buffer without taking a lock, so a scanner
+ * or UI thread never waits on the database. A writer thread drains the buffer
+ * and adds whatever has piled up as one transaction, through the pool's writer
+ * connection. When the buffer is full, ingest_scan() says so straight away,
+ * so the caller can beep or retry rather than stall.
+ *
+ * The ring buffer is the bounded queue of Dmitry Vyukov: each slot carries a
+ * sequence number saying whose turn it is, so producers claim slots with a
+ * single compare-and-swap and any number of scanners can feed it.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sqlite3.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "db_access.h"
+
+struct ingest_slot {
+    // Equal to the position when free to fill, one past it when filled.
+    atomic_size_t sequence;
+    sqlite3_int64 isbn13;
+    // When the scan came in, in nanoseconds.
+    long long scanned;
+};
+
+struct ingest {
+    struct ingest_slot slots[INGEST_QUEUE_SIZE];
+    // The next position to fill. Shared by the scanning threads.
+    atomic_size_t tail;
+    // The next position to drain. Only used by the writer.
+    size_t head;
+    // Counts the scans waiting, plus one when stopping, so the writer can sleep.
+    sem_t waiting;
+    // Set before the post that wakes the writer to stop.
+    atomic_int stopping;
+    pthread_t writer;
+    db_pool *pool;
+    name owner;
+    // Counts kept by the scanning threads.
+    atomic_ulong queued;
+    atomic_ulong full;
+    // Counts kept by the writer, read under the lock.
+    pthread_mutex_t stats_lock;
+    ingest_stats stats;
+};
+
+/**
+ * The monotonic clock, in nanoseconds.
+ */
+static long long now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Takes the next scan off the ring buffer. Only the writer calls this.
+ *
+ * @return
+ * 1 if a scan was taken, 0 if the buffer is empty.
+ */
+static int dequeue(struct ingest *in, sqlite3_int64 *isbn13, long long *scanned){
+    struct ingest_slot *slot = &in->slots[in->head & (INGEST_QUEUE_SIZE - 1)];
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != in->head + 1)
+	return 0;
+    *isbn13 = slot->isbn13;
+    *scanned = slot->scanned;
+    // Hand the slot back for the next time round the buffer.
+    atomic_store_explicit(&slot->sequence, in->head + INGEST_QUEUE_SIZE, memory_order_release);
+    ++in->head;
+    return 1;
+}
+
+/**
+ * Takes the scan a post on waiting stands for.
+ * A scanner posts just after filling its slot, but another scanner that
+ * claimed an earlier slot may still be filling that one, so wait it out.
+ *
+ * @return
+ * 1 if a scan was taken, 0 if the post was the one to stop.
+ */
+static int take_scan(struct ingest *in, sqlite3_int64 *isbn13, long long *scanned){
+    while (!dequeue(in, isbn13, scanned)){
+	if (atomic_load(&in->stopping))
+	    return 0;
+	sched_yield();
+    }
+    return 1;
+}
+
+/**
+ * Finds the latency histogram bucket for a time.
+ * Bucket 0 is under a microsecond, and bucket i is under 2^i microseconds.
+ */
+static int latency_bucket(long long ns){
+    long long us = ns / 1000;
+    int bucket = 0;
+    while (us && bucket < INGEST_LATENCY_BUCKETS - 1){
+	us >>= 1;
+	++bucket;
+    }
+    return bucket;
+}
+
+/**
+ * Adds a group of scans in one transaction and records how it went.
+ */
+static void commit_group(struct ingest *in, const sqlite3_int64 *isbns, const long long *scanned, int count){
+    unsigned long added = 0, unknown = 0;
+    sqlite3 *db = pool_writer_acquire(in->pool);
+    int ok = sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0) == SQLITE_OK;
+    for (int i = 0; ok && i < count; ++i){
+	int result = add_copy(db, isbns[i], &in->owner);
+	if (result == 0)
+	    ++added;
+	else if (result == 1)
+	    ++unknown;
+	else
+	    ok = 0;
+    }
+    if (ok)
+	ok = sqlite3_exec(db, "COMMIT", 0, 0, 0) == SQLITE_OK;
+    if (!ok && !sqlite3_get_autocommit(db)){
+	sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+	id_cache_clear(db);
+    }
+    pool_writer_release(in->pool);
+
+    long long done = now_ns();
+    pthread_mutex_lock(&in->stats_lock);
+    if (ok){
+	in->stats.added += added;
+	in->stats.unknown += unknown;
+	++in->stats.commits;
+    }
+    else
+	in->stats.failed += count;
+    for (int i = 0; i < count; ++i)
+	++in->stats.latency[latency_bucket(done - scanned[i])];
+    pthread_mutex_unlock(&in->stats_lock);
+}
+
+/**
+ * The writer thread. Sleeps until scans come in, then commits
+ * everything waiting, up to INGEST_GROUP_MAX scans at a time.
+ */
+static void *write_scans(void *data){
+    struct ingest *in = data;
+    sqlite3_int64 isbns[INGEST_GROUP_MAX];
+    long long scanned[INGEST_GROUP_MAX];
+    int stop = 0;
+    while (!stop){
+	while (sem_wait(&in->waiting) != 0)
+	    ;
+	int count = 0;
+	if (take_scan(in, &isbns[count], &scanned[count]))
+	    ++count;
+	else
+	    stop = 1;
+	// Take everything else already waiting, so it shares the commit.
+	while (count < INGEST_GROUP_MAX && sem_trywait(&in->waiting) == 0){
+	    if (take_scan(in, &isbns[count], &scanned[count]))
+		++count;
+	    else
+		stop = 1;
+	}
+	if (count)
+	    commit_group(in, isbns, scanned, count);
+    }
+    return 0;
+}
+
+/**
+ * Frees the copy of the owner's name.
+ */
+static void free_owner(name *owner){
+    free((char *)owner->last);
+    free((char *)owner->first);
+    free((char *)owner->middle);
+    free((char *)owner->suffix);
+}
+
+/**
+ * Copies a name part, keeping a missing part missing.
+ *
+ * @return
+ * 0 on success, -1 if out of memory.
+ */
+static int copy_part(const char **to, const char * const from){
+    *to = 0;
+    return from && !(*to = strdup(from)) ? -1 : 0;
+}
+
+/**
+ * Starts taking in scans, with a writer thread adding them to a database.
+ *
+ * @param pool
+ * The pool whose writer connection the scans are added through.
+ * It must stay open until ingest_stop().
+ *
+ * @param owner
+ * Who the scanned books belong to. It is copied.
+ *
+ * @return
+ * The ingest, or 0 if it could not be started.
+ */
+ingest *ingest_start(db_pool *pool, const name * const owner){
+    if (!pool || !owner || !owner->last)
+	return 0;
+    struct ingest *in = calloc(1, sizeof(struct ingest));
+    if (!in)
+	return 0;
+    for (size_t i = 0; i < INGEST_QUEUE_SIZE; ++i)
+	atomic_init(&in->slots[i].sequence, i);
+    in->pool = pool;
+    if (copy_part(&in->owner.last, owner->last) != 0 || copy_part(&in->owner.first, owner->first) != 0 ||
+	    copy_part(&in->owner.middle, owner->middle) != 0 || copy_part(&in->owner.suffix, owner->suffix) != 0 ||
+	    sem_init(&in->waiting, 0, 0) != 0){
+	free_owner(&in->owner);
+	free(in);
+	return 0;
+    }
+    pthread_mutex_init(&in->stats_lock, 0);
+    if (pthread_create(&in->writer, 0, write_scans, in) != 0){
+	pthread_mutex_destroy(&in->stats_lock);
+	sem_destroy(&in->waiting);
+	free_owner(&in->owner);
+	free(in);
+	return 0;
+    }
+    return in;
+}
+
+/**
+ * Queues a scanned ISBN to be added. Never waits on the database.
+ * Safe to call from several threads at once.
+ *
+ * @param in
+ * The ingest from ingest_start().
+ *
+ * @param isbn
+ * The ISBN as scanned or typed.
+ *
+ * @retval 0
+ * The scan is queued.
+ *
+ * @retval 1
+ * The queue is full. Nothing was queued; try again shortly.
+ *
+ * @retval -1
+ * The ISBN is not valid.
+ */
+int ingest_scan(ingest *in, const char * const isbn){
+    sqlite3_int64 isbn13 = isbn_normalize(isbn);
+    if (!isbn13)
+	return -1;
+    size_t pos = atomic_load_explicit(&in->tail, memory_order_relaxed);
+    struct ingest_slot *slot;
+    for (;;){
+	slot = &in->slots[pos & (INGEST_QUEUE_SIZE - 1)];
+	size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+	if (sequence == pos){
+	    // The slot is free; claim it unless another scanner got there first.
+	    if (atomic_compare_exchange_weak_explicit(&in->tail, &pos, pos + 1,
+		    memory_order_relaxed, memory_order_relaxed))
+		break;
+	}
+	else if ((long)(sequence - pos) < 0){
+	    // The writer has not drained this slot since last time round.
+	    atomic_fetch_add_explicit(&in->full, 1, memory_order_relaxed);
+	    return 1;
+	}
+	else
+	    pos = atomic_load_explicit(&in->tail, memory_order_relaxed);
+    }
+    slot->isbn13 = isbn13;
+    slot->scanned = now_ns();
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    atomic_fetch_add_explicit(&in->queued, 1, memory_order_relaxed);
+    sem_post(&in->waiting);
+    return 0;
+}
+
+/**
+ * Reports how an ingest is going.
+ *
+ * @param in
+ * The ingest from ingest_start().
+ *
+ * @param stats
+ * Where to store the counts so far.
+ */
+void ingest_get_stats(ingest *in, ingest_stats *stats){
+    pthread_mutex_lock(&in->stats_lock);
+    *stats = in->stats;
+    pthread_mutex_unlock(&in->stats_lock);
+    stats->queued = atomic_load_explicit(&in->queued, memory_order_relaxed);
+    stats->full = atomic_load_explicit(&in->full, memory_order_relaxed);
+}
+
+/**
+ * Stops taking in scans, once every scan already queued has been added.
+ *
+ * @param in
+ * The ingest to stop. It is freed. May be 0.
+ *
+ * @param stats
+ * Where to store the final counts, or 0.
+ *
+ * @note No thread may still be calling ingest_scan().
+ */
+void ingest_stop(ingest *in, ingest_stats *stats){
+    if (!in)
+	return;
+    atomic_store(&in->stopping, 1);
+    sem_post(&in->waiting);
+    pthread_join(in->writer, 0);
+    if (stats)
+	ingest_get_stats(in, stats);
+    pthread_mutex_destroy(&in->stats_lock);
+    sem_destroy(&in->waiting);
+    free_owner(&in->owner);
+    free(in);
+}
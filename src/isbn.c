@@ -0,0 +1,177 @@
+/*
+    BookDBLite, a book database management solution using SQLite.
+    Copyright (C) 2015-2016  SilverNexus
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file isbn.c
+ * Normalizes ISBNs, so every way of writing one compares equal.
+ *
+ * Printing.ISBN keeps the ISBN as it was entered. Printing.ISBN13 holds the
+ * same ISBN as a checked ISBN-13 number, or NULL if it is not a valid ISBN,
+ * and is what adds and ISBN searches match on.
+ */
+
+#include <sqlite3.h>
+#include "db_access.h"
+
+// Check digit weights. Fixed-length loops over these compile to straight-line code.
+static const unsigned char isbn10_weights[10] = {10, 9, 8, 7, 6, 5, 4, 3, 2, 1};
+static const unsigned char isbn13_weights[13] = {1, 3, 1, 3, 1, 3, 1, 3, 1, 3, 1, 3, 1};
+
+/**
+ * Turns an ISBN-10 or ISBN-13, as typed, into an ISBN-13 number.
+ * Hyphens and spaces are ignored, and the check digit must be right.
+ *
+ * @param text
+ * The ISBN. May be 0.
+ *
+ * @return
+ * The ISBN-13 as a number, e.g. 9780345339683 for "0-345-33968-1",
+ * or 0 if text is not a valid ISBN.
+ */
+sqlite3_int64 isbn_normalize(const char * const text){
+    if (!text)
+	return 0;
+    unsigned char digits[13];
+    int count = 0;
+    for (const char *c = text; *c; ++c){
+	if (*c == '-' || *c == ' ')
+	    continue;
+	if (count == 13)
+	    return 0;
+	if (*c >= '0' && *c <= '9')
+	    digits[count++] = *c - '0';
+	// X stands for 10, and only as the check digit of an ISBN-10.
+	else if ((*c == 'X' || *c == 'x') && count == 9)
+	    digits[count++] = 10;
+	else
+	    return 0;
+    }
+    unsigned int sum = 0;
+    if (count == 10){
+	for (int i = 0; i < 10; ++i)
+	    sum += digits[i] * isbn10_weights[i];
+	if (sum % 11 != 0)
+	    return 0;
+	// The ISBN-13 is 978 and the first nine digits, with a check digit of its own.
+	for (int i = 8; i >= 0; --i)
+	    digits[i + 3] = digits[i];
+	digits[0] = 9;
+	digits[1] = 7;
+	digits[2] = 8;
+	sum = 0;
+	for (int i = 0; i < 12; ++i)
+	    sum += digits[i] * isbn13_weights[i];
+	digits[12] = (10 - sum % 10) % 10;
+    }
+    else if (count == 13){
+	if (digits[9] == 10)
+	    return 0;
+	for (int i = 0; i < 13; ++i)
+	    sum += digits[i] * isbn13_weights[i];
+	// Only the 978 and 979 prefixes are ISBNs; other EANs are not.
+	if (sum % 10 != 0 || digits[0] != 9 || digits[1] != 7 || (digits[2] != 8 && digits[2] != 9))
+	    return 0;
+    }
+    else
+	return 0;
+    sqlite3_int64 number = 0;
+    for (int i = 0; i < 13; ++i)
+	number = number * 10 + digits[i];
+    return number;
+}
+
+/**
+ * Adds the ISBN13 column to Printing, if it is not there yet, and its index.
+ * Printings already in the database are filled in by fill_isbn13().
+ * Used both by new_db() and when upgrading to schema version 5.
+ *
+ * @param db
+ * The database to change.
+ *
+ * @retval 0
+ * The column and index exist.
+ *
+ * @retval -1
+ * Failed to add the column or index.
+ */
+int create_isbn13(sqlite3 *db){
+    if (!db)
+	return -1;
+    sqlite3_stmt *stmt = get_stmt(db, "SELECT 1 FROM pragma_table_info('Printing') WHERE name = 'ISBN13'");
+    if (!stmt)
+	return -1;
+    int result = sqlite3_step(stmt);
+    release_stmt(stmt);
+    if (result == SQLITE_DONE && sqlite3_exec(db, "ALTER TABLE Printing ADD COLUMN ISBN13 INTEGER", 0, 0, 0) != SQLITE_OK)
+	return -1;
+    if (result != SQLITE_ROW && result != SQLITE_DONE)
+	return -1;
+    if (sqlite3_exec(db, "CREATE INDEX IF NOT EXISTS PrintingISBN13Index ON Printing(ISBN13, BookID, TypeID)",
+	    0, 0, 0) != SQLITE_OK)
+	return -1;
+    return 0;
+}
+
+/**
+ * Fills in ISBN13 for the next chunk of printings added before the column existed.
+ * Each call is small enough to run in a short transaction of its own.
+ *
+ * @param db
+ * The database to fill in.
+ *
+ * @param after
+ * Only printings with a higher PrintingID are filled in. 0 starts from the beginning.
+ *
+ * @param limit
+ * The most printings to look at.
+ *
+ * @param last
+ * Where to store the highest PrintingID looked at, to pass as after next time.
+ *
+ * @return
+ * The number of printings looked at, 0 once every printing is done, or -1 on failure.
+ */
+int fill_isbn13(sqlite3 *db, sqlite3_int64 after, int limit, sqlite3_int64 *last){
+    sqlite3_stmt *select = get_stmt(db, "SELECT PrintingID, ISBN FROM Printing"
+	" WHERE PrintingID > ? ORDER BY PrintingID LIMIT ?");
+    sqlite3_stmt *update = get_stmt(db, "UPDATE Printing SET ISBN13 = ? WHERE PrintingID = ?");
+    if (!select || !update ||
+	    sqlite3_bind_int64(select, 1, after) != SQLITE_OK || sqlite3_bind_int(select, 2, limit) != SQLITE_OK){
+	release_stmt(select);
+	return -1;
+    }
+    int count = 0;
+    int result;
+    while ((result = sqlite3_step(select)) == SQLITE_ROW){
+	++count;
+	*last = sqlite3_column_int64(select, 0);
+	sqlite3_int64 number = isbn_normalize((const char *)sqlite3_column_text(select, 1));
+	if (!number)
+	    continue;
+	sqlite3_reset(update);
+	if (sqlite3_bind_int64(update, 1, number) != SQLITE_OK || sqlite3_bind_int64(update, 2, *last) != SQLITE_OK ||
+		sqlite3_step(update) != SQLITE_DONE){
+	    result = SQLITE_ERROR;
+	    break;
+	}
+    }
+    release_stmt(update);
+    release_stmt(select);
+    return result == SQLITE_DONE ? count : -1;
+}
@@ -23,26 +23,592 @@
  * Also handles argument parsing and database open/close.
  */
 
+#define _POSIX_C_SOURCE 200809L
 #include <sqlite3.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "db_access.h"
 
 static inline void print_help(){
-    puts("Usage: book-db-lite [filename]");
+    puts("Usage: book-db-lite [--profile <profile>] [--check] [filename]\n"
+	"       book-db-lite [--profile <profile>] [--template <template>] --import <filename> <import file>\n"
+	"       book-db-lite [--profile <profile>] --check-plans <filename>\n"
+	"       book-db-lite [--profile <profile>] [--template <template>] --batch <filename> [<command file>]\n"
+	"       book-db-lite --scan <filename> <owner>\n"
+	"       book-db-lite [--compress] --export-snapshot <filename> <snapshot file>\n"
+	"       book-db-lite --import-snapshot <filename> <snapshot file>\n"
+	"       book-db-lite [--compress] --export-changes <filename> <change> <change file>\n"
+	"       book-db-lite --apply-changes <filename> <change file>\n"
+	"       book-db-lite --prune-changes <filename> <change>\n"
+	"Options --profile, --template, --compress, --check and --stats come first. --stats prints counts and timings on exit.\n"
+	"--check checks the database for damage once it is open, which reads the whole file.\n"
+	"Profiles: interactive, bulk-load, read-only\n"
+	"A new database is copied from the template, if one is given.\n"
+	"Batch commands are read from standard input if no file is given.\n"
+	"Scanned ISBNs are read from standard input. The owner is written Last|First.\n"
+	"A snapshot or change file of - is standard output or input.\n"
+	"Changes are exported after the change a copy is up to, which importing and applying print.");
     exit(0);
 }
 
+// When main() started, for the startup report.
+static long long launched = 0;
+
+/**
+ * Reports the settings the database connection is really using.
+ *
+ * @param profile
+ * The profile the database was opened with.
+ */
+static void report_settings(db_profile profile){
+    long long start = stats_start();
+    char settings[300];
+    if (describe_db_settings(db, profile, settings, sizeof(settings)) == 0)
+	fprintf(stderr, "%s\n", settings);
+    stats_phase("report_settings", start);
+}
+
+/**
+ * Prints upgrade progress on one line of the terminal.
+ * Stands in for the upgrade dialog until the GUI is in place.
+ */
+static int print_upgrade_progress(void *data, int version, const char *step, long done, long total){
+    (void)data;
+    if (total > 0)
+	fprintf(stderr, "\rUpgrading to schema version %d: %s... %ld/%ld (%ld%%)", version, step,
+	    done, total, done * 100 / total);
+    else
+	fprintf(stderr, "\rUpgrading to schema version %d: %s...", version, step);
+    if (total > 0 && done == total)
+	fputc('\n', stderr);
+    return 0;
+}
+
+/**
+ * Opens an existing database, upgrading it first if it is an older version.
+ * Unlike the damage check, the upgrade is not put off to the background:
+ * every mode reads and writes the current schema as soon as it starts.
+ * The GUI is to open through db_worker_open(), which upgrades on the worker thread.
+ *
+ * @return
+ * As open_db(). An older database that could not be upgraded gives 1.
+ */
+static int open_existing(const char * const path, db_profile profile){
+    int result = open_db(path, profile);
+    if (result != 2)
+	return result;
+    if (profile == PROFILE_READ_ONLY){
+	puts("The database needs upgrading, which cannot be done read only.");
+	return 1;
+    }
+    if (db_upgrade(db, print_upgrade_progress, 0) != 0){
+	puts("\ndb_upgrade() failed! Run again to resume the upgrade.");
+	return 1;
+    }
+    return 0;
+}
+
+/**
+ * Opens a database, creating it if it does not exist yet.
+ *
+ * @param template_path
+ * The database to copy when creating the database, or 0 to build it from scratch.
+ *
+ * @return
+ * 0 on success, nonzero on failure, with the failure already reported.
+ */
+static int open_or_create(const char * const path, db_profile profile, const char * const template_path){
+    if (access(path, F_OK) == 0){
+	if (open_existing(path, profile) != 0){
+	    puts("open_db() failed!");
+	    return -1;
+	}
+    }
+    else if (template_path){
+	if (create_db_from_template(path, template_path, profile) != 0){
+	    puts("create_db_from_template() failed!");
+	    return -1;
+	}
+    }
+    else if (create_db(path, profile) != 0){
+	puts("create_db() failed!");
+	return -1;
+    }
+    report_settings(profile);
+    stats_phase("ready", launched);
+    return 0;
+}
+
+/**
+ * Bulk loads a tab-separated file into a database, creating the database if needed.
+ *
+ * @param path
+ * The database file.
+ *
+ * @param import_path
+ * The file to import.
+ *
+ * @param profile
+ * The profile to open the database with.
+ *
+ * @param template_path
+ * The database to copy when creating the database, or 0 to build it from scratch.
+ *
+ * @return
+ * The exit status for the program: 0 if every record was imported,
+ * 1 if some were skipped, and -1 if the import failed.
+ */
+static int run_import(const char * const path, const char * const import_path, db_profile profile,
+	const char * const template_path){
+    if (open_or_create(path, profile, template_path) != 0)
+	return -1;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int skipped;
+    int added = import_file(db, import_path, stderr, &skipped);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (added < 0){
+	printf("Import of %s failed!\n", import_path);
+	return -1;
+    }
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Imported %d books in %.2f seconds (%.0f rows/sec)\n", added, seconds,
+	seconds > 0 ? added / seconds : 0.0);
+    if (skipped){
+	printf("Skipped %d records\n", skipped);
+	return 1;
+    }
+    return 0;
+}
+
+/**
+ * Runs a file of commands against a database, creating the database if needed.
+ * Replies go to standard output as JSON Lines, so messages go to standard error.
+ *
+ * @param path
+ * The database file.
+ *
+ * @param command_path
+ * The file of commands, or 0 or "-" to read standard input.
+ *
+ * @return
+ * The exit status for the program: 0 if every command succeeded,
+ * 1 if some failed, and -1 if the batch could not be run.
+ */
+static int run_batch_file(const char * const path, const char * const command_path, db_profile profile,
+	const char * const template_path){
+    FILE *in = stdin;
+    if (command_path && strcmp(command_path, "-") != 0 && !(in = fopen(command_path, "r"))){
+	fprintf(stderr, "Cannot open %s!\n", command_path);
+	return -1;
+    }
+    if (open_or_create(path, profile, template_path) != 0){
+	if (in != stdin)
+	    fclose(in);
+	return -1;
+    }
+    // Replies are small and many, so write them in large blocks.
+    static char out_buffer[1 << 16];
+    setvbuf(stdout, out_buffer, _IOFBF, sizeof(out_buffer));
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int failed = run_batch(db, in, stdout);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fflush(stdout);
+    if (in != stdin)
+	fclose(in);
+    if (failed < 0){
+	fputs("Committing the batch failed!\n", stderr);
+	return -1;
+    }
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Ran batch in %.2f seconds, %d commands failed\n", seconds, failed);
+    return failed ? 1 : 0;
+}
+
+/**
+ * Takes in ISBNs from standard input, one per line, as a barcode scanner types them,
+ * and adds a copy of each for an owner.
+ *
+ * @param path
+ * The database file. It must already exist.
+ *
+ * @param owner_text
+ * The owner, written Last|First|Middle|Suffix. It is split up in place.
+ *
+ * @return
+ * The exit status for the program.
+ */
+static int run_scan(const char * const path, char *owner_text){
+    // Upgrade the database first if need be, which the pool's connections cannot do.
+    if (open_existing(path, PROFILE_INTERACTIVE) != 0){
+	puts("open_db() failed!");
+	return -1;
+    }
+    close_db();
+    char *parts[4] = {0, 0, 0, 0};
+    for (int i = 0; i < 4 && owner_text; ++i){
+	parts[i] = owner_text;
+	if ((owner_text = strchr(owner_text, '|')))
+	    *owner_text++ = '\0';
+    }
+    const name owner = {parts[0], parts[2] && *parts[2] ? parts[2] : 0, parts[1] ? parts[1] : "",
+	parts[3] && *parts[3] ? parts[3] : 0};
+    db_pool *pool = pool_open(path);
+    ingest *in = pool ? ingest_start(pool, &owner) : 0;
+    if (!in){
+	pool_close(pool);
+	puts("ingest_start() failed!");
+	return -1;
+    }
+    char line[64];
+    unsigned long invalid = 0;
+    while (fgets(line, sizeof(line), stdin)){
+	line[strcspn(line, "\r\n")] = '\0';
+	if (!line[0])
+	    continue;
+	int res;
+	// A full queue means the writer is behind, so give it a moment.
+	while ((res = ingest_scan(in, line)) == 1){
+	    struct timespec pause = {0, 1000000};
+	    nanosleep(&pause, 0);
+	}
+	if (res < 0){
+	    fprintf(stderr, "Not a valid ISBN: %s\n", line);
+	    ++invalid;
+	}
+    }
+    ingest_stats stats;
+    ingest_stop(in, &stats);
+    pool_close(pool);
+    fprintf(stderr, "Added %lu, not in the database %lu, failed %lu, invalid %lu, in %lu commits."
+	" The queue was full %lu times.\n", stats.added, stats.unknown, stats.failed, invalid,
+	stats.commits, stats.full);
+    // Scan to commit latency, by power of two buckets.
+    fputs("Latency:", stderr);
+    for (int i = 0; i < INGEST_LATENCY_BUCKETS; ++i){
+	if (stats.latency[i])
+	    fprintf(stderr, " <%luus: %lu", 1UL << i, stats.latency[i]);
+    }
+    fputc('\n', stderr);
+    return stats.failed ? 1 : 0;
+}
+
+/**
+ * Opens a snapshot or change file to read or write, where "-" is standard input or output.
+ *
+ * @return
+ * The file, or 0 if it could not be opened, which has been reported.
+ */
+static FILE *open_transfer_file(const char * const transfer_path, int write){
+    if (strcmp(transfer_path, "-") == 0)
+	return write ? stdout : stdin;
+    FILE *file = fopen(transfer_path, write ? "wb" : "rb");
+    if (!file)
+	fprintf(stderr, "Cannot %s %s!\n", write ? "create" : "open", transfer_path);
+    return file;
+}
+
+/**
+ * Writes a snapshot of a database's whole catalog, or the changes since a copy was last brought up to date.
+ *
+ * @param path
+ * The database file. It must already exist.
+ *
+ * @param since
+ * The Seq to write the changes after, or -1 for the whole catalog.
+ *
+ * @param snapshot_path
+ * The file to write, or "-" for standard output.
+ *
+ * @param compress
+ * Nonzero to compress the file.
+ *
+ * @return
+ * The exit status for the program.
+ */
+static int run_export(const char * const path, sqlite3_int64 since, const char * const snapshot_path,
+	db_profile profile, int compress){
+    if (open_existing(path, profile) != 0){
+	fputs("open_db() failed!\n", stderr);
+	return -1;
+    }
+    FILE *out = open_transfer_file(snapshot_path, 1);
+    if (!out)
+	return -1;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sqlite3_int64 seq = 0;
+    sqlite3_int64 rows = since < 0 ? export_snapshot(db, out, compress, &seq) :
+	export_changes(db, since, out, compress, &seq);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long bytes = out != stdout ? ftell(out) : -1;
+    if ((out != stdout && fclose(out) != 0) || rows < 0){
+	if (rows == -2)
+	    fprintf(stderr, "The change log does not have the changes after %lld; send a whole snapshot.\n",
+		(long long)since);
+	else
+	    fprintf(stderr, "Export to %s failed!%s\n", snapshot_path,
+		compress ? " (Compression needs zlib.)" : "");
+	if (out != stdout)
+	    remove(snapshot_path);
+	return -1;
+    }
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Exported %lld rows", (long long)rows);
+    if (bytes >= 0)
+	fprintf(stderr, " in %ld bytes", bytes);
+    fprintf(stderr, " in %.2f seconds, up to change %lld\n", seconds, (long long)seq);
+    return 0;
+}
+
+/**
+ * Creates a database and loads a snapshot into it.
+ *
+ * @param path
+ * The database file. It must not exist yet, and is removed again if the load fails.
+ *
+ * @param snapshot_path
+ * The snapshot to load, or "-" for standard input.
+ *
+ * @return
+ * The exit status for the program.
+ */
+static int run_import_snapshot(const char * const path, const char * const snapshot_path, db_profile profile){
+    if (access(path, F_OK) == 0){
+	fprintf(stderr, "%s already exists; snapshots are only loaded into new databases.\n", path);
+	return -1;
+    }
+    FILE *in = open_transfer_file(snapshot_path, 0);
+    if (!in)
+	return -1;
+    if (create_db(path, profile) != 0){
+	fputs("create_db() failed!\n", stderr);
+	if (in != stdin)
+	    fclose(in);
+	return -1;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sqlite3_int64 seq = 0;
+    sqlite3_int64 rows = import_snapshot(db, in, &seq);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (in != stdin)
+	fclose(in);
+    if (rows < 0){
+	fprintf(stderr, "Import of %s failed!\n", snapshot_path);
+	// Don't leave an empty database behind to be mistaken for a copy.
+	close_db();
+	remove(path);
+	return -1;
+    }
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Imported %lld rows in %.2f seconds, up to change %lld\n", (long long)rows, seconds,
+	(long long)seq);
+    return 0;
+}
+
+/**
+ * Brings a copy of a database up to date with changes from --export-changes.
+ *
+ * @param path
+ * The copy. It must already exist.
+ *
+ * @param changes_path
+ * The changes to apply, or "-" for standard input.
+ *
+ * @return
+ * The exit status for the program.
+ */
+static int run_apply_changes(const char * const path, const char * const changes_path, db_profile profile){
+    if (open_existing(path, profile) != 0){
+	fputs("open_db() failed!\n", stderr);
+	return -1;
+    }
+    FILE *in = open_transfer_file(changes_path, 0);
+    if (!in)
+	return -1;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sqlite3_int64 seq = -1;
+    sqlite3_int64 rows = apply_changes(db, in, &seq);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (in != stdin)
+	fclose(in);
+    if (rows == -2){
+	fprintf(stderr, "%s starts after change %lld, which this copy is up to; export the changes after it.\n",
+	    changes_path, (long long)seq);
+	return -1;
+    }
+    if (rows < 0){
+	fprintf(stderr, "Applying %s failed!\n", changes_path);
+	return -1;
+    }
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "Applied %lld rows in %.2f seconds, up to change %lld\n", (long long)rows, seconds,
+	(long long)seq);
+    return 0;
+}
+
+// Set by --stats.
+static int show_stats = 0;
+
+// Set by --check.
+static int check_database = 0;
+
+// The check for damage of the GUI's database, while it runs.
+static db_check *check = 0;
+
+/**
+ * Stops the check for damage, if one is still running, and dumps the operation
+ * and statement counts to standard error, if asked for, while the database is still open.
+ *
+ * @param status
+ * The exit status, which is passed through.
+ */
+static int finish(int status){
+    // A check that has not finished by now is cut short. Damage it already found is still reported.
+    char message[DB_CHECK_MESSAGE_LEN];
+    if (db_check_stop(check, 0, message) == 1)
+	fprintf(stderr, "The database is damaged: %s\n", message);
+    check = 0;
+    if (show_stats)
+	db_stats(db, stderr);
+    return status;
+}
+
 int main(int argc, const char * const *argv){
-    if (argc >= 2){
+    launched = stats_start();
+    // Each mode has a sensible profile, which --profile overrides.
+    int profile = -1;
+    const char *template_path = 0;
+    int compress = 0;
+    while (argc >= 2 && (strcmp(argv[1], "--profile") == 0 || strcmp(argv[1], "--template") == 0 ||
+	    strcmp(argv[1], "--stats") == 0 || strcmp(argv[1], "--compress") == 0 || strcmp(argv[1], "--check") == 0)){
+	if (strcmp(argv[1], "--stats") == 0 || strcmp(argv[1], "--compress") == 0 || strcmp(argv[1], "--check") == 0){
+	    if (strcmp(argv[1], "--stats") == 0){
+		show_stats = 1;
+		// Counting the rows and time of every statement costs a little per row, so only when asked.
+		stmt_cache_trace(1);
+	    }
+	    else if (strcmp(argv[1], "--check") == 0)
+		check_database = 1;
+	    else
+		compress = 1;
+	    --argc;
+	    ++argv;
+	    continue;
+	}
+	if (argc < 3)
+	    print_help();
+	if (strcmp(argv[1], "--template") == 0)
+	    template_path = argv[2];
+	else if ((profile = find_profile(argv[2])) < 0)
+	    print_help();
+	argc -= 2;
+	argv += 2;
+    }
+    if (argc >= 2 && strcmp(argv[1], "--import") == 0){
+	if (argc != 4)
+	    print_help();
+	return finish(run_import(argv[2], argv[3], profile < 0 ? PROFILE_BULK_LOAD : profile, template_path));
+    }
+    if (argc >= 2 && strcmp(argv[1], "--batch") == 0){
+	if (argc != 3 && argc != 4)
+	    print_help();
+	return finish(run_batch_file(argv[2], argc == 4 ? argv[3] : 0, profile < 0 ? PROFILE_INTERACTIVE : profile,
+	    template_path));
+    }
+    if (argc >= 2 && strcmp(argv[1], "--scan") == 0){
+	if (argc != 4)
+	    print_help();
+	char owner[256];
+	snprintf(owner, sizeof(owner), "%s", argv[3]);
+	return finish(run_scan(argv[2], owner));
+    }
+    if (argc >= 2 && strcmp(argv[1], "--export-snapshot") == 0){
+	if (argc != 4)
+	    print_help();
+	return finish(run_export(argv[2], -1, argv[3], profile < 0 ? PROFILE_READ_ONLY : profile, compress));
+    }
+    if (argc >= 2 && strcmp(argv[1], "--export-changes") == 0){
+	char *end;
+	long long since = argc == 5 ? strtoll(argv[3], &end, 10) : -1;
+	if (since < 0 || *end)
+	    print_help();
+	return finish(run_export(argv[2], since, argv[4], profile < 0 ? PROFILE_READ_ONLY : profile, compress));
+    }
+    if (argc >= 2 && strcmp(argv[1], "--apply-changes") == 0){
+	if (argc != 4)
+	    print_help();
+	return finish(run_apply_changes(argv[2], argv[3], profile < 0 ? PROFILE_INTERACTIVE : profile));
+    }
+    if (argc >= 2 && strcmp(argv[1], "--prune-changes") == 0){
+	char *end;
+	long long seq = argc == 4 ? strtoll(argv[3], &end, 10) : -1;
+	if (seq < 0 || *end)
+	    print_help();
+	if (open_existing(argv[2], profile < 0 ? PROFILE_INTERACTIVE : profile) != 0){
+	    puts("open_db() failed!");
+	    return -1;
+	}
+	sqlite3_int64 removed = prune_changes(db, seq);
+	if (removed < 0){
+	    puts("prune_changes() failed!");
+	    return finish(-1);
+	}
+	fprintf(stderr, "Removed %lld changes\n", (long long)removed);
+	return finish(0);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--import-snapshot") == 0){
+	if (argc != 4)
+	    print_help();
+	return finish(run_import_snapshot(argv[2], argv[3], profile < 0 ? PROFILE_BULK_LOAD : profile));
+    }
+    if (argc >= 2 && strcmp(argv[1], "--check-plans") == 0){
+	if (argc != 3)
+	    print_help();
+	if (profile < 0)
+	    profile = PROFILE_READ_ONLY;
+	if (open_existing(argv[2], profile) != 0){
+	    puts("open_db() failed!");
+	    return -1;
+	}
+	report_settings(profile);
+	stats_phase("ready", launched);
+	// Nonzero exit when a search would scan a table, so scripts can catch regressions.
+	return finish(check_query_plans(db) == 0 ? 0 : 1);
+    }
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-')){
 	print_help();
     }
-    if (argc == 1){
+    if (argc == 2){
 	// argv[1] is the path
-	if (open_db(argv[1]) < 0){
+	if (profile < 0)
+	    profile = PROFILE_INTERACTIVE;
+	if (open_existing(argv[1], profile) < 0){
 	    puts("open_db() failed!");
 	    exit(-1);
 	}
+	report_settings(profile);
+	stats_phase("ready", launched);
+	// Checking for damage reads the whole file, so it is only done when asked for,
+	// until there is a GUI loop to run it alongside.
+	if (check_database){
+	    check = db_check_start(argv[1]);
+	    char message[DB_CHECK_MESSAGE_LEN] = "could not start the check";
+	    int damaged = db_check_stop(check, 1, message);
+	    check = 0;
+	    if (damaged == 1)
+		fprintf(stderr, "The database is damaged: %s\n", message);
+	    else if (damaged < 0)
+		fprintf(stderr, "The database could not be checked: %s\n", message);
+	    else
+		fprintf(stderr, "The database is sound\n");
+	}
     }
     else{
 	// Give the user the choice of creating a new db or loading an existing one.
@@ -51,5 +617,5 @@ int main(int argc, const char * const *argv){
 	// TODO: Implement
     }
     // TODO: Finish initializing and begin implementing
-    return 0;
+    return finish(0);
 }
@@ -0,0 +1,318 @@
+/*
+    BookDBLite, a book database management solution using SQLite.
+    Copyright (C) 2015-2016  SilverNexus
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file prefix_index.c
+ * Searches titles and author last names as they are typed.
+ *
+ * Every title and author last name is kept in memory, case folded, in one
+ * sorted array, so the entries starting with some text are a range found by
+ * binary search. A prefix_query remembers its range, and as more is typed
+ * the new range is looked for only inside the old one. SQLite is only asked
+ * for the page of books that will be shown, by id.
+ *
+ * The index is a snapshot; prefix_index_is_current() says when to rebuild it.
+ */
+
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+#include "db_access.h"
+
+struct prefix_entry {
+    // The title or last name, case folded.
+    const char *key;
+    int book_id;
+};
+
+struct prefix_index {
+    struct prefix_entry *entries;
+    size_t count;
+    // Holds the keys.
+    arena keys;
+    // To tell whether the database has changed since.
+    sqlite3_int64 data_version;
+    int total_changes;
+};
+
+/**
+ * Folds ASCII letters to lower case, as SQLite's lower() does.
+ */
+static char fold(char c){
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+/**
+ * Copies text into the index, case folded.
+ *
+ * @return
+ * The copy, or 0 if out of memory.
+ */
+static const char *fold_key(arena *keys, const char *text){
+    size_t len = strlen(text);
+    char *key = arena_alloc(keys, len + 1);
+    if (!key)
+	return 0;
+    for (size_t i = 0; i <= len; ++i)
+	key[i] = fold(text[i]);
+    return key;
+}
+
+static int compare_entries(const void *a, const void *b){
+    const struct prefix_entry *x = a, *y = b;
+    int order = strcmp(x->key, y->key);
+    return order ? order : (x->book_id > y->book_id) - (x->book_id < y->book_id);
+}
+
+/**
+ * Reads PRAGMA data_version, which changes when another connection commits.
+ *
+ * @return
+ * The version, or -1 on failure.
+ */
+static sqlite3_int64 read_data_version(sqlite3 *db){
+    sqlite3_stmt *stmt = get_stmt(db, "PRAGMA data_version");
+    if (!stmt)
+	return -1;
+    sqlite3_int64 version = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : -1;
+    release_stmt(stmt);
+    return version;
+}
+
+/**
+ * Adds the rows of a query giving text and a BookID to the index.
+ *
+ * @return
+ * 0 on success, -1 on failure.
+ */
+static int add_entries(sqlite3 *db, prefix_index *index, size_t *size, const char * const sql){
+    sqlite3_stmt *stmt = get_stmt(db, sql);
+    if (!stmt)
+	return -1;
+    int result;
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW){
+	const char *text = (const char *)sqlite3_column_text(stmt, 0);
+	if (!text)
+	    continue;
+	if (index->count == *size){
+	    size_t new_size = *size ? *size * 2 : 65536;
+	    struct prefix_entry *grown = realloc(index->entries, sizeof(struct prefix_entry) * new_size);
+	    if (!grown)
+		break;
+	    index->entries = grown;
+	    *size = new_size;
+	}
+	struct prefix_entry *entry = &index->entries[index->count];
+	if (!(entry->key = fold_key(&index->keys, text)))
+	    break;
+	entry->book_id = sqlite3_column_int(stmt, 1);
+	++index->count;
+    }
+    release_stmt(stmt);
+    return result == SQLITE_DONE ? 0 : -1;
+}
+
+/**
+ * Reads every title and author last name into a new index.
+ * This reads the whole Book and BookAuthor tables, so on a large
+ * database build it once, e.g. on a db_worker, and keep it.
+ *
+ * @param db
+ * The database to index.
+ *
+ * @return
+ * The index, or 0 on failure. Free it with prefix_index_free().
+ */
+prefix_index *prefix_index_build(sqlite3 *db){
+    prefix_index *index = calloc(1, sizeof(prefix_index));
+    if (!index)
+	return 0;
+    arena_init(&index->keys, 0, 0, 0);
+    size_t size = 0;
+    index->data_version = read_data_version(db);
+    index->total_changes = sqlite3_total_changes(db);
+    if (index->data_version < 0 ||
+	    add_entries(db, index, &size, "SELECT Title, BookID FROM Book") != 0 ||
+	    add_entries(db, index, &size, "SELECT AuthorLast, BookID FROM BookAuthor"
+		" JOIN Author ON Author.AuthorID = BookAuthor.AuthorID") != 0){
+	prefix_index_free(index);
+	return 0;
+    }
+    qsort(index->entries, index->count, sizeof(struct prefix_entry), compare_entries);
+    return index;
+}
+
+/**
+ * Checks whether an index still matches its database.
+ *
+ * @param index
+ * The index from prefix_index_build().
+ *
+ * @param db
+ * The connection the index was built from.
+ *
+ * @return
+ * 1 if nothing has been committed since the index was built, 0 if it should be rebuilt.
+ */
+int prefix_index_is_current(const prefix_index *index, sqlite3 *db){
+    return read_data_version(db) == index->data_version && sqlite3_total_changes(db) == index->total_changes;
+}
+
+/**
+ * Frees an index.
+ *
+ * @param index
+ * The index to free. May be 0.
+ */
+void prefix_index_free(prefix_index *index){
+    if (!index)
+	return;
+    free(index->entries);
+    arena_free(&index->keys);
+    free(index);
+}
+
+/**
+ * Sets up a query matching everything in an index, before anything is typed.
+ *
+ * @param query
+ * The query to set up.
+ *
+ * @param index
+ * The index to search. It must outlive the query.
+ */
+void prefix_query_init(prefix_query *query, const prefix_index *index){
+    query->index = index;
+    query->text[0] = '\0';
+    query->len = 0;
+    query->low = 0;
+    query->high = index->count;
+}
+
+/**
+ * Finds the first entry in a range whose key is not before text.
+ */
+static size_t lower_bound(const struct prefix_entry *entries, size_t low, size_t high, const char *text){
+    while (low < high){
+	size_t mid = low + (high - low) / 2;
+	if (strcmp(entries[mid].key, text) < 0)
+	    low = mid + 1;
+	else
+	    high = mid;
+    }
+    return low;
+}
+
+/**
+ * Finds the first entry in a range, from lower_bound(), whose key does not start with text.
+ */
+static size_t upper_bound(const struct prefix_entry *entries, size_t low, size_t high, const char *text, size_t len){
+    while (low < high){
+	size_t mid = low + (high - low) / 2;
+	if (strncmp(entries[mid].key, text, len) <= 0)
+	    low = mid + 1;
+	else
+	    high = mid;
+    }
+    return low;
+}
+
+/**
+ * Changes what a query matches to the text now typed. When the text only
+ * grows, as while typing, the old range is narrowed rather than searched again.
+ *
+ * @param query
+ * The query from prefix_query_init().
+ *
+ * @param text
+ * The text typed so far. Case does not matter, and past PREFIX_MAX_LEN characters it is ignored.
+ *
+ * @return
+ * The number of titles and author last names starting with the text.
+ */
+size_t prefix_query_set(prefix_query *query, const char * const text){
+    const prefix_index *index = query->index;
+    size_t len = 0;
+    char folded[PREFIX_MAX_LEN + 1];
+    while (len < PREFIX_MAX_LEN && text[len]){
+	folded[len] = fold(text[len]);
+	++len;
+    }
+    folded[len] = '\0';
+    // Only a longer text starting with the old one can stay inside the old range.
+    if (len < query->len || memcmp(folded, query->text, query->len) != 0){
+	query->low = 0;
+	query->high = index->count;
+    }
+    query->low = lower_bound(index->entries, query->low, query->high, folded);
+    query->high = upper_bound(index->entries, query->low, query->high, folded, len);
+    memcpy(query->text, folded, len + 1);
+    query->len = len;
+    return query->high - query->low;
+}
+
+/**
+ * Gets the books a query matches, in index order, each once.
+ *
+ * @param query
+ * The query from prefix_query_set().
+ *
+ * @param book_ids
+ * Where to store the BookIDs.
+ *
+ * @param max
+ * The most books to get.
+ *
+ * @return
+ * The number of BookIDs stored.
+ */
+int prefix_query_books(const prefix_query *query, int *book_ids, int max){
+    int count = 0;
+    for (size_t i = query->low; i < query->high && count < max; ++i){
+	int book_id = query->index->entries[i].book_id;
+	int seen = 0;
+	// A book is listed under its title and each author, usually close together.
+	for (int j = count - 1; j >= 0 && !seen; --j)
+	    seen = book_ids[j] == book_id;
+	if (!seen)
+	    book_ids[count++] = book_id;
+    }
+    return count;
+}
+
+/**
+ * Starts reading the first page of books a query matches from the database.
+ *
+ * @param query
+ * The query from prefix_query_set().
+ *
+ * @param db
+ * The database the index was built from.
+ *
+ * @param limit
+ * The most books to read, up to SEARCH_BOOKS_MAX. Each gives a result per printing and owner.
+ *
+ * @return
+ * The cursor, as from search_open_books(), or 0 on failure.
+ */
+search_cursor *prefix_query_open(const prefix_query *query, sqlite3 *db, int limit){
+    int book_ids[SEARCH_BOOKS_MAX];
+    int count = prefix_query_books(query, book_ids, limit < SEARCH_BOOKS_MAX ? limit : SEARCH_BOOKS_MAX);
+    return search_open_books(db, book_ids, count);
+}
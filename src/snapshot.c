@@ -0,0 +1,1276 @@
+/*
+    BookDBLite, a book database management solution using SQLite.
+    Copyright (C) 2015-2016  SilverNexus
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file snapshot.c
+ * Copies the catalog between databases: whole, as a snapshot, or as the rows
+ * changed since an earlier copy, as read from the change log.
+ *
+ * Triggers on every catalog table add the key of each row added, changed or
+ * removed to the Change table, numbered by Seq. Only keys are logged; the rows
+ * are read when the changes are exported, so a row changed many times is sent
+ * once, as it is now. Applying changes adds or updates rows by key and removes
+ * the ones that are gone, so applying the same changes twice does no harm.
+ *
+ * A snapshot starts with the magic "BDLS", then the format version, the schema
+ * version, flags, the Seq the changes start after (0 for a whole snapshot) and
+ * the Seq they run to, each a varint. The rest, deflated if the compressed flag
+ * is set, is a run of row groups ended by a 0 and the total number of rows.
+ * A group is a tag, its row count, its length in bytes, and then each column in turn.
+ * Tags up to SNAPSHOT_TABLES are rows to add or update in the table at that
+ * place in snapshot_tables, counting from one; those after are keys to remove.
+ *
+ * - Integer columns are a varint per row: 0 for NULL, or else one more than the
+ *   value zigzag encoded. Key columns, which mostly climb by one, hold the
+ *   difference from the last value in the group rather than the value.
+ * - Text columns are a dictionary of the distinct strings in the group, as a
+ *   count and then each string's length and bytes, followed by a varint per row:
+ *   0 for NULL, or else the string's place in the dictionary plus one.
+ *
+ * Groups are at most SNAPSHOT_GROUP_ROWS rows, so neither side ever holds more
+ * than one group of a table in memory. ISBN13 is worked out again when loading
+ * rather than stored.
+ */
+
+#include <limits.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include "db_access.h"
+
+#define SNAPSHOT_MAGIC "BDLS"
+#define SNAPSHOT_FORMAT 2
+// Set in the header flags when everything after the header is deflated.
+#define SNAPSHOT_COMPRESSED 1
+// Set in the header flags when only the changes since a Seq are held.
+#define SNAPSHOT_CHANGES 2
+#define SNAPSHOT_GROUP_ROWS 65536
+// Slots in a text column's dictionary hash; a power of two above SNAPSHOT_GROUP_ROWS.
+#define SNAPSHOT_DICT_SLOTS (SNAPSHOT_GROUP_ROWS * 2)
+#define SNAPSHOT_MAX_COLUMNS 6
+// The most indexes and triggers dropped while loading.
+#define SNAPSHOT_MAX_DROPPED 64
+// The size of the blocks read and written when compressing.
+#define SNAPSHOT_CHUNK 65536
+
+/*
+ * The tables copied, in the order rows are added; they are removed in the
+ * reverse order. Each table's place in the list is logged in Change.TableID,
+ * so new tables go at the end.
+ */
+static const struct snapshot_table {
+    const char *name;
+    // The key columns come first.
+    const char *columns[SNAPSHOT_MAX_COLUMNS];
+    // One letter per column: 'k' for keys near the row before, 'i' for other integers, 't' for text.
+    const char *kinds;
+    // How many of the columns make up the primary key: 1 or 2.
+    int keys;
+    // The text column holding an ISBN, whose ISBN13 is stored with the row, or -1.
+    int isbn_column;
+} snapshot_tables[] = {
+    {"Type", {"TypeID", "TypeName"}, "kt", 1, -1},
+    {"Genre", {"GenreID", "GenreName"}, "kt", 1, -1},
+    {"Author", {"AuthorID", "AuthorLast", "AuthorFirst", "AuthorMiddle", "AuthorSuffix"}, "ktttt", 1, -1},
+    {"Owner", {"OwnerID", "OwnerLast", "OwnerFirst", "OwnerMiddle", "OwnerSuffix"}, "ktttt", 1, -1},
+    {"Book", {"BookID", "Title", "Subtitle"}, "ktt", 1, -1},
+    {"BookAuthor", {"BookID", "AuthorID", "AuthorOrder"}, "kii", 2, -1},
+    {"BookGenre", {"BookID", "GenreID"}, "ki", 2, -1},
+    {"Printing", {"PrintingID", "BookID", "ISBN", "Year", "TypeID", "PrintingNum"}, "kktiii", 1, 2},
+    {"BookOwner", {"PrintingID", "OwnerID", "Quantity"}, "kii", 2, -1}
+};
+#define SNAPSHOT_TABLES (sizeof(snapshot_tables) / sizeof(snapshot_tables[0]))
+
+// The statements made for each table by table_sql().
+typedef enum {
+    // Every row, by key.
+    SQL_ALL,
+    // The rows whose keys were logged after Seq ?2, by key. ?1 is the table's place.
+    SQL_CHANGED,
+    // The keys logged after Seq ?2 that are no longer in the table.
+    SQL_REMOVED,
+    // Adds a row, or updates the row with its key.
+    SQL_UPSERT,
+    // Removes the row with a key.
+    SQL_DELETE,
+    // The triggers logging added, changed and removed keys.
+    SQL_TRIGGERS
+} table_sql_kind;
+
+// A growing run of bytes. failed is set, and the bytes kept, if it cannot grow.
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+    int failed;
+} byte_buf;
+
+static void put_bytes(byte_buf *buf, const void *bytes, size_t len){
+    if (buf->len + len > buf->size){
+	size_t size = buf->size ? buf->size : 4096;
+	while (size < buf->len + len)
+	    size *= 2;
+	unsigned char *grown = realloc(buf->data, size);
+	if (!grown){
+	    buf->failed = 1;
+	    return;
+	}
+	buf->data = grown;
+	buf->size = size;
+    }
+    memcpy(buf->data + buf->len, bytes, len);
+    buf->len += len;
+}
+
+static void put_varint(byte_buf *buf, unsigned long long value){
+    unsigned char bytes[10];
+    size_t len = 0;
+    while (value >= 0x80){
+	bytes[len++] = (unsigned char)(value | 0x80);
+	value >>= 7;
+    }
+    bytes[len++] = (unsigned char)value;
+    put_bytes(buf, bytes, len);
+}
+
+/**
+ * Reads a varint from memory.
+ *
+ * @return
+ * 0 on success, -1 if it runs past end.
+ */
+static int get_varint(const unsigned char **pos, const unsigned char *end, unsigned long long *value){
+    *value = 0;
+    for (int shift = 0; *pos < end && shift < 64; shift += 7){
+	unsigned char byte = *(*pos)++;
+	*value |= (unsigned long long)(byte & 0x7f) << shift;
+	if (!(byte & 0x80))
+	    return 0;
+    }
+    return -1;
+}
+
+// Zigzag encoding keeps small negative numbers small.
+static unsigned long long zigzag(sqlite3_int64 value){
+    return ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63);
+}
+
+static sqlite3_int64 unzigzag(unsigned long long value){
+    return (sqlite3_int64)(value >> 1) ^ -(sqlite3_int64)(value & 1);
+}
+
+/*
+ * Where a snapshot is written, through zlib if compressing.
+ */
+struct snapshot_out {
+    FILE *file;
+    int compress;
+#ifdef HAVE_ZLIB
+    z_stream z;
+    unsigned char chunk[SNAPSHOT_CHUNK];
+#endif
+};
+
+/**
+ * Writes bytes to a snapshot.
+ *
+ * @return
+ * 0 on success, -1 on failure.
+ */
+static int out_write(struct snapshot_out *out, const void *data, size_t len){
+#ifdef HAVE_ZLIB
+    if (out->compress){
+	out->z.next_in = (Bytef *)data;
+	out->z.avail_in = (uInt)len;
+	while (out->z.avail_in){
+	    out->z.next_out = out->chunk;
+	    out->z.avail_out = sizeof(out->chunk);
+	    if (deflate(&out->z, Z_NO_FLUSH) == Z_STREAM_ERROR)
+		return -1;
+	    size_t have = sizeof(out->chunk) - out->z.avail_out;
+	    if (fwrite(out->chunk, 1, have, out->file) != have)
+		return -1;
+	}
+	return 0;
+    }
+#endif
+    return fwrite(data, 1, len, out->file) == len ? 0 : -1;
+}
+
+/**
+ * Flushes what compression is holding back, and the file.
+ *
+ * @return
+ * 0 on success, -1 on failure.
+ */
+static int out_finish(struct snapshot_out *out){
+#ifdef HAVE_ZLIB
+    if (out->compress){
+	int result;
+	do{
+	    out->z.next_out = out->chunk;
+	    out->z.avail_out = sizeof(out->chunk);
+	    result = deflate(&out->z, Z_FINISH);
+	    size_t have = sizeof(out->chunk) - out->z.avail_out;
+	    if (result == Z_STREAM_ERROR || fwrite(out->chunk, 1, have, out->file) != have)
+		return -1;
+	} while (result != Z_STREAM_END);
+    }
+#endif
+    return fflush(out->file) == 0 ? 0 : -1;
+}
+
+/*
+ * Where a snapshot is read from, through zlib if it is compressed.
+ */
+struct snapshot_in {
+    FILE *file;
+    int compress;
+#ifdef HAVE_ZLIB
+    z_stream z;
+    unsigned char chunk[SNAPSHOT_CHUNK];
+#endif
+};
+
+/**
+ * Reads exactly len bytes of a snapshot.
+ *
+ * @return
+ * 0 on success, -1 if the snapshot is cut short or cannot be read.
+ */
+static int in_read(struct snapshot_in *in, void *data, size_t len){
+#ifdef HAVE_ZLIB
+    if (in->compress){
+	in->z.next_out = data;
+	in->z.avail_out = (uInt)len;
+	while (in->z.avail_out){
+	    if (!in->z.avail_in){
+		in->z.next_in = in->chunk;
+		in->z.avail_in = (uInt)fread(in->chunk, 1, sizeof(in->chunk), in->file);
+		if (!in->z.avail_in)
+		    return -1;
+	    }
+	    int result = inflate(&in->z, Z_NO_FLUSH);
+	    if (result == Z_STREAM_END && in->z.avail_out)
+		return -1;
+	    if (result != Z_OK && result != Z_STREAM_END)
+		return -1;
+	}
+	return 0;
+    }
+#endif
+    return fread(data, 1, len, in->file) == len ? 0 : -1;
+}
+
+/**
+ * Reads a varint a byte at a time, for the few outside a group.
+ *
+ * @return
+ * 0 on success, -1 on failure.
+ */
+static int in_varint(struct snapshot_in *in, unsigned long long *value){
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7){
+	unsigned char byte;
+	if (in_read(in, &byte, 1) != 0)
+	    return -1;
+	*value |= (unsigned long long)(byte & 0x7f) << shift;
+	if (!(byte & 0x80))
+	    return 0;
+    }
+    return -1;
+}
+
+// A dictionary entry, found by its hash.
+struct dict_slot {
+    unsigned int hash;
+    // The entry's place in the dictionary plus one, or 0 for an empty slot.
+    unsigned int index;
+    // Where the string's bytes are in the dictionary.
+    size_t offset;
+    size_t len;
+};
+
+// One column of the group being written.
+struct column_out {
+    char kind;
+    byte_buf values;
+    // For text, the distinct strings and how to find them.
+    byte_buf dict;
+    unsigned int dict_count;
+    struct dict_slot *slots;
+    // For keys, the last value written.
+    sqlite3_int64 last;
+};
+
+static unsigned int hash_bytes(const unsigned char *bytes, size_t len){
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i)
+	hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+/**
+ * Adds a value from the current row to a column.
+ */
+static void add_value(struct column_out *column, sqlite3_stmt *stmt, int i){
+    if (sqlite3_column_type(stmt, i) == SQLITE_NULL){
+	put_varint(&column->values, 0);
+	return;
+    }
+    if (column->kind != 't'){
+	sqlite3_int64 value = sqlite3_column_int64(stmt, i);
+	if (column->kind == 'k'){
+	    sqlite3_int64 last = column->last;
+	    column->last = value;
+	    value -= last;
+	}
+	put_varint(&column->values, zigzag(value) + 1);
+	return;
+    }
+    const unsigned char *text = sqlite3_column_text(stmt, i);
+    size_t len = (size_t)sqlite3_column_bytes(stmt, i);
+    unsigned int hash = hash_bytes(text, len);
+    unsigned int slot = hash & (SNAPSHOT_DICT_SLOTS - 1);
+    // A group has at most half as many strings as there are slots, so there is always an empty one.
+    while (column->slots[slot].index){
+	const struct dict_slot *entry = &column->slots[slot];
+	if (entry->hash == hash && entry->len == len &&
+		(!entry->len || memcmp(column->dict.data + entry->offset, text, len) == 0)){
+	    put_varint(&column->values, entry->index);
+	    return;
+	}
+	slot = (slot + 1) & (SNAPSHOT_DICT_SLOTS - 1);
+    }
+    put_varint(&column->dict, len);
+    struct dict_slot *entry = &column->slots[slot];
+    entry->hash = hash;
+    entry->index = ++column->dict_count;
+    entry->offset = column->dict.len;
+    entry->len = len;
+    put_bytes(&column->dict, text, len);
+    put_varint(&column->values, entry->index);
+}
+
+/**
+ * Writes a group of rows, and empties the columns for the next.
+ *
+ * @return
+ * 0 on success, -1 on failure.
+ */
+static int write_group(struct snapshot_out *out, unsigned long long tag, unsigned long rows,
+	struct column_out *columns, int count){
+    // Each text column's dictionary count, which leads it.
+    byte_buf counts[SNAPSHOT_MAX_COLUMNS];
+    memset(counts, 0, sizeof(counts));
+    byte_buf head = {0, 0, 0, 0};
+    unsigned long long len = 0;
+    int failed = 0;
+    for (int i = 0; i < count; ++i){
+	struct column_out *column = &columns[i];
+	if (column->kind == 't'){
+	    put_varint(&counts[i], column->dict_count);
+	    len += counts[i].len + column->dict.len;
+	}
+	len += column->values.len;
+	failed |= counts[i].failed | column->values.failed | column->dict.failed;
+    }
+    put_varint(&head, tag);
+    put_varint(&head, rows);
+    put_varint(&head, len);
+    failed |= head.failed;
+    if (!failed)
+	failed = out_write(out, head.data, head.len) != 0;
+    for (int i = 0; i < count && !failed; ++i){
+	struct column_out *column = &columns[i];
+	if (column->kind == 't')
+	    failed = out_write(out, counts[i].data, counts[i].len) != 0 ||
+		out_write(out, column->dict.data, column->dict.len) != 0;
+	if (!failed)
+	    failed = out_write(out, column->values.data, column->values.len) != 0;
+    }
+    free(head.data);
+    for (int i = 0; i < count; ++i){
+	struct column_out *column = &columns[i];
+	free(counts[i].data);
+	column->values.len = 0;
+	column->dict.len = 0;
+	column->dict_count = 0;
+	column->last = 0;
+	if (column->slots)
+	    memset(column->slots, 0, sizeof(struct dict_slot) * SNAPSHOT_DICT_SLOTS);
+    }
+    return failed ? -1 : 0;
+}
+
+/**
+ * Adds a table's first count column names, each after prefix, separated by commas.
+ */
+static void append_columns(sqlite3_str *sql, const struct snapshot_table *info, int count, const char *prefix){
+    for (int i = 0; i < count; ++i)
+	sqlite3_str_appendf(sql, "%s%s%s", i ? ", " : "", prefix, info->columns[i]);
+}
+
+/**
+ * Adds the key of the NEW or OLD row to the statement logging a change.
+ */
+static void append_logged_key(sqlite3_str *sql, const struct snapshot_table *info, const char *row){
+    sqlite3_str_appendf(sql, "%s.%s, ", row, info->columns[0]);
+    if (info->keys > 1)
+	sqlite3_str_appendf(sql, "%s.%s", row, info->columns[1]);
+    else
+	sqlite3_str_appendall(sql, "NULL");
+}
+
+/**
+ * Makes one of a table's statements.
+ *
+ * @param table
+ * The table's place in snapshot_tables.
+ *
+ * @param kind
+ * Which statement to make.
+ *
+ * @return
+ * The SQL, to free with sqlite3_free(), or 0 if out of memory.
+ */
+static char *table_sql(size_t table, table_sql_kind kind){
+    const struct snapshot_table *info = &snapshot_tables[table];
+    int count = (int)strlen(info->kinds);
+    const char *key2 = info->keys > 1 ? ", RowKey2" : "";
+    sqlite3_str *sql = sqlite3_str_new(0);
+    switch (kind){
+    case SQL_ALL:
+    case SQL_CHANGED:
+	sqlite3_str_appendall(sql, "SELECT ");
+	append_columns(sql, info, count, "");
+	sqlite3_str_appendf(sql, " FROM %s", info->name);
+	if (kind == SQL_CHANGED){
+	    sqlite3_str_appendall(sql, " WHERE (");
+	    append_columns(sql, info, info->keys, "");
+	    sqlite3_str_appendf(sql, ") IN (SELECT RowKey%s FROM Change WHERE TableID = ?1 AND Seq > ?2)", key2);
+	}
+	sqlite3_str_appendall(sql, " ORDER BY ");
+	append_columns(sql, info, info->keys, "");
+	break;
+    case SQL_REMOVED:
+	sqlite3_str_appendf(sql, "SELECT DISTINCT RowKey%s FROM Change WHERE TableID = ?1 AND Seq > ?2"
+	    " AND NOT EXISTS (SELECT 1 FROM %s WHERE %s = RowKey", key2, info->name, info->columns[0]);
+	if (info->keys > 1)
+	    sqlite3_str_appendf(sql, " AND %s = RowKey2", info->columns[1]);
+	sqlite3_str_appendf(sql, ") ORDER BY RowKey%s", key2);
+	break;
+    case SQL_UPSERT:
+	sqlite3_str_appendf(sql, "INSERT INTO %s (", info->name);
+	append_columns(sql, info, count, "");
+	sqlite3_str_appendf(sql, "%s) VALUES (?", info->isbn_column >= 0 ? ", ISBN13" : "");
+	for (int i = 1; i < count + (info->isbn_column >= 0); ++i)
+	    sqlite3_str_appendall(sql, ", ?");
+	sqlite3_str_appendall(sql, ") ON CONFLICT (");
+	append_columns(sql, info, info->keys, "");
+	if (count > info->keys){
+	    sqlite3_str_appendall(sql, ") DO UPDATE SET ");
+	    for (int i = info->keys; i < count; ++i)
+		sqlite3_str_appendf(sql, "%s%s = excluded.%s", i > info->keys ? ", " : "", info->columns[i],
+		    info->columns[i]);
+	    if (info->isbn_column >= 0)
+		sqlite3_str_appendall(sql, ", ISBN13 = excluded.ISBN13");
+	}
+	else
+	    sqlite3_str_appendall(sql, ") DO NOTHING");
+	break;
+    case SQL_DELETE:
+	sqlite3_str_appendf(sql, "DELETE FROM %s WHERE %s = ?1", info->name, info->columns[0]);
+	if (info->keys > 1)
+	    sqlite3_str_appendf(sql, " AND %s = ?2", info->columns[1]);
+	break;
+    case SQL_TRIGGERS:
+	sqlite3_str_appendf(sql, "CREATE TRIGGER IF NOT EXISTS %sChangeInsert AFTER INSERT ON %s BEGIN"
+	    " INSERT INTO Change (TableID, RowKey, RowKey2) VALUES (%d, ", info->name, info->name, (int)table);
+	append_logged_key(sql, info, "NEW");
+	sqlite3_str_appendall(sql, "); END;");
+	// A changed key is logged under both the old key and the new one.
+	sqlite3_str_appendf(sql, "CREATE TRIGGER IF NOT EXISTS %sChangeUpdate AFTER UPDATE ON %s BEGIN"
+	    " INSERT INTO Change (TableID, RowKey, RowKey2) VALUES (%d, ", info->name, info->name, (int)table);
+	append_logged_key(sql, info, "NEW");
+	sqlite3_str_appendf(sql, "); INSERT INTO Change (TableID, RowKey, RowKey2) SELECT %d, ", (int)table);
+	append_logged_key(sql, info, "OLD");
+	sqlite3_str_appendf(sql, " WHERE OLD.%s IS NOT NEW.%s", info->columns[0], info->columns[0]);
+	if (info->keys > 1)
+	    sqlite3_str_appendf(sql, " OR OLD.%s IS NOT NEW.%s", info->columns[1], info->columns[1]);
+	sqlite3_str_appendall(sql, "; END;");
+	sqlite3_str_appendf(sql, "CREATE TRIGGER IF NOT EXISTS %sChangeDelete AFTER DELETE ON %s BEGIN"
+	    " INSERT INTO Change (TableID, RowKey, RowKey2) VALUES (%d, ", info->name, info->name, (int)table);
+	append_logged_key(sql, info, "OLD");
+	sqlite3_str_appendall(sql, "); END");
+	break;
+    }
+    return sqlite3_str_finish(sql);
+}
+
+/**
+ * Gets an integer from a query without parameters.
+ *
+ * @return
+ * The first column of the first row, or -1 on failure or if there is no row.
+ */
+static sqlite3_int64 query_int(sqlite3 *db, const char * const sql){
+    sqlite3_stmt *stmt = get_stmt(db, sql);
+    if (!stmt)
+	return -1;
+    sqlite3_int64 value = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : -1;
+    release_stmt(stmt);
+    return value;
+}
+
+// The last Seq handed out, which stays put when the log is pruned.
+#define LAST_SEQ_SQL "SELECT ifnull((SELECT seq FROM sqlite_sequence WHERE name = 'Change'), 0)"
+
+/**
+ * Sets up a database's change log: the Change table, the triggers filling it,
+ * and the ChangeState row. Safe to run again.
+ *
+ * The Seq of the last change this database has from the one it is copied from
+ * is kept in ChangeState.Applied, and the Seq up to which its own log has been
+ * pruned in ChangeState.Pruned.
+ *
+ * @param db
+ * The database to log changes to.
+ *
+ * @return
+ * 0 on success, -1 on failure.
+ */
+int create_change_log(sqlite3 *db){
+    if (!db)
+	return -1;
+    // AUTOINCREMENT, so Seq never goes back even when the whole log is pruned.
+    if (sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS Change("
+		"Seq     INTEGER PRIMARY KEY AUTOINCREMENT,"
+		"TableID INTEGER NOT NULL,"
+		"RowKey  INTEGER,"
+		"RowKey2 INTEGER);"
+	    "CREATE TABLE IF NOT EXISTS ChangeState("
+		"Applied INTEGER NOT NULL,"
+		"Pruned  INTEGER NOT NULL);"
+	    "INSERT INTO ChangeState (Applied, Pruned) SELECT 0, 0 WHERE NOT EXISTS (SELECT 1 FROM ChangeState)",
+	    0, 0, 0) != SQLITE_OK)
+	return -1;
+    for (size_t i = 0; i < SNAPSHOT_TABLES; ++i){
+	char *sql = table_sql(i, SQL_TRIGGERS);
+	int result = sql ? sqlite3_exec(db, sql, 0, 0, 0) : SQLITE_NOMEM;
+	sqlite3_free(sql);
+	if (result != SQLITE_OK)
+	    return -1;
+    }
+    return 0;
+}
+
+/**
+ * Removes changes every copy has been sent from the log.
+ *
+ * @param db
+ * The database whose log to prune.
+ *
+ * @param seq
+ * The changes up to and including this Seq are removed. Copies behind it need a whole snapshot.
+ *
+ * @return
+ * The number of changes removed, or -1 on failure.
+ */
+sqlite3_int64 prune_changes(sqlite3 *db, sqlite3_int64 seq){
+    if (!db || sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0) != SQLITE_OK)
+	return -1;
+    sqlite3_int64 removed = -1;
+    sqlite3_stmt *stmt = get_stmt(db, "DELETE FROM Change WHERE Seq <= ?");
+    if (stmt && sqlite3_bind_int64(stmt, 1, seq) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_DONE)
+	removed = sqlite3_changes(db);
+    release_stmt(stmt);
+    stmt = removed < 0 ? 0 :
+	get_stmt(db, "UPDATE ChangeState SET Pruned = max(Pruned, min(?, (" LAST_SEQ_SQL ")))");
+    if (!stmt || sqlite3_bind_int64(stmt, 1, seq) != SQLITE_OK || sqlite3_step(stmt) != SQLITE_DONE)
+	removed = -1;
+    release_stmt(stmt);
+    if (removed < 0 || sqlite3_exec(db, "COMMIT", 0, 0, 0) != SQLITE_OK){
+	sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+	return -1;
+    }
+    return removed;
+}
+
+/**
+ * Writes the rows of a query as groups.
+ *
+ * @param tag
+ * The tag for the groups.
+ *
+ * @param kinds
+ * The kind of each column, as in snapshot_table.
+ *
+ * @return
+ * The number of rows written, or -1 on failure.
+ */
+static sqlite3_int64 export_rows(struct snapshot_out *out, sqlite3_stmt *stmt, unsigned long long tag,
+	const char *kinds, int count){
+    struct column_out columns[SNAPSHOT_MAX_COLUMNS];
+    memset(columns, 0, sizeof(columns));
+    int failed = 0;
+    for (int i = 0; i < count; ++i){
+	columns[i].kind = kinds[i];
+	if (columns[i].kind == 't' && !(columns[i].slots = calloc(SNAPSHOT_DICT_SLOTS, sizeof(struct dict_slot))))
+	    failed = 1;
+    }
+    sqlite3_int64 total = 0;
+    unsigned long rows = 0;
+    int result = SQLITE_ERROR;
+    while (!failed && (result = sqlite3_step(stmt)) == SQLITE_ROW){
+	for (int i = 0; i < count; ++i)
+	    add_value(&columns[i], stmt, i);
+	++total;
+	if (++rows == SNAPSHOT_GROUP_ROWS){
+	    if (write_group(out, tag, rows, columns, count) != 0)
+		break;
+	    rows = 0;
+	}
+    }
+    if (result != SQLITE_DONE || (rows && write_group(out, tag, rows, columns, count) != 0))
+	failed = 1;
+    for (int i = 0; i < count; ++i){
+	free(columns[i].values.data);
+	free(columns[i].dict.data);
+	free(columns[i].slots);
+    }
+    return failed ? -1 : total;
+}
+
+/**
+ * Writes one table's rows: all of them, those changed since a Seq, or the keys removed since.
+ *
+ * @return
+ * The number of rows written, or -1 on failure.
+ */
+static sqlite3_int64 export_table(sqlite3 *db, struct snapshot_out *out, size_t table, table_sql_kind kind,
+	sqlite3_int64 since){
+    const struct snapshot_table *info = &snapshot_tables[table];
+    char *sql = table_sql(table, kind);
+    sqlite3_stmt *stmt = sql ? get_stmt(db, sql) : 0;
+    sqlite3_free(sql);
+    if (!stmt)
+	return -1;
+    sqlite3_int64 rows = -1;
+    if (kind == SQL_ALL || (sqlite3_bind_int(stmt, 1, (int)table) == SQLITE_OK &&
+	    sqlite3_bind_int64(stmt, 2, since) == SQLITE_OK)){
+	if (kind == SQL_REMOVED)
+	    rows = export_rows(out, stmt, SNAPSHOT_TABLES + table + 1, info->kinds, info->keys);
+	else
+	    rows = export_rows(out, stmt, table + 1, info->kinds, (int)strlen(info->kinds));
+    }
+    release_stmt(stmt);
+    return rows;
+}
+
+/**
+ * Does the work of export_snapshot() and export_changes().
+ *
+ * @param since
+ * The Seq to send the changes after, or -1 for every row.
+ */
+static sqlite3_int64 write_snapshot(sqlite3 *db, FILE *out, int compress, sqlite3_int64 since,
+	sqlite3_int64 *seq, stats_op op){
+    if (!db)
+	return -1;
+#ifndef HAVE_ZLIB
+    if (compress)
+	return -1;
+#endif
+    long long start = stats_start();
+    struct snapshot_out *sink = calloc(1, sizeof(struct snapshot_out));
+    // One read transaction, so the tables agree with each other and with the log.
+    if (!sink || sqlite3_exec(db, "BEGIN", 0, 0, 0) != SQLITE_OK){
+	free(sink);
+	stats_end(op, start, 1);
+	return -1;
+    }
+    sink->file = out;
+    sqlite3_int64 last = query_int(db, LAST_SEQ_SQL);
+    sqlite3_int64 total = last < 0 ? -1 : 0;
+    // The log must still hold every change after since, and since must be one this database gave out.
+    if (total == 0 && since >= 0){
+	sqlite3_int64 pruned = query_int(db, "SELECT Pruned FROM ChangeState");
+	if (pruned < 0)
+	    total = -1;
+	else if (since < pruned || since > last)
+	    total = -2;
+    }
+    byte_buf head = {0, 0, 0, 0};
+    if (total == 0){
+	put_bytes(&head, SNAPSHOT_MAGIC, 4);
+	put_varint(&head, SNAPSHOT_FORMAT);
+	put_varint(&head, DB_SCHEMA_VERSION);
+	put_varint(&head, (compress ? SNAPSHOT_COMPRESSED : 0) | (since >= 0 ? SNAPSHOT_CHANGES : 0));
+	put_varint(&head, since >= 0 ? (unsigned long long)since : 0);
+	put_varint(&head, (unsigned long long)last);
+	if (head.failed || out_write(sink, head.data, head.len) != 0)
+	    total = -1;
+    }
+#ifdef HAVE_ZLIB
+    if (total == 0 && compress){
+	if (deflateInit(&sink->z, Z_DEFAULT_COMPRESSION) != Z_OK)
+	    total = -1;
+	else
+	    sink->compress = 1;
+    }
+#endif
+    // Rows are added parents first, and removed children first.
+    for (size_t i = 0; i < SNAPSHOT_TABLES && total >= 0; ++i){
+	sqlite3_int64 rows = export_table(db, sink, i, since >= 0 ? SQL_CHANGED : SQL_ALL, since);
+	total = rows < 0 ? -1 : total + rows;
+    }
+    for (size_t i = SNAPSHOT_TABLES; i > 0 && since >= 0 && total >= 0; --i){
+	sqlite3_int64 rows = export_table(db, sink, i - 1, SQL_REMOVED, since);
+	total = rows < 0 ? -1 : total + rows;
+    }
+    sqlite3_exec(db, "COMMIT", 0, 0, 0);
+    if (total >= 0){
+	head.len = 0;
+	put_varint(&head, 0);
+	put_varint(&head, (unsigned long long)total);
+	if (head.failed || out_write(sink, head.data, head.len) != 0 || out_finish(sink) != 0)
+	    total = -1;
+    }
+#ifdef HAVE_ZLIB
+    if (sink->compress)
+	deflateEnd(&sink->z);
+#endif
+    free(head.data);
+    free(sink);
+    if (seq)
+	*seq = last;
+    stats_end(op, start, total < 0);
+    return total;
+}
+
+/**
+ * Writes the whole catalog as a snapshot, as of one moment.
+ *
+ * @param db
+ * The database to export. It must be at DB_SCHEMA_VERSION.
+ *
+ * @param out
+ * Where to write the snapshot. It can be a pipe.
+ *
+ * @param compress
+ * Nonzero to deflate the snapshot, which needs zlib.
+ *
+ * @param seq
+ * Where to store the Seq of the last change in the snapshot, to export changes after. May be 0.
+ *
+ * @return
+ * The number of rows written, or -1 on failure.
+ */
+sqlite3_int64 export_snapshot(sqlite3 *db, FILE *out, int compress, sqlite3_int64 *seq){
+    return write_snapshot(db, out, compress, -1, seq, STATS_EXPORT_SNAPSHOT);
+}
+
+/**
+ * Writes the rows added, changed and removed since a Seq, as of one moment.
+ * Each row is written once, as it is now, however often it changed.
+ *
+ * @param db
+ * The database to export from. It must be at DB_SCHEMA_VERSION.
+ *
+ * @param since
+ * The Seq the copy has changes up to, from its ChangeState.Applied.
+ *
+ * @param out
+ * Where to write the changes. It can be a pipe.
+ *
+ * @param compress
+ * Nonzero to deflate the changes, which needs zlib.
+ *
+ * @param seq
+ * Where to store the Seq of the last change written. May be 0.
+ *
+ * @retval >=0
+ * The number of rows and removed keys written.
+ *
+ * @retval -1
+ * Failed to write the changes.
+ *
+ * @retval -2
+ * The log no longer goes back to since, or since is later than any change,
+ * so the copy needs a whole snapshot instead.
+ */
+sqlite3_int64 export_changes(sqlite3 *db, sqlite3_int64 since, FILE *out, int compress, sqlite3_int64 *seq){
+    if (since < 0)
+	return -2;
+    return write_snapshot(db, out, compress, since, seq, STATS_EXPORT_CHANGES);
+}
+
+// One column of the group being loaded.
+struct column_in {
+    // The value of each row, or for text its place in the dictionary plus one.
+    sqlite3_int64 *values;
+    unsigned char *nulls;
+    // For text, where each string is in the group, and its length.
+    const unsigned char **dict;
+    int *dict_len;
+};
+
+/**
+ * Reads one column of a group.
+ *
+ * @return
+ * 0 on success, -1 if the group is damaged.
+ */
+static int decode_column(struct column_in *column, char kind, unsigned long rows,
+	const unsigned char **pos, const unsigned char *end){
+    unsigned long long dict_count = 0;
+    if (kind == 't'){
+	if (get_varint(pos, end, &dict_count) != 0 || dict_count > rows)
+	    return -1;
+	for (unsigned long long i = 0; i < dict_count; ++i){
+	    unsigned long long len;
+	    if (get_varint(pos, end, &len) != 0 || len > (unsigned long long)(end - *pos) || len > 0x7fffffff)
+		return -1;
+	    column->dict[i] = *pos;
+	    column->dict_len[i] = (int)len;
+	    *pos += len;
+	}
+    }
+    sqlite3_int64 last = 0;
+    for (unsigned long row = 0; row < rows; ++row){
+	unsigned long long value;
+	if (get_varint(pos, end, &value) != 0)
+	    return -1;
+	column->nulls[row] = value == 0;
+	if (kind == 't'){
+	    if (value > dict_count)
+		return -1;
+	    column->values[row] = (sqlite3_int64)value;
+	}
+	else if (value){
+	    sqlite3_int64 number = unzigzag(value - 1);
+	    if (kind == 'k')
+		number = last += number;
+	    column->values[row] = number;
+	}
+    }
+    return 0;
+}
+
+/**
+ * Adds or updates the rows of a group in their table, or removes them.
+ *
+ * @param kind
+ * SQL_UPSERT or SQL_DELETE.
+ *
+ * @return
+ * 0 on success, -1 on failure.
+ */
+static int load_group(sqlite3 *db, size_t table, table_sql_kind kind, struct column_in *columns,
+	unsigned long rows){
+    const struct snapshot_table *info = &snapshot_tables[table];
+    int count = kind == SQL_DELETE ? info->keys : (int)strlen(info->kinds);
+    char *sql = table_sql(table, kind);
+    sqlite3_stmt *stmt = sql ? get_stmt(db, sql) : 0;
+    sqlite3_free(sql);
+    if (!stmt)
+	return -1;
+    int result = SQLITE_DONE;
+    for (unsigned long row = 0; row < rows && result == SQLITE_DONE; ++row){
+	for (int i = 0; i < count; ++i){
+	    const struct column_in *column = &columns[i];
+	    if (column->nulls[row])
+		sqlite3_bind_null(stmt, i + 1);
+	    else if (info->kinds[i] == 't'){
+		sqlite3_int64 entry = column->values[row] - 1;
+		sqlite3_bind_text(stmt, i + 1, (const char *)column->dict[entry], column->dict_len[entry],
+		    SQLITE_STATIC);
+	    }
+	    else
+		sqlite3_bind_int64(stmt, i + 1, column->values[row]);
+	}
+	if (kind == SQL_UPSERT && info->isbn_column >= 0){
+	    const struct column_in *column = &columns[info->isbn_column];
+	    char isbn[32];
+	    sqlite3_int64 isbn13 = 0;
+	    if (!column->nulls[row]){
+		sqlite3_int64 entry = column->values[row] - 1;
+		if (column->dict_len[entry] < (int)sizeof(isbn)){
+		    memcpy(isbn, column->dict[entry], column->dict_len[entry]);
+		    isbn[column->dict_len[entry]] = '\0';
+		    isbn13 = isbn_normalize(isbn);
+		}
+	    }
+	    if (isbn13)
+		sqlite3_bind_int64(stmt, count + 1, isbn13);
+	    else
+		sqlite3_bind_null(stmt, count + 1);
+	}
+	result = sqlite3_step(stmt);
+	sqlite3_reset(stmt);
+    }
+    // The text is bound in place, so let go of it before the group is freed.
+    sqlite3_clear_bindings(stmt);
+    release_stmt(stmt);
+    return result == SQLITE_DONE ? 0 : -1;
+}
+
+/**
+ * Reads the groups of a snapshot into the database, up to the end mark.
+ *
+ * @return
+ * The number of rows loaded, or -1 on failure.
+ */
+static sqlite3_int64 load_groups(sqlite3 *db, struct snapshot_in *in){
+    struct column_in columns[SNAPSHOT_MAX_COLUMNS];
+    memset(columns, 0, sizeof(columns));
+    int failed = 0;
+    for (int i = 0; i < SNAPSHOT_MAX_COLUMNS && !failed; ++i){
+	columns[i].values = malloc(sizeof(sqlite3_int64) * SNAPSHOT_GROUP_ROWS);
+	columns[i].nulls = malloc(SNAPSHOT_GROUP_ROWS);
+	columns[i].dict = malloc(sizeof(const unsigned char *) * SNAPSHOT_GROUP_ROWS);
+	columns[i].dict_len = malloc(sizeof(int) * SNAPSHOT_GROUP_ROWS);
+	failed = !columns[i].values || !columns[i].nulls || !columns[i].dict || !columns[i].dict_len;
+    }
+    unsigned char *group = 0;
+    size_t group_size = 0;
+    sqlite3_int64 total = 0;
+    unsigned long long tag, rows, len;
+    while (!failed){
+	if (in_varint(in, &tag) != 0 || tag > SNAPSHOT_TABLES * 2){
+	    failed = 1;
+	    break;
+	}
+	// The end mark, and the number of rows there should have been.
+	if (!tag){
+	    failed = in_varint(in, &rows) != 0 || rows != (unsigned long long)total;
+	    break;
+	}
+	if (in_varint(in, &rows) != 0 || !rows || rows > SNAPSHOT_GROUP_ROWS || in_varint(in, &len) != 0 ||
+		len > 0x7fffffff){
+	    failed = 1;
+	    break;
+	}
+	if (len > group_size){
+	    unsigned char *grown = realloc(group, len);
+	    if (!grown){
+		failed = 1;
+		break;
+	    }
+	    group = grown;
+	    group_size = len;
+	}
+	if (in_read(in, group, len) != 0){
+	    failed = 1;
+	    break;
+	}
+	table_sql_kind kind = tag > SNAPSHOT_TABLES ? SQL_DELETE : SQL_UPSERT;
+	size_t table = (size_t)(tag - 1) % SNAPSHOT_TABLES;
+	const struct snapshot_table *info = &snapshot_tables[table];
+	int count = kind == SQL_DELETE ? info->keys : (int)strlen(info->kinds);
+	const unsigned char *pos = group, *end = group + len;
+	for (int i = 0; i < count && !failed; ++i)
+	    failed = decode_column(&columns[i], info->kinds[i], rows, &pos, end) != 0;
+	if (failed || pos != end || load_group(db, table, kind, columns, rows) != 0){
+	    failed = 1;
+	    break;
+	}
+	total += rows;
+    }
+    free(group);
+    for (int i = 0; i < SNAPSHOT_MAX_COLUMNS; ++i){
+	free(columns[i].values);
+	free(columns[i].nulls);
+	free(columns[i].dict);
+	free(columns[i].dict_len);
+    }
+    return failed ? -1 : total;
+}
+
+/**
+ * Reads a snapshot's header, and sets up decompression if it needs it.
+ *
+ * @return
+ * 0 on success, -1 if it is not a snapshot this version of the schema can load.
+ */
+static int read_header(struct snapshot_in *in, unsigned long long *flags, sqlite3_int64 *since, sqlite3_int64 *seq){
+    char magic[4];
+    unsigned long long format, version, first, last;
+    if (in_read(in, magic, 4) != 0 || memcmp(magic, SNAPSHOT_MAGIC, 4) != 0 ||
+	    in_varint(in, &format) != 0 || format != SNAPSHOT_FORMAT ||
+	    in_varint(in, &version) != 0 || version != DB_SCHEMA_VERSION ||
+	    in_varint(in, flags) != 0 || (*flags & ~(unsigned long long)(SNAPSHOT_COMPRESSED | SNAPSHOT_CHANGES)) ||
+	    in_varint(in, &first) != 0 || in_varint(in, &last) != 0 || first > last || last > LLONG_MAX)
+	return -1;
+    *since = (sqlite3_int64)first;
+    *seq = (sqlite3_int64)last;
+#ifdef HAVE_ZLIB
+    if (*flags & SNAPSHOT_COMPRESSED){
+	if (inflateInit(&in->z) != Z_OK)
+	    return -1;
+	in->compress = 1;
+    }
+    return 0;
+#else
+    return *flags & SNAPSHOT_COMPRESSED ? -1 : 0;
+#endif
+}
+
+/**
+ * Loads a snapshot into the database, within the caller's transaction.
+ *
+ * The secondary indexes and the triggers are dropped while the rows go in and
+ * made again after. FTS5 writes out what it holds at the end of every statement,
+ * so books are added to the full-text index all in one go.
+ *
+ * @return
+ * The number of rows loaded, or -1 on failure.
+ */
+static sqlite3_int64 load_snapshot(sqlite3 *db, struct snapshot_in *in){
+    // Only an empty catalog is loaded into, so the ids cannot clash.
+    if (query_int(db, "SELECT count(*) FROM (SELECT 1 FROM Book LIMIT 1)") != 0)
+	return -1;
+    sqlite3_stmt *stmt = get_stmt(db, "SELECT type, name, sql FROM sqlite_master"
+	" WHERE type IN ('index', 'trigger') AND sql IS NOT NULL");
+    if (!stmt)
+	return -1;
+    arena names;
+    arena_init(&names, 0, 0, 0);
+    const char *drop_sql[SNAPSHOT_MAX_DROPPED], *create_sql[SNAPSHOT_MAX_DROPPED];
+    int dropped = 0;
+    int result;
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW && dropped < SNAPSHOT_MAX_DROPPED){
+	char *sql = sqlite3_mprintf("DROP %s \"%w\"", (const char *)sqlite3_column_text(stmt, 0),
+	    (const char *)sqlite3_column_text(stmt, 1));
+	drop_sql[dropped] = sql ? arena_strdup(&names, sql) : 0;
+	create_sql[dropped] = arena_strdup(&names, (const char *)sqlite3_column_text(stmt, 2));
+	sqlite3_free(sql);
+	if (!drop_sql[dropped] || !create_sql[dropped])
+	    break;
+	++dropped;
+    }
+    release_stmt(stmt);
+    int failed = result != SQLITE_DONE;
+    for (int i = 0; i < dropped && !failed; ++i)
+	failed = sqlite3_exec(db, drop_sql[i], 0, 0, 0) != SQLITE_OK;
+    sqlite3_int64 total = failed ? -1 : load_groups(db, in);
+    sqlite3_int64 last;
+    if (total >= 0 && fill_fulltext(db, 0, INT_MAX, &last) < 0)
+	total = -1;
+    for (int i = 0; i < dropped && total >= 0; ++i){
+	if (sqlite3_exec(db, create_sql[i], 0, 0, 0) != SQLITE_OK)
+	    total = -1;
+    }
+    if (total >= 0)
+	analyze_sampled(db);
+    arena_free(&names);
+    return total;
+}
+
+/**
+ * Adds the books a change set added to the full-text index, once their authors
+ * and genres are in. They are found through this database's own log of the rows
+ * the change set wrote.
+ *
+ * @param since
+ * The last Seq in this database's log before the change set was loaded.
+ *
+ * @return
+ * 0 on success, -1 on failure.
+ */
+static int index_changed_books(sqlite3 *db, sqlite3_int64 since){
+    size_t book_table = 0;
+    while (strcmp(snapshot_tables[book_table].name, "Book") != 0)
+	++book_table;
+    sqlite3_stmt *stmt = get_stmt(db, "SELECT DISTINCT RowKey FROM Change WHERE TableID = ? AND Seq > ?");
+    if (!stmt)
+	return -1;
+    if (sqlite3_bind_int64(stmt, 1, (sqlite3_int64)book_table) != SQLITE_OK ||
+	    sqlite3_bind_int64(stmt, 2, since) != SQLITE_OK){
+	release_stmt(stmt);
+	return -1;
+    }
+    int result;
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW){
+	if (index_book(db, sqlite3_column_int64(stmt, 0)) != 0){
+	    result = SQLITE_ERROR;
+	    break;
+	}
+    }
+    release_stmt(stmt);
+    return result == SQLITE_DONE ? 0 : -1;
+}
+
+/**
+ * Records the Seq a database now has the changes of its source up to.
+ *
+ * @return
+ * 0 on success, -1 on failure.
+ */
+static int set_applied(sqlite3 *db, sqlite3_int64 seq){
+    sqlite3_stmt *stmt = get_stmt(db, "UPDATE ChangeState SET Applied = ?");
+    if (!stmt)
+	return -1;
+    int result = sqlite3_bind_int64(stmt, 1, seq) == SQLITE_OK ? sqlite3_step(stmt) : SQLITE_ERROR;
+    release_stmt(stmt);
+    return result == SQLITE_DONE ? 0 : -1;
+}
+
+/**
+ * Loads a snapshot from export_snapshot() into a database new_db() has just made.
+ * Nothing is kept if it fails. The rows loaded are not logged as changes.
+ *
+ * @param db
+ * The database to load into. It must not hold any books yet.
+ *
+ * @param in
+ * Where to read the snapshot from. It can be a pipe.
+ *
+ * @param seq
+ * Where to store the Seq the database now has changes up to. May be 0.
+ *
+ * @return
+ * The number of rows loaded, or -1 on failure, including when the snapshot
+ * is from another schema version or is compressed and zlib is not built in.
+ */
+sqlite3_int64 import_snapshot(sqlite3 *db, FILE *in, sqlite3_int64 *seq){
+    if (!db)
+	return -1;
+    long long start = stats_start();
+    struct snapshot_in *source = calloc(1, sizeof(struct snapshot_in));
+    if (!source){
+	stats_end(STATS_IMPORT_SNAPSHOT, start, 1);
+	return -1;
+    }
+    source->file = in;
+    unsigned long long flags;
+    sqlite3_int64 since, last;
+    int failed = read_header(source, &flags, &since, &last) != 0 || (flags & SNAPSHOT_CHANGES);
+    /*
+     * A rollback journal only holds pages that were there before, which for a
+     * new database is next to nothing, where WAL would write every page twice.
+     */
+    int wal = 0;
+    sqlite3_stmt *stmt = failed ? 0 : get_stmt(db, "PRAGMA journal_mode");
+    if (stmt){
+	wal = sqlite3_step(stmt) == SQLITE_ROW &&
+	    sqlite3_stricmp((const char *)sqlite3_column_text(stmt, 0), "wal") == 0;
+	release_stmt(stmt);
+    }
+    if (wal && sqlite3_exec(db, "PRAGMA journal_mode = DELETE", 0, 0, 0) != SQLITE_OK)
+	failed = 1;
+    sqlite3_int64 total = -1;
+    if (!failed && sqlite3_exec(db, "BEGIN", 0, 0, 0) == SQLITE_OK){
+	total = load_snapshot(db, source);
+	if (total < 0 || set_applied(db, last) != 0 || sqlite3_exec(db, "COMMIT", 0, 0, 0) != SQLITE_OK){
+	    sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+	    total = -1;
+	}
+	// The ids the cache remembers may now belong to other rows.
+	id_cache_clear(db);
+    }
+    if (wal && sqlite3_exec(db, "PRAGMA journal_mode = WAL", 0, 0, 0) != SQLITE_OK)
+	total = -1;
+#ifdef HAVE_ZLIB
+    if (source->compress)
+	inflateEnd(&source->z);
+#endif
+    free(source);
+    if (seq && total >= 0)
+	*seq = last;
+    stats_end(STATS_IMPORT_SNAPSHOT, start, total < 0);
+    return total;
+}
+
+/**
+ * Applies changes from export_changes() to a copy of the database, in one transaction.
+ * Changes already applied are skipped, so running the same changes again is harmless.
+ *
+ * @param db
+ * The copy, loaded from a snapshot of the same database and kept up to date
+ * with its changes since.
+ *
+ * @param in
+ * Where to read the changes from. It can be a pipe.
+ *
+ * @param seq
+ * Where to store the Seq the copy now has changes up to. May be 0.
+ *
+ * @retval >=0
+ * The number of rows and removed keys applied, 0 if the copy already had them.
+ *
+ * @retval -1
+ * Failed to apply the changes. The copy is as it was.
+ *
+ * @retval -2
+ * The changes start after the copy's last change, so some are missing.
+ */
+sqlite3_int64 apply_changes(sqlite3 *db, FILE *in, sqlite3_int64 *seq){
+    if (!db)
+	return -1;
+    long long start = stats_start();
+    struct snapshot_in *source = calloc(1, sizeof(struct snapshot_in));
+    if (!source){
+	stats_end(STATS_APPLY_CHANGES, start, 1);
+	return -1;
+    }
+    source->file = in;
+    unsigned long long flags;
+    sqlite3_int64 since, last, applied = -1;
+    sqlite3_int64 total = -1;
+    if (read_header(source, &flags, &since, &last) == 0 && (flags & SNAPSHOT_CHANGES) &&
+	    sqlite3_exec(db, "BEGIN IMMEDIATE", 0, 0, 0) == SQLITE_OK){
+	applied = query_int(db, "SELECT Applied FROM ChangeState");
+	if (applied < 0)
+	    total = -1;
+	else if (since > applied)
+	    total = -2;
+	else if (last <= applied)
+	    total = 0;
+	else{
+	    sqlite3_int64 logged = query_int(db, LAST_SEQ_SQL);
+	    if (logged < 0 || (total = load_groups(db, source)) < 0 ||
+		    index_changed_books(db, logged) != 0 || set_applied(db, last) != 0)
+		total = -1;
+	}
+	if (total <= 0 || sqlite3_exec(db, "COMMIT", 0, 0, 0) != SQLITE_OK){
+	    sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+	    if (total > 0)
+		total = -1;
+	}
+	else
+	    applied = last;
+	// The ids the cache remembers may have been removed or changed.
+	id_cache_clear(db);
+    }
+#ifdef HAVE_ZLIB
+    if (source->compress)
+	inflateEnd(&source->z);
+#endif
+    free(source);
+    if (seq && applied >= 0)
+	*seq = applied;
+    stats_end(STATS_APPLY_CHANGES, start, total < 0);
+    return total;
+}
@@ -0,0 +1,523 @@
+/*
+    BookDBLite, a book database management solution using SQLite.
+    Copyright (C) 2015-2016  SilverNexus
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/**
+ * @file stmt_cache.c
+ * Keeps prepared statements around for the life of a database connection,
+ * so each query is only parsed and planned once.
+ *
+ * Each cached statement's runs are counted by SQLite, for db_stats().
+ * Its rows and time take a trace callback per row, so they are only counted
+ * once stmt_cache_trace() turns tracing on.
+ *
+ * Compound searches prepare a statement for each combination of terms used,
+ * so the cache is capped, and the statement used longest ago makes way.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <sqlite3.h>
+#include "db_access.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Starting number of slots in a connection's cache. Must be a power of two.
+#define STMT_CACHE_INITIAL_SIZE 32
+
+// Most statements kept for a connection. Past this, the least recently used goes.
+#define STMT_CACHE_MAX 256
+
+struct cached_stmt {
+    char *sql;
+    unsigned long hash;
+    sqlite3_stmt *stmt;
+    unsigned long rows;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    // When the current run started, in nanoseconds.
+    long long started;
+    // Held by an open search cursor, so other cursors must not reset it.
+    int claimed;
+    // The cache's clock when the statement was last handed out.
+    unsigned long last_used;
+};
+
+struct stmt_cache {
+    sqlite3 *db;
+    struct cached_stmt *slots;
+    unsigned int size;
+    unsigned int used;
+    unsigned long hits;
+    unsigned long misses;
+    // Ticks once per lookup, to find the least recently used statement.
+    unsigned long clock;
+    // The slot the trace callback found last, since rows come in runs from one statement.
+    struct cached_stmt *traced;
+    struct stmt_cache *next;
+};
+
+// One cache per open connection.
+// Connections can be on different threads, so the list is locked.
+// A cache itself is only used by the thread using its connection.
+static struct stmt_cache *caches = 0;
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set by stmt_cache_trace(). Guarded by caches_lock.
+static int tracing = 0;
+
+/**
+ * FNV-1a hash of the SQL text.
+ */
+static unsigned long hash_sql(const char *sql){
+    unsigned long hash = 2166136261UL;
+    while (*sql){
+	hash ^= (unsigned char)*sql++;
+	hash *= 16777619UL;
+    }
+    return hash;
+}
+
+/**
+ * Finds the slot holding a statement, for the trace callback.
+ *
+ * @return
+ * The slot, or 0 if the statement is not cached, e.g. one run by sqlite3_exec().
+ */
+static struct cached_stmt *find_slot(struct stmt_cache *cache, sqlite3_stmt *stmt){
+    if (cache->traced && cache->traced->stmt == stmt)
+	return cache->traced;
+    const char *sql = sqlite3_sql(stmt);
+    if (!sql)
+	return 0;
+    unsigned int pos = hash_sql(sql) & (cache->size - 1);
+    while (cache->slots[pos].sql){
+	if (cache->slots[pos].stmt == stmt)
+	    return cache->traced = &cache->slots[pos];
+	pos = (pos + 1) & (cache->size - 1);
+    }
+    return 0;
+}
+
+/**
+ * The monotonic clock, in nanoseconds.
+ */
+static long long now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Counts rows and time for cached statements. SQLite calls this when a
+ * statement starts running, for each row it gives, and once the run ends.
+ * The run is timed here, since SQLite's own profile time is only to the millisecond.
+ */
+static int trace_stmt(unsigned int type, void *data, void *stmt, void *detail){
+    struct cached_stmt *slot = find_slot(data, stmt);
+    if (!slot)
+	return 0;
+    if (type == SQLITE_TRACE_ROW)
+	++slot->rows;
+    else if (type == SQLITE_TRACE_STMT){
+	// Triggers the statement fires are reported too, as comments.
+	const char *text = detail;
+	if (!text || text[0] != '-' || text[1] != '-')
+	    slot->started = now_ns();
+    }
+    else if (type == SQLITE_TRACE_PROFILE && slot->started){
+	unsigned long long ns = now_ns() - slot->started;
+	slot->started = 0;
+	slot->total_ns += ns;
+	if (ns > slot->max_ns)
+	    slot->max_ns = ns;
+    }
+    return 0;
+}
+
+/**
+ * Finds the cache belonging to a connection.
+ *
+ * @param db
+ * The connection to look for.
+ *
+ * @param create
+ * If nonzero, make a new cache when none exists.
+ *
+ * @return
+ * The cache, or 0 if it does not exist and could not be created.
+ */
+static struct stmt_cache *find_cache(sqlite3 *db, int create){
+    struct stmt_cache *cache;
+    pthread_mutex_lock(&caches_lock);
+    for (cache = caches; cache; cache = cache->next){
+	if (cache->db == db)
+	    break;
+    }
+    if (!cache && create && (cache = calloc(1, sizeof(struct stmt_cache)))){
+	cache->slots = calloc(STMT_CACHE_INITIAL_SIZE, sizeof(struct cached_stmt));
+	if (cache->slots){
+	    cache->db = db;
+	    cache->size = STMT_CACHE_INITIAL_SIZE;
+	    cache->next = caches;
+	    caches = cache;
+	    if (tracing)
+		sqlite3_trace_v2(db, SQLITE_TRACE_STMT | SQLITE_TRACE_ROW | SQLITE_TRACE_PROFILE, trace_stmt, cache);
+	}
+	else{
+	    free(cache);
+	    cache = 0;
+	}
+    }
+    pthread_mutex_unlock(&caches_lock);
+    return cache;
+}
+
+/**
+ * Doubles the number of slots in a cache and rehashes the entries.
+ *
+ * @retval 0
+ * Cache grown successfully
+ *
+ * @retval -1
+ * Out of memory; the cache is left unchanged
+ */
+static int grow_cache(struct stmt_cache *cache){
+    unsigned int new_size = cache->size * 2;
+    struct cached_stmt *new_slots = calloc(new_size, sizeof(struct cached_stmt));
+    if (!new_slots)
+	return -1;
+    for (unsigned int i = 0; i < cache->size; ++i){
+	if (!cache->slots[i].sql)
+	    continue;
+	unsigned int pos = cache->slots[i].hash & (new_size - 1);
+	while (new_slots[pos].sql)
+	    pos = (pos + 1) & (new_size - 1);
+	new_slots[pos] = cache->slots[i];
+    }
+    free(cache->slots);
+    cache->slots = new_slots;
+    cache->size = new_size;
+    cache->traced = 0;
+    return 0;
+}
+
+/**
+ * Finds the slot caching the statement for some SQL text.
+ *
+ * @return
+ * The slot, or 0 if the text has not been prepared yet.
+ */
+static struct cached_stmt *find_sql(struct stmt_cache *cache, const char * const sql, unsigned long hash){
+    unsigned int pos = hash & (cache->size - 1);
+    while (cache->slots[pos].sql){
+	if (cache->slots[pos].hash == hash && strcmp(cache->slots[pos].sql, sql) == 0)
+	    return &cache->slots[pos];
+	pos = (pos + 1) & (cache->size - 1);
+    }
+    return 0;
+}
+
+/**
+ * Finalizes the least recently used statement, to make room for another.
+ * Statements that are running or held by a cursor are skipped.
+ *
+ * @retval 0
+ * A statement was dropped.
+ *
+ * @retval -1
+ * Every statement is in use.
+ */
+static int evict_stmt(struct stmt_cache *cache){
+    unsigned int mask = cache->size - 1;
+    unsigned int oldest = cache->size;
+    for (unsigned int i = 0; i < cache->size; ++i){
+	struct cached_stmt *slot = &cache->slots[i];
+	if (slot->sql && !slot->claimed && !sqlite3_stmt_busy(slot->stmt) &&
+		(oldest == cache->size || slot->last_used < cache->slots[oldest].last_used))
+	    oldest = i;
+    }
+    if (oldest == cache->size)
+	return -1;
+    sqlite3_finalize(cache->slots[oldest].stmt);
+    free(cache->slots[oldest].sql);
+    memset(&cache->slots[oldest], 0, sizeof(struct cached_stmt));
+    // Move later entries of the probe run back, so lookups still find them.
+    unsigned int hole = oldest;
+    for (unsigned int pos = (hole + 1) & mask; cache->slots[pos].sql; pos = (pos + 1) & mask){
+	unsigned int home = cache->slots[pos].hash & mask;
+	// Only an entry whose home is not between the hole and itself may fill the hole.
+	if (((pos - home) & mask) >= ((pos - hole) & mask)){
+	    cache->slots[hole] = cache->slots[pos];
+	    memset(&cache->slots[pos], 0, sizeof(struct cached_stmt));
+	    hole = pos;
+	}
+    }
+    --cache->used;
+    cache->traced = 0;
+    return 0;
+}
+
+/**
+ * Gets a ready-to-bind statement for the given SQL text.
+ * The statement is prepared on first use and reset on every later use.
+ * Once STMT_CACHE_MAX statements are cached, the least recently used
+ * one not in use is finalized to make room.
+ *
+ * @param db
+ * The connection to prepare the statement on
+ *
+ * @param sql
+ * The SQL text. The same text always maps to the same statement.
+ *
+ * @return
+ * The statement, or 0 if it could not be prepared.
+ *
+ * @note The statement belongs to the cache. Callers hand it back with
+ * release_stmt() and must never finalize it themselves.
+ */
+sqlite3_stmt *get_stmt(sqlite3 *db, const char * const sql){
+    if (!db)
+	return 0;
+    struct stmt_cache *cache = find_cache(db, 1);
+    if (!cache)
+	return 0;
+    unsigned long hash = hash_sql(sql);
+    struct cached_stmt *slot = find_sql(cache, sql, hash);
+    if (slot){
+	++cache->hits;
+	slot->last_used = ++cache->clock;
+	sqlite3_reset(slot->stmt);
+	sqlite3_clear_bindings(slot->stmt);
+	return slot->stmt;
+    }
+    // Not cached yet, so prepare it.
+    ++cache->misses;
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK)
+	return 0;
+    // When every statement is in use, the cache goes over its cap for now.
+    if (cache->used >= STMT_CACHE_MAX)
+	evict_stmt(cache);
+    // Keep the load factor under 3/4 so probing stays short.
+    if ((cache->used + 1) * 4 > cache->size * 3){
+	if (grow_cache(cache) != 0){
+	    sqlite3_finalize(stmt);
+	    return 0;
+	}
+    }
+    unsigned int pos = hash & (cache->size - 1);
+    while (cache->slots[pos].sql)
+	pos = (pos + 1) & (cache->size - 1);
+    char *copy = strdup(sql);
+    if (!copy){
+	sqlite3_finalize(stmt);
+	return 0;
+    }
+    cache->slots[pos].sql = copy;
+    cache->slots[pos].hash = hash;
+    cache->slots[pos].stmt = stmt;
+    cache->slots[pos].last_used = ++cache->clock;
+    ++cache->used;
+    return stmt;
+}
+
+/**
+ * Hands a statement back to the cache once the caller is done with it.
+ * Resetting here releases any read lock the statement still holds.
+ *
+ * @param stmt
+ * A statement obtained from get_stmt(). May be 0.
+ */
+void release_stmt(sqlite3_stmt *stmt){
+    if (stmt)
+	sqlite3_reset(stmt);
+}
+
+/**
+ * Gets a statement for a search cursor, which keeps it until the cursor is closed.
+ * The cached statement is used unless another cursor already holds it,
+ * since get_stmt() would reset that cursor and rebind it under its reader.
+ * Then this cursor gets a statement of its own instead.
+ *
+ * @param db
+ * The connection to prepare the statement on
+ *
+ * @param sql
+ * The SQL text.
+ *
+ * @return
+ * The statement, or 0 if it could not be prepared.
+ *
+ * @note Hand the statement back with release_cursor_stmt(), never release_stmt().
+ */
+sqlite3_stmt *get_cursor_stmt(sqlite3 *db, const char * const sql){
+    if (!db)
+	return 0;
+    struct stmt_cache *cache = find_cache(db, 1);
+    if (!cache)
+	return 0;
+    struct cached_stmt *slot = find_sql(cache, sql, hash_sql(sql));
+    if (slot && (slot->claimed || sqlite3_stmt_busy(slot->stmt))){
+	++cache->misses;
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, 0) != SQLITE_OK)
+	    return 0;
+	return stmt;
+    }
+    sqlite3_stmt *stmt = get_stmt(db, sql);
+    // Looked up again, since preparing it may have moved the slots.
+    if (stmt && (slot = find_slot(cache, stmt)))
+	slot->claimed = 1;
+    return stmt;
+}
+
+/**
+ * Hands back a statement from get_cursor_stmt(). The cached statement is reset
+ * for the next cursor, and one the cursor had to itself is finalized.
+ *
+ * @param stmt
+ * A statement obtained from get_cursor_stmt(). May be 0.
+ */
+void release_cursor_stmt(sqlite3_stmt *stmt){
+    if (!stmt)
+	return;
+    struct stmt_cache *cache = find_cache(sqlite3_db_handle(stmt), 0);
+    struct cached_stmt *slot = cache ? find_slot(cache, stmt) : 0;
+    if (slot){
+	slot->claimed = 0;
+	sqlite3_reset(stmt);
+    }
+    else
+	sqlite3_finalize(stmt);
+}
+
+/**
+ * Finalizes every cached statement for a connection and drops its cache.
+ * Must be called before the connection is closed.
+ *
+ * @param db
+ * The connection whose statements should be finalized.
+ */
+void finalize_stmts(sqlite3 *db){
+    struct stmt_cache *cache;
+    pthread_mutex_lock(&caches_lock);
+    for (struct stmt_cache **prev = &caches; (cache = *prev); prev = &cache->next){
+	if (cache->db == db){
+	    *prev = cache->next;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&caches_lock);
+    if (!cache)
+	return;
+    sqlite3_trace_v2(db, 0, 0, 0);
+    for (unsigned int i = 0; i < cache->size; ++i){
+	if (cache->slots[i].sql){
+	    sqlite3_finalize(cache->slots[i].stmt);
+	    free(cache->slots[i].sql);
+	}
+    }
+    free(cache->slots);
+    free(cache);
+}
+
+/**
+ * Turns counting the rows and time of each cached statement on or off,
+ * for every connection. Off by default, since it costs a callback per row.
+ *
+ * @param on
+ * Nonzero to count them.
+ */
+void stmt_cache_trace(int on){
+    pthread_mutex_lock(&caches_lock);
+    tracing = on;
+    for (struct stmt_cache *cache = caches; cache; cache = cache->next){
+	if (on)
+	    sqlite3_trace_v2(cache->db, SQLITE_TRACE_STMT | SQLITE_TRACE_ROW | SQLITE_TRACE_PROFILE,
+		trace_stmt, cache);
+	else
+	    sqlite3_trace_v2(cache->db, 0, 0, 0);
+    }
+    pthread_mutex_unlock(&caches_lock);
+}
+
+/**
+ * Reports how often the cache for a connection avoided preparing a statement.
+ *
+ * @param db
+ * The connection to report on.
+ *
+ * @param hits
+ * Where to store the number of lookups that reused a prepared statement.
+ *
+ * @param misses
+ * Where to store the number of lookups that had to prepare the statement.
+ */
+void stmt_cache_stats(sqlite3 *db, unsigned long *hits, unsigned long *misses){
+    struct stmt_cache *cache = find_cache(db, 0);
+    *hits = cache ? cache->hits : 0;
+    *misses = cache ? cache->misses : 0;
+}
+
+/**
+ * Gets the counts for each statement cached for a connection.
+ * Rows and times come from the trace callbacks, and are 0 unless
+ * stmt_cache_trace() is on. The rest come from sqlite3_stmt_status(),
+ * so they cover the statement's whole life.
+ *
+ * @param db
+ * The connection to report on.
+ *
+ * @param stats
+ * Where to store the counts, or 0 to only count the statements.
+ *
+ * @param max
+ * The room in stats.
+ *
+ * @return
+ * The number of statements filled in, or cached if stats is 0.
+ *
+ * @note The sql of each entry belongs to the cache, and is only valid until
+ * the connection is closed.
+ */
+int stmt_cache_each(sqlite3 *db, stmt_stats *stats, int max){
+    struct stmt_cache *cache = find_cache(db, 0);
+    if (!cache)
+	return 0;
+    if (!stats)
+	return (int)cache->used;
+    int count = 0;
+    for (unsigned int i = 0; i < cache->size && count < max; ++i){
+	struct cached_stmt *slot = &cache->slots[i];
+	if (!slot->sql)
+	    continue;
+	stmt_stats *entry = &stats[count++];
+	entry->sql = slot->sql;
+	entry->runs = (unsigned long)sqlite3_stmt_status(slot->stmt, SQLITE_STMTSTATUS_RUN, 0);
+	entry->rows = slot->rows;
+	entry->total_ns = slot->total_ns;
+	entry->max_ns = slot->max_ns;
+	entry->fullscan_steps = sqlite3_stmt_status(slot->stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0);
+	entry->sorts = sqlite3_stmt_status(slot->stmt, SQLITE_STMTSTATUS_SORT, 0);
+	entry->autoindexes = sqlite3_stmt_status(slot->stmt, SQLITE_STMTSTATUS_AUTOINDEX, 0);
+	entry->vm_steps = sqlite3_stmt_status(slot->stmt, SQLITE_STMTSTATUS_VM_STEP, 0);
+    }
+    return count;
+}